@@ -0,0 +1,131 @@
+/*
+
+file    :  bench/bench_load.cpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+exeptor-bench-load - compare per-process load time and RSS of short-lived
+processes started with different libexeptor builds in LD_PRELOAD.
+each process runs a command that execs something not found in config, which
+is what most processes of a real build do
+
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Result {
+  double usec_per_process;
+  double avg_maxrss_kb;
+};
+
+static double now_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool run_batch(const char *preload, const char *config, int iterations,
+                      char *const command[], Result &res) {
+  std::string preload_env = std::string("LD_PRELOAD=") + preload;
+  std::string config_env = std::string("EXEPTOR_CONFIG=") + config;
+
+  std::vector<char *> envp;
+  if (preload[0]) {
+    envp.push_back(const_cast<char *>(preload_env.c_str()));
+  }
+  envp.push_back(const_cast<char *>(config_env.c_str()));
+  envp.push_back(const_cast<char *>("PATH=/usr/bin:/bin"));
+  envp.push_back(nullptr);
+
+  double total_rss = 0;
+  double start = now_usec();
+
+  for (int i = 0; i < iterations; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return false;
+    }
+    if (pid == 0) {
+      execve(command[0], command, envp.data());
+      _exit(127);
+    }
+
+    int status = 0;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "command failed with LD_PRELOAD='%s'\n", preload);
+      return false;
+    }
+    total_rss += ru.ru_maxrss;
+  }
+
+  res.usec_per_process = (now_usec() - start) / iterations;
+  res.avg_maxrss_kb = total_rss / iterations;
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = 500;
+  int i = 1;
+  if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+    iterations = atoi(argv[i + 1]);
+    i += 2;
+  }
+
+  if (argc - i < 2 || iterations <= 0) {
+    printf("%s - compare process startup cost with different libexeptor "
+           "builds\n",
+           argv[0]);
+    printf("Run it like this: %s [-n iterations] /abs/path/config.yaml "
+           "/abs/path/libexeptor.so [/abs/path/libexeptor-lean.so ...] "
+           "[-- command args]\n",
+           argv[0]);
+    printf("Lean libexeptor needs snapshot made by exeptor-compile-config\n");
+    return argc - i < 2 ? 0 : 1;
+  }
+
+  const char *config = argv[i++];
+
+  std::vector<const char *> libs = {""}; // baseline without LD_PRELOAD
+  while (i < argc && strcmp(argv[i], "--") != 0) {
+    libs.push_back(argv[i++]);
+  }
+
+  std::vector<char *> command;
+  if (i < argc) {
+    for (i++; i < argc; i++) {
+      command.push_back(argv[i]);
+    }
+  }
+  if (command.empty()) {
+    // shell execs the only command it was given, so exec hooks get called
+    command = {const_cast<char *>("/bin/sh"), const_cast<char *>("-c"),
+               const_cast<char *>("/bin/true")};
+  }
+  command.push_back(nullptr);
+
+  printf("%-60s %14s %14s\n", "LD_PRELOAD", "usec/process", "maxrss KiB");
+  for (auto lib : libs) {
+    Result res;
+    if (!run_batch(lib, config, iterations, command.data(), res)) {
+      return 1;
+    }
+    printf("%-60s %14.1f %14.1f\n", lib[0] ? lib : "(none)",
+           res.usec_per_process, res.avg_maxrss_kb);
+  }
+
+  return 0;
+}
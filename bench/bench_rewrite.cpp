@@ -0,0 +1,161 @@
+/*
+
+file    :  bench/bench_rewrite.cpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+exeptor-bench-rewrite - measure argv rewriting of huge linker and ar command
+lines (10k objects is common for LLVM-based builds). rewrite plans from
+config snapshot are compared with the old approach: std::set lookups of
+std::string and std::vector::erase for every deleted option
+
+*/
+
+#include "../src/exeptor.cpp"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+static double now_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+struct Invocation {
+  const char *title;
+  std::vector<std::string> storage;
+  std::vector<const char *> argv; // NULL-terminated
+};
+
+// deleted options are spread over the whole command line, like repeated
+// -Wl,... flags coming from pkg-config and CMake generator expressions
+static Invocation make_invocation(const char *title, const char *prog,
+                                  const std::vector<std::string> &head,
+                                  const char *object_fmt, int objects,
+                                  const std::vector<std::string> &to_delete) {
+  Invocation inv;
+  inv.title = title;
+  inv.storage.push_back(prog);
+  inv.storage.insert(inv.storage.end(), head.begin(), head.end());
+  char buf[64];
+  for (int i = 0; i < objects; i++) {
+    snprintf(buf, sizeof(buf), object_fmt, i);
+    inv.storage.push_back(buf);
+    if (!to_delete.empty() && i % 50 == 0) {
+      inv.storage.push_back(to_delete[(i / 50) % to_delete.size()]);
+    }
+  }
+  for (const auto &arg : inv.storage) {
+    inv.argv.push_back(arg.c_str());
+  }
+  inv.argv.push_back(nullptr);
+  return inv;
+}
+
+// how prep_prog_argv used to work
+static size_t rewrite_old(const Invocation &inv, const std::string &repl,
+                          const std::set<std::string> &del_opts,
+                          const std::vector<std::string> &add_opts) {
+  std::vector<const char *> args(inv.argv.begin(), inv.argv.end() - 1);
+  args[0] = repl.c_str();
+  for (auto it = args.begin() + 1; it != args.end();) {
+    if (del_opts.find(*it) != del_opts.end()) {
+      it = args.erase(it);
+    } else {
+      it++;
+    }
+  }
+  for (auto &opt : add_opts) {
+    args.push_back(opt.c_str());
+  }
+  args.push_back(nullptr);
+  return args.size();
+}
+
+static size_t rewrite_plan(const Invocation &inv) {
+  ArgList args;
+  args_from_argv_envp(args, inv.argv.data());
+  const char *prog = inv.argv[0];
+  prep_prog_argv(prog, args);
+  return args.size + 1;
+}
+
+template <typename func_t>
+static double usec_per_call(int iterations, size_t &result, func_t func) {
+  double start = now_usec();
+  for (int i = 0; i < iterations; i++) {
+    result += func();
+  }
+  return (now_usec() - start) / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  int iterations = 200;
+  if (argc == 3 && strcmp(argv[1], "-n") == 0) {
+    iterations = atoi(argv[2]);
+  }
+  if (iterations <= 0) {
+    printf("Run it like this: %s [-n iterations]\n", argv[0]);
+    return 1;
+  }
+
+  const std::vector<std::string> ld_del = {
+      "-Wl,--fatal-warnings", "-Wl,-z,defs", "-s", "-Wl,--strip-all",
+      "-Wl,-O2"};
+  const std::vector<std::string> ld_add = {"-fsanitize=address", "-g"};
+  const std::vector<std::string> ar_del = {"D", "--plugin=LLVMgold.so"};
+
+  ReplacementSettings settings;
+  auto linkers = settings.add_group("linkers");
+  settings.programs["c++"] = {"afl-clang-fast++", linkers};
+  settings.groups[linkers].del_options = ld_del;
+  settings.groups[linkers].add_options = ld_add;
+  auto archivers = settings.add_group("archivers");
+  settings.programs["ar"] = {"llvm-ar", archivers};
+  settings.groups[archivers].del_options = ar_del;
+  if (!apply_settings(settings)) {
+    fprintf(stderr, "failed to build config snapshot\n");
+    return 1;
+  }
+
+  std::vector<Invocation> invocations;
+  invocations.push_back(make_invocation(
+      "c++ -o app <10k objects>", "c++", {"-o", "app", "-fuse-ld=lld"},
+      "lib/CodeGen/CMakeFiles/obj.dir/File%05d.cpp.o", 10000, ld_del));
+  invocations.push_back(make_invocation(
+      "ar qc libbig.a <10k members>", "ar", {"qc", "libbig.a"},
+      "lib/Support/CMakeFiles/obj.dir/Member%05d.cpp.o", 10000, ar_del));
+
+  printf("%-32s %10s %16s %16s\n", "command line", "args", "old usec/call",
+         "plan usec/call");
+  size_t sink = 0;
+  for (const auto &inv : invocations) {
+    const auto &prog = settings.programs[inv.argv[0]];
+    const auto &group = settings.groups[prog.group];
+    std::set<std::string> del_set(group.del_options.begin(),
+                                  group.del_options.end());
+
+    size_t old_size = 0, plan_size = 0;
+    double old_usec = usec_per_call(iterations, old_size, [&]() {
+      return rewrite_old(inv, prog.path, del_set, group.add_options);
+    });
+    double plan_usec = usec_per_call(iterations, plan_size,
+                                     [&]() { return rewrite_plan(inv); });
+    if (old_size != plan_size) {
+      fprintf(stderr, "results differ for '%s'\n", inv.title);
+      return 1;
+    }
+    sink += plan_size;
+
+    printf("%-32s %10zu %16.1f %16.1f\n", inv.title, inv.argv.size() - 1,
+           old_usec, plan_usec);
+  }
+
+  return sink ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+/*
+
+file    :  include/exeptor-plugin.h
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+C interface of libexeptor plugins: shared objects named by "plugin" setting
+of a group. they rewrite command lines of replaced programs in-process, so
+logic yaml can't express doesn't need a wrapper script exec'ed for every
+compiler run.
+
+plugin exports EXEPTOR_PLUGIN_HOOK function of exeptor_plugin_rewrite_t type.
+libexeptor dlopen's plugins once per process while it loads config, then the
+hook gets called for every replaced exec of the group, after options of the
+group are applied and before the replacement runs. hook edits the lists in
+place, they are views of what is going to be passed to exec, nothing gets
+copied for it.
+
+the hook may run in a vfork child (posix_spawn, GNU make), so it must not
+call malloc, take locks or use stdio. strings it puts into the lists must
+stay alive until exec: string literals, strings already in the lists or text
+written to scratch.
+
+*/
+
+#ifndef EXEPTOR_PLUGIN_H
+#define EXEPTOR_PLUGIN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EXEPTOR_PLUGIN_API 1
+#define EXEPTOR_PLUGIN_HOOK "exeptor_plugin_rewrite"
+
+/* NULL-terminated list of strings. items may be reordered, replaced, removed
+   or added (up to capacity, terminating NULL doesn't count), size must be
+   updated accordingly. items pointer itself must not change */
+struct exeptor_plugin_list {
+  const char **items;
+  size_t size;
+  size_t capacity;
+};
+
+struct exeptor_plugin_call {
+  unsigned api;          /* EXEPTOR_PLUGIN_API */
+  const char *group;     /* name of group in config */
+  const char *original;  /* program application wanted to run */
+  const char *program;   /* replacement to run, may be changed */
+  struct exeptor_plugin_list argv;
+  struct exeptor_plugin_list envp; /* items are NULL if caller's environment
+                                      can't be changed */
+  char *scratch;         /* room for new strings, lives until exec */
+  size_t scratch_size;
+};
+
+typedef void (*exeptor_plugin_rewrite_t)(struct exeptor_plugin_call *call);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXEPTOR_PLUGIN_H */
@@ -0,0 +1,171 @@
+/*
+
+file    :  src/action.hpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+what compiler driver (gcc, clang and their wrappers) is asked to do, found
+in one pass over its argv. add-options may be scoped to these action classes,
+so e.g. -fsanitize=address doesn't slow down -E runs and dependency scans
+
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+enum ActionClass : uint32_t {
+  ACTION_PREPROCESS = 1, // -E, -M and -MM
+  ACTION_COMPILE = 2,    // source files get compiled
+  ACTION_ASSEMBLE = 4,   // assembly files get assembled
+  ACTION_LINK = 8,
+  ACTION_QUERY = 16, // --version, -print-*, no inputs at all
+};
+
+#define EXEPTOR_ACTIONS_ALL 31u
+
+// class by its name in config, 0 if there is no such class
+inline uint32_t action_by_name(const char *name) {
+  static const struct {
+    const char *name;
+    uint32_t actions;
+  } names[] = {
+      {"all", EXEPTOR_ACTIONS_ALL}, {"preprocess", ACTION_PREPROCESS},
+      {"compile", ACTION_COMPILE},  {"assemble", ACTION_ASSEMBLE},
+      {"link", ACTION_LINK},        {"query", ACTION_QUERY},
+  };
+  for (const auto &n : names) {
+    if (strcmp(name, n.name) == 0) {
+      return n.actions;
+    }
+  }
+  return 0;
+}
+
+enum InputKind { INPUT_OTHER, INPUT_SOURCE, INPUT_ASM };
+
+// language given by -x, INPUT_OTHER for "none" (extension decides)
+inline InputKind input_kind_of_language(const char *lang) {
+  if (strcmp(lang, "none") == 0) {
+    return INPUT_OTHER;
+  }
+  if (strcmp(lang, "assembler") == 0 ||
+      strcmp(lang, "assembler-with-cpp") == 0) {
+    return INPUT_ASM;
+  }
+  return INPUT_SOURCE;
+}
+
+// objects, libraries and unknown files are left for linker
+inline InputKind input_kind_of_file(const char *path) {
+  if (strcmp(path, "-") == 0) {
+    return INPUT_SOURCE;
+  }
+  const char *dot = strrchr(path, '.');
+  if (!dot || strchr(dot, '/')) {
+    return INPUT_OTHER;
+  }
+
+  static const char *const asm_exts[] = {"s", "S", "sx", "asm"};
+  static const char *const source_exts[] = {
+      "c",   "i",   "ii",  "cc",  "cp",  "cxx", "cpp", "CPP", "c++", "C",
+      "m",   "mi",  "mm",  "M",   "mii", "h",   "hh",  "hpp", "hxx", "H",
+      "tcc", "f",   "for", "ftn", "F",   "FOR", "f90", "f95", "f03", "f08",
+      "F90", "F95", "F03", "F08", "cu",  "hip", "cl",  "d",   "go",  "ads",
+      "adb",
+  };
+  for (const char *ext : asm_exts) {
+    if (strcmp(dot + 1, ext) == 0) {
+      return INPUT_ASM;
+    }
+  }
+  for (const char *ext : source_exts) {
+    if (strcmp(dot + 1, ext) == 0) {
+      return INPUT_SOURCE;
+    }
+  }
+  return INPUT_OTHER;
+}
+
+// options which make driver print something and exit
+inline bool is_query_option(const char *arg) {
+  return strcmp(arg, "--version") == 0 || strcmp(arg, "-dumpversion") == 0 ||
+         strcmp(arg, "-dumpfullversion") == 0 ||
+         strcmp(arg, "-dumpmachine") == 0 || strcmp(arg, "-dumpspecs") == 0 ||
+         strncmp(arg, "-print-", 7) == 0 || strncmp(arg, "--print-", 8) == 0 ||
+         strncmp(arg, "--help", 6) == 0;
+}
+
+// action classes of driver invocation, argv[0] is skipped. takes_value
+// tells which options take value from the next argument, so values like
+// "-o out.c" are not mistaken for inputs. response files count as inputs
+// for linker
+template <typename TakesValue>
+uint32_t classify_action(const char *const *argv, size_t argc,
+                         TakesValue takes_value) {
+  bool compile_only = false; // -c
+  bool to_asm = false;       // -S
+  bool preprocess = false;   // -E, -M, -MM
+  bool query = false;
+  bool inputs = false;
+  bool sources = false;
+  bool asms = false;
+  InputKind lang = INPUT_OTHER;
+
+  for (size_t i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if (arg[0] == '-' && arg[1]) {
+      const char *value = nullptr;
+      if (i + 1 < argc && takes_value(arg)) {
+        value = argv[++i];
+      }
+      if (arg[1] == 'x') {
+        const char *l = value ? value : arg + 2;
+        lang = *l ? input_kind_of_language(l) : lang;
+      } else if (strcmp(arg, "-c") == 0) {
+        compile_only = true;
+      } else if (strcmp(arg, "-S") == 0) {
+        to_asm = true;
+      } else if (strcmp(arg, "-E") == 0 || strcmp(arg, "-M") == 0 ||
+                 strcmp(arg, "-MM") == 0) {
+        preprocess = true;
+      } else if (is_query_option(arg)) {
+        query = true;
+      } else if (arg[1] == 'l') {
+        inputs = true; // library for linker
+      }
+      continue;
+    }
+
+    inputs = true;
+    InputKind kind = arg[0] == '@' ? INPUT_OTHER : lang;
+    if (kind == INPUT_OTHER && arg[0] != '@') {
+      kind = input_kind_of_file(arg);
+    }
+    sources = sources || kind == INPUT_SOURCE;
+    asms = asms || kind == INPUT_ASM;
+  }
+
+  if (query || !inputs) {
+    return ACTION_QUERY;
+  }
+  if (preprocess) {
+    return ACTION_PREPROCESS;
+  }
+
+  uint32_t actions = 0;
+  if (sources) {
+    actions |= ACTION_COMPILE;
+  }
+  if (asms && !to_asm) {
+    actions |= ACTION_ASSEMBLE;
+  }
+  if (to_asm || compile_only) {
+    return actions ? actions : ACTION_COMPILE;
+  }
+  return actions | ACTION_LINK;
+}
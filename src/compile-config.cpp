@@ -0,0 +1,105 @@
+/*
+
+file    :  src/compile-config.cpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+exeptor-compile-config - compile yaml config to binary snapshot.
+by default snapshot is written next to config file, where libexeptor looks
+for it before falling back to parsing yaml.
+with --cxx snapshot is written as C++ header which gets compiled into
+dedicated libexeptor-<profile> (see EXEPTOR_EMBED_CONFIG in CMakeLists.txt)
+
+*/
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "config.hpp"
+
+// write snapshot as C++ header to be compiled into libexeptor
+static bool write_snapshot_cxx(const std::string &path,
+                               const std::string &config_path,
+                               const std::vector<char> &data) {
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+
+  out << "// generated by exeptor-compile-config from '" << config_path
+      << "', do not edit\n\n"
+      << "#pragma once\n\n"
+      << "alignas(8) static constexpr unsigned char exeptor_embedded_snapshot"
+      << "[" << data.size() << "] = {";
+
+  char byte[8];
+  for (size_t i = 0; i < data.size(); i++) {
+    snprintf(byte, sizeof(byte), "0x%02x,",
+             static_cast<unsigned char>(data[i]));
+    out << (i % 12 == 0 ? "\n    " : " ") << byte;
+  }
+  out << "\n};\n";
+
+  out.close();
+  return !out.fail();
+}
+
+int main(int argc, char *argv[]) {
+  bool cxx = argc > 1 && std::string(argv[1]) == "--cxx";
+  if (cxx) {
+    argc--;
+    argv++;
+  }
+
+  if (argc < 2 || argc > 3 || (cxx && argc != 3)) {
+    std::cout << argv[0] << " - compile exeptor config to binary snapshot\n";
+    std::cout << "Run it like this: " << argv[0]
+              << " /path/to/config.yaml [/path/to/output]\n";
+    std::cout << "Default output is /path/to/config.yaml"
+              << EXEPTOR_SNAPSHOT_SUFFIX << "\n";
+    std::cout << "Or like this to get C++ header for EXEPTOR_EMBED_CONFIG: "
+              << argv[0] << " --cxx /path/to/config.yaml /path/to/output.hpp"
+              << std::endl;
+    return argc < 2 ? 0 : 1;
+  }
+
+  // snapshot is keyed by config path as libexeptor sees it in EXEPTOR_CONFIG,
+  // which is required to be absolute
+  std::string config_path = argv[1];
+  if (config_path[0] != '/') {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+      perror("Wasn't able to get current directory");
+      return 1;
+    }
+    config_path = std::string(cwd) + "/" + config_path;
+  }
+  std::string output_path =
+      argc > 2 ? argv[2] : config_path + EXEPTOR_SNAPSHOT_SUFFIX;
+
+  ReplacementSettings settings;
+  std::vector<char> snapshot;
+  if (!settings.compile_file(config_path, snapshot)) {
+    std::cerr << "ERROR: failed to parse config file" << std::endl;
+    return 2;
+  }
+
+  bool written =
+      cxx ? write_snapshot_cxx(output_path, config_path, snapshot)
+          : ReplacementSettings::write_snapshot_file(output_path, snapshot);
+  if (!written) {
+    std::cerr << "ERROR: wasn't able to write '" << output_path << "'"
+              << std::endl;
+    return 3;
+  }
+
+  std::cout << "Snapshot of "
+            << settings.programs.size() + settings.patterns.size()
+            << " replacements written to '" << output_path << "' ("
+            << snapshot.size() << " bytes)" << std::endl;
+  return 0;
+}
@@ -7,28 +7,316 @@ license :  MIT
 check repository for more information
 
 parse replacement settings from yaml config file with help of yaml-cpp library
+and compile them to binary snapshot (see snapshot.hpp)
+
+keys of replacements are either exact names or patterns:
+  base:NAME   - any path with basename NAME
+  glob:GLOB   - shell glob, basename is matched if GLOB has no '/'
+  re:REGEX    - regex matching the whole path
+replacement of pattern may use \1 - \9 for captures (every '*' and '?' of
+glob is a capture) and \0 for the whole path
+
+rewrite-args rules of group are whitespace-separated words:
+  delete P [V]               - drop matching option (and its value)
+  keep P [V]                 - protect matching option from later rules
+  replace P [V] -> W [W]     - put words in place of matched arguments
+  insert-before-input A...   - put arguments before the first input file
+  append A...                - same as add-options
+  pair OPT                   - OPT takes value from the next argument
+P and V are exact arguments, globs (with '*', '?' or '[') or "re:REGEX".
+rule with V matches option followed by its value, rule without V matches
+option alone or together with its value. the first matching rule wins
+
+add-options may also be a map of action classes (see action.hpp) to lists:
+"all", "preprocess", "compile", "assemble", "link" and "query"
+
+top-level phases setting switches replacements off ("off" list) or back on
+("on" list) below processes whose command line matches: the first word is
+a glob of program basename, others are globs of its arguments, e.g.
+"make check" or "ctest". see phase.hpp
+
+plugin of group is a shared object with C hook which edits argv and envp of
+replaced programs in-process, see include/exeptor-plugin.h
+
+include-paths and exclude-paths are globs of absolute paths ('*' matches
+'/' too), each also covers everything below it. they are matched against
+current directory and source files in argv: program gets replaced only if
+nothing is excluded and something is included (or there are no includes)
 
 */
 
 #pragma once
 
+#include <algorithm>
 #include <iostream>
 #include <map>
-#include <set>
+#include <string>
+#include <vector>
+
+#include <cctype>
+#include <cstdio>
 
+#include "regex.hpp"
+#include "snapshot.hpp"
 #include "yaml-cpp/yaml.h"
 
 class ReplacementSettings {
 public:
-  using options_t = std::set<std::string>;
+  using options_t = std::vector<std::string>; // kept in config order
+
+  // rewrite-args rule, see add_rule
+  struct Rule {
+    RuleAction action;
+    options_t patterns; // option, then value for rules matching pairs
+    options_t words;    // replacement
+  };
+
+  // options are stored once per group, programs refer to their group
+  struct Group {
+    std::string name;
+    options_t add_options;
+    std::vector<uint32_t> add_actions; // action classes of add_options,
+                                       // missing entries mean all classes
+    options_t del_options;
+    options_t add_environ; // "NAME=value" entries
+    options_t del_environ; // names of variables
+    unsigned reintercept;  // replacement depth up to which exec calls of
+                           // replacements still get intercepted
+    bool match_inodes;     // programs also match any path of their binary
+    std::vector<Rule> rules;
+    options_t insert_options; // go before the first input
+    options_t pairs;          // options taking value, besides default ones
+    options_t include_paths;  // globs, see the top of this file
+    options_t exclude_paths;
+    std::string plugin; // shared object, see include/exeptor-plugin.h
+  };
 
-  std::map<std::string, std::string> programs;
-  std::map<std::string, options_t> add_options;
-  std::map<std::string, options_t> del_options;
+  struct Replacement {
+    std::string path;
+    size_t group; // index in groups
+  };
+
+  // build phase rule, see phase.hpp
+  struct Phase {
+    bool on;
+    options_t words;
+  };
+
+  std::vector<Group> groups;
+  std::vector<Phase> phases;
+  std::map<std::string, Replacement> programs;
+  // keys with pattern prefix, earlier patterns take priority
+  std::vector<std::pair<std::string, Replacement>> patterns;
 
   ReplacementSettings() {}
   ~ReplacementSettings() {}
 
+  size_t add_group(const std::string &name) {
+    groups.push_back(
+        Group{name, {}, {}, {}, {}, {}, 0, false, {}, {}, {}, {}, {}, {}});
+    return groups.size() - 1;
+  }
+
+  // add option unless it's already there
+  static void add_option(options_t &opts, const std::string &opt) {
+    if (std::find(opts.begin(), opts.end(), opt) == opts.end()) {
+      opts.push_back(opt);
+    }
+  }
+
+  // add option for invocations of given action classes. the same option
+  // given for several classes is added once for all of them
+  static void add_scoped_option(Group &group, const std::string &opt,
+                                uint32_t actions) {
+    auto &opts = group.add_options;
+    group.add_actions.resize(opts.size(), EXEPTOR_ACTIONS_ALL);
+    auto it = std::find(opts.begin(), opts.end(), opt);
+    if (it == opts.end()) {
+      opts.push_back(opt);
+      group.add_actions.push_back(actions);
+    } else {
+      group.add_actions[it - opts.begin()] |= actions;
+    }
+  }
+
+  static bool is_pattern(const std::string &key) {
+    return key.compare(0, 5, "base:") == 0 || key.compare(0, 5, "glob:") == 0 ||
+           key.compare(0, 3, "re:") == 0;
+  }
+
+  // exact name or pattern, later replacement of the same key wins
+  void add_program(const std::string &key, const Replacement &r) {
+    if (!is_pattern(key)) {
+      programs[key] = r;
+      return;
+    }
+    for (auto &p : patterns) {
+      if (p.first == key) {
+        p.second = r;
+        return;
+      }
+    }
+    patterns.emplace_back(key, r);
+  }
+
+  // word of rewrite-args rule which is not just an argument to compare with
+  static bool is_arg_pattern(const std::string &word) {
+    return word.compare(0, 3, "re:") == 0 ||
+           word.find_first_of("*?[") != std::string::npos;
+  }
+
+  // regex of word of rewrite-args rule. globs never match across the
+  // separator of option and value
+  static std::string arg_regex(const std::string &word) {
+    if (word.compare(0, 3, "re:") == 0) {
+      std::string re = word.substr(3);
+      if (!re.empty() && re[0] == '^') {
+        re.erase(0, 1);
+      }
+      if (!re.empty() && re.back() == '$' &&
+          (re.size() < 2 || re[re.size() - 2] != '\\')) {
+        re.pop_back();
+      }
+      return re;
+    }
+    if (!is_arg_pattern(word)) {
+      return RegexCompiler::escape(word);
+    }
+
+    return glob_regex(word, std::string("[^") + EXEPTOR_RULE_SEPARATOR + "]");
+  }
+
+  // regex of include-paths or exclude-paths glob, paths below match too
+  static std::string path_regex(const std::string &glob) {
+    std::string re = glob;
+    while (re.size() > 1 && re.back() == '/') {
+      re.pop_back();
+    }
+    return "(?:" + glob_regex(re, ".") + ")(?:/.*)?";
+  }
+
+  // shell glob without captures, any is regex of char '*' and '?' match
+  static std::string glob_regex(const std::string &glob,
+                                const std::string &any) {
+    std::string re;
+    for (size_t i = 0; i < glob.size(); i++) {
+      char c = glob[i];
+      if (c == '*') {
+        re += any + "*";
+      } else if (c == '?') {
+        re += any;
+      } else if (c == '[' && glob.find(']', i + 2) != std::string::npos) {
+        size_t close = glob.find(']', i + 2);
+        std::string set = glob.substr(i + 1, close - i - 1);
+        if (set[0] == '!') {
+          set[0] = '^';
+        }
+        re += "[" + set + "]";
+        i = close;
+      } else {
+        re += RegexCompiler::escape(std::string(1, c));
+      }
+    }
+    return re;
+  }
+
+  // add "NAME=value" entry, later value of the same variable wins
+  static void add_environ(options_t &envs, const std::string &entry) {
+    auto name = entry.substr(0, entry.find('=') + 1);
+    for (auto &e : envs) {
+      if (e.compare(0, name.size(), name) == 0) {
+        e = entry;
+        return;
+      }
+    }
+    envs.push_back(entry);
+  }
+
+  static options_t split_words(const std::string &text) {
+    options_t words;
+    size_t pos = 0;
+    while ((pos = text.find_first_not_of(" \t", pos)) != std::string::npos) {
+      size_t end = text.find_first_of(" \t", pos);
+      words.push_back(text.substr(pos, end - pos));
+      pos = end;
+    }
+    return words;
+  }
+
+  // "make check", "ctest" and such, see phase.hpp
+  bool add_phase(bool on, const std::string &text) {
+    options_t words = split_words(text);
+    if (words.empty()) {
+      return false;
+    }
+    phases.push_back(Phase{on, words});
+    return true;
+  }
+
+  // parse one rewrite-args rule of group, see the top of this file
+  bool add_rule(size_t group_index, const std::string &text,
+                std::string &error) {
+    auto &group = groups[group_index];
+    options_t words = split_words(text);
+    if (words.empty()) {
+      error = "empty rule";
+      return false;
+    }
+
+    const auto &verb = words[0];
+    options_t rest(words.begin() + 1, words.end());
+    if (verb == "append" || verb == "insert-before-input" || verb == "pair") {
+      if (rest.empty() || (verb == "pair" && rest.size() != 1)) {
+        error = "wrong number of arguments for '" + verb + "'";
+        return false;
+      }
+      for (const auto &w : rest) {
+        if (verb == "append") {
+          add_scoped_option(group, w, EXEPTOR_ACTIONS_ALL);
+        } else {
+          add_option(verb == "pair" ? group.pairs : group.insert_options, w);
+        }
+      }
+      return true;
+    }
+
+    Rule rule;
+    if (verb == "delete") {
+      rule.action = RULE_DELETE;
+    } else if (verb == "keep") {
+      rule.action = RULE_KEEP;
+    } else if (verb == "replace") {
+      rule.action = RULE_REPLACE;
+    } else {
+      error = "unknown rule '" + verb + "'";
+      return false;
+    }
+
+    auto arrow = std::find(rest.begin(), rest.end(), "->");
+    rule.patterns.assign(rest.begin(), arrow);
+    if (arrow != rest.end()) {
+      rule.words.assign(arrow + 1, rest.end());
+    }
+    if (rule.patterns.empty() || rule.patterns.size() > 2) {
+      error = "rule '" + verb + "' needs an option and optionally its value";
+      return false;
+    }
+    if ((rule.action == RULE_REPLACE) != (arrow != rest.end())) {
+      error = "only 'replace' rules have '->'";
+      return false;
+    }
+    // argv gets rewritten in place, it never grows
+    if (rule.action == RULE_REPLACE &&
+        (rule.words.empty() || rule.words.size() > rule.patterns.size())) {
+      error = "replacement must have 1 to " +
+              std::to_string(rule.patterns.size()) + " arguments";
+      return false;
+    }
+
+    group.rules.push_back(rule);
+    return true;
+  }
+
   bool parse_from_file(std::string path) {
     bool verbose = getenv("EXEPTOR_VERBOSE") != nullptr;
     if (verbose) {
@@ -42,16 +330,79 @@ public:
       return false;
     }
 
-    auto groups = config["target_groups"];
+    auto target_groups = config["target_groups"];
 
-    if (!groups.IsMap()) {
+    if (!target_groups.IsMap()) {
       std::cerr << "Error: 'target_groups' is empty" << std::endl;
       return false;
     }
 
-    enum class OType : uint8_t { ADD, DELETE } optType;
+    // build phases where replacements are on or off
+    auto phase_lists = config["phases"];
+    if (phase_lists && !phase_lists.IsMap()) {
+      std::cerr << "Error: 'phases' is not a key-value list" << std::endl;
+      return false;
+    }
+    for (auto it = phase_lists.begin(); it != phase_lists.end(); it++) {
+      auto state = it->first.as<std::string>();
+      if ((state != "on" && state != "off") || !it->second.IsSequence()) {
+        std::cerr << "Error: '" << state
+                  << "' in 'phases' is not 'on' or 'off' with list of "
+                     "commands"
+                  << std::endl;
+        return false;
+      }
+      for (auto k = it->second.begin(); k != it->second.end(); k++) {
+        if (!k->IsScalar() || !add_phase(state == "on", k->as<std::string>())) {
+          std::cerr << "Error: bad command in 'phases'" << std::endl;
+          return false;
+        }
+        if (verbose) {
+          std::cout << "Replacements are " << state << " below '"
+                    << k->as<std::string>() << "'" << std::endl;
+        }
+      }
+    }
+
+    enum class OType : uint8_t {
+      ADD,
+      DELETE,
+      ADD_ENV,
+      DEL_ENV,
+      INCLUDE_PATHS,
+      EXCLUDE_PATHS
+    } optType;
+
+    // add-environ takes "NAME=value", del-environ takes just "NAME"
+    auto add_env_entry = [&](size_t group_index, OType type,
+                             const std::string &entry) {
+      auto &group = groups[group_index];
+      auto eq = entry.find('=');
+      bool ok = type == OType::ADD_ENV ? eq != std::string::npos && eq > 0
+                                       : eq == std::string::npos &&
+                                             !entry.empty();
+      if (!ok) {
+        std::cerr << "Error: bad environment variable '" << entry
+                  << "' in group '" << group.name << "'" << std::endl;
+        return false;
+      }
+
+      if (type == OType::ADD_ENV) {
+        add_environ(group.add_environ, entry);
+      } else {
+        add_option(group.del_environ, entry);
+      }
+
+      if (verbose) {
+        std::cout << "Group '" << group.name << "': "
+                  << (type == OType::ADD_ENV ? "set " : "unset ")
+                  << "environment variable '" << entry << "'" << std::endl;
+      }
+      return true;
+    };
 
-    for (auto group = groups.begin(); group != groups.end(); group++) {
+    for (auto group = target_groups.begin(); group != target_groups.end();
+         group++) {
       auto group_name = group->first.as<std::string>();
       auto group_items = group->second;
 
@@ -63,6 +414,7 @@ public:
       if (verbose) {
         std::cout << "Found group '" << group_name << "'" << std::endl;
       }
+      size_t group_index = add_group(group_name);
       if (!group_items["replacements"]) {
         std::cerr << "Error: target_group '" << group_name
                   << "' doesn't contain 'replacements' setting" << std::endl;
@@ -90,7 +442,8 @@ public:
           std::cout << "Replacement for '" << binary << "' is '"
                     << binary_replacement.as<std::string>() << "'" << std::endl;
         }
-        programs[binary] = binary_replacement.as<std::string>();
+        add_program(binary, Replacement{binary_replacement.as<std::string>(),
+                                        group_index});
       }
 
       for (auto key = group_items.begin(); key != group_items.end(); key++) {
@@ -101,14 +454,150 @@ public:
           optType = OType::ADD;
         } else if (settingName == "del-options") {
           optType = OType::DELETE;
+        } else if (settingName == "add-environ") {
+          optType = OType::ADD_ENV;
+        } else if (settingName == "del-environ") {
+          optType = OType::DEL_ENV;
+        } else if (settingName == "include-paths") {
+          optType = OType::INCLUDE_PATHS;
+        } else if (settingName == "exclude-paths") {
+          optType = OType::EXCLUDE_PATHS;
         } else if (settingName == "replacements") {
           continue;
+        } else if (settingName == "reintercept") {
+          // wrapper chains: replacement may run programs to be replaced too
+          unsigned long depth = 0;
+          auto value = setting.IsScalar() ? setting.as<std::string>() : "";
+          char *end = nullptr;
+          if (!value.empty() && isdigit(static_cast<unsigned char>(value[0]))) {
+            depth = strtoul(value.c_str(), &end, 10);
+          }
+          if (!end || *end != '\0' || depth > EXEPTOR_MAX_REINTERCEPT) {
+            std::cerr << "Error: setting '" << settingName
+                      << "' is not a number from 0 to "
+                      << EXEPTOR_MAX_REINTERCEPT << " in group '"
+                      << group_name << "'" << std::endl;
+            return false;
+          }
+          groups[group_index].reintercept = static_cast<unsigned>(depth);
+          if (verbose) {
+            std::cout << "Group '" << group_name << "': reintercept up to "
+                      << "depth " << depth << std::endl;
+          }
+          continue;
+        } else if (settingName == "rewrite-args") {
+          if (!setting.IsSequence()) {
+            std::cerr << "Error: setting '" << settingName
+                      << "' is not a list of rules in group '" << group_name
+                      << "'" << std::endl;
+            return false;
+          }
+          for (auto k = setting.begin(); k != setting.end(); k++) {
+            std::string error;
+            auto text = k->IsScalar() ? k->as<std::string>() : "";
+            if (!k->IsScalar() || !add_rule(group_index, text, error)) {
+              std::cerr << "Error: bad rule '" << text << "' in group '"
+                        << group_name << "': "
+                        << (error.empty() ? "not a simple value" : error)
+                        << std::endl;
+              return false;
+            }
+            if (verbose) {
+              std::cout << "Group '" << group_name << "': rule '" << text
+                        << "'" << std::endl;
+            }
+          }
+          continue;
+        } else if (settingName == "plugin") {
+          // in-process rewrite hook instead of wrapper script
+          auto path = setting.IsScalar() ? setting.as<std::string>() : "";
+          if (path.empty()) {
+            std::cerr << "Error: setting '" << settingName
+                      << "' is not a path to shared object in group '"
+                      << group_name << "'" << std::endl;
+            return false;
+          }
+          groups[group_index].plugin = path;
+          if (verbose) {
+            std::cout << "Group '" << group_name << "': plugin '" << path
+                      << "'" << std::endl;
+          }
+          continue;
+        } else if (settingName == "match-inodes") {
+          // cc, /usr/bin/c++, ./gcc and symlinks to the same compiler
+          bool on = false;
+          if (!setting.IsScalar() ||
+              !YAML::convert<bool>::decode(setting, on)) {
+            std::cerr << "Error: setting '" << settingName
+                      << "' is not true or false in group '" << group_name
+                      << "'" << std::endl;
+            return false;
+          }
+          groups[group_index].match_inodes = on;
+          if (verbose) {
+            std::cout << "Group '" << group_name << "': "
+                      << (on ? "match" : "don't match")
+                      << " programs by inode" << std::endl;
+          }
+          continue;
         } else {
           std::cerr << "Error: unknown setting '" << settingName
                     << "' in group '" << group_name << "'" << std::endl;
           return false;
         }
 
+        // add-options may be scoped to action classes
+        if (optType == OType::ADD && setting.IsMap()) {
+          for (auto k = setting.begin(); k != setting.end(); k++) {
+            auto name = k->first.as<std::string>();
+            uint32_t actions = action_by_name(name.c_str());
+            if (!actions || !k->second.IsSequence()) {
+              std::cerr << "Error: '" << name << "' in setting '"
+                        << settingName
+                        << "' is not an action class with list of options "
+                           "in group '"
+                        << group_name << "'" << std::endl;
+              return false;
+            }
+            for (auto opt = k->second.begin(); opt != k->second.end();
+                 opt++) {
+              if (!opt->IsScalar()) {
+                std::cerr << "Error: setting '" << settingName
+                          << "' is not a simple value in group '"
+                          << group_name << "'" << std::endl;
+                return false;
+              }
+              add_scoped_option(groups[group_index], opt->as<std::string>(),
+                                actions);
+              if (verbose) {
+                std::cout << "Group '" << group_name << "': add setting '"
+                          << opt->as<std::string>() << "' for " << name
+                          << std::endl;
+              }
+            }
+          }
+          continue;
+        }
+
+        // add-environ may also be written as NAME: value pairs
+        if (optType == OType::ADD_ENV && setting.IsMap()) {
+          for (auto k = setting.begin(); k != setting.end(); k++) {
+            if (!k->second.IsScalar()) {
+              std::cerr << "Error: variable '" << k->first.as<std::string>()
+                        << "' in setting '" << settingName
+                        << "' is not a simple value in group '" << group_name
+                        << "'" << std::endl;
+              return false;
+            }
+            auto entry = k->first.as<std::string>() + "=" +
+                         k->second.as<std::string>();
+            if (!add_env_entry(group_index, optType, entry)) {
+              return false;
+            }
+          }
+          continue;
+        }
+
         if (!setting.IsSequence()) {
           std::cerr << "Error: setting '" << settingName
                     << "' is not a list of values in group '"
@@ -123,30 +612,35 @@ public:
                       << group->first.as<std::string>() << "'" << std::endl;
             return false;
           }
-          bool quiet = !verbose;
-          if (quiet) {
-            for (auto &prog : programs) {
-              if (optType == OType::ADD) {
-                add_options[prog.first].insert(k->as<std::string>());
-              } else {
-                del_options[prog.first].insert(k->as<std::string>());
-              }
+          if (optType == OType::ADD_ENV || optType == OType::DEL_ENV) {
+            if (!add_env_entry(group_index, optType, k->as<std::string>())) {
+              return false;
             }
+            continue;
+          }
+
+          auto &g = groups[group_index];
+          auto value = k->as<std::string>();
+          const char *what = "add setting";
+          if (optType == OType::ADD) {
+            add_scoped_option(g, value, EXEPTOR_ACTIONS_ALL);
+          } else if (optType == OType::DELETE) {
+            add_option(g.del_options, value);
+            what = "delete setting";
+          } else if (!value.empty() && (value[0] == '/' || value[0] == '*')) {
+            bool include = optType == OType::INCLUDE_PATHS;
+            add_option(include ? g.include_paths : g.exclude_paths, value);
+            what = include ? "include path" : "exclude path";
           } else {
-            for (auto &prog : programs) {
-              std::cout << "Program '" << prog.first << "': ";
-
-              if (optType == OType::ADD) {
-                std::cout << "add ";
-                add_options[prog.first].insert(k->as<std::string>());
-              } else {
-                std::cout << "delete ";
-                del_options[prog.first].insert(k->as<std::string>());
-              }
+            std::cerr << "Error: path '" << value << "' in setting '"
+                      << settingName << "' is not absolute in group '"
+                      << group_name << "'" << std::endl;
+            return false;
+          }
 
-              std::cout << "setting '" << k->as<std::string>() << "'"
-                        << std::endl;
-            }
+          if (verbose) {
+            std::cout << "Group '" << group_name << "': " << what << " '"
+                      << value << "'" << std::endl;
           }
         }
       }
@@ -154,4 +648,511 @@ public:
 
     return true;
   }
-};
\ No newline at end of file
+
+  // parse yaml config file and compile it to snapshot keyed by its current
+  // size and modification time
+  bool compile_file(const std::string &path, std::vector<char> &out) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      std::cerr << "Error: config file '" << path << "' is not accessible"
+                << std::endl;
+      return false;
+    }
+
+    if (!parse_from_file(path)) {
+      return false;
+    }
+
+    SnapshotSource source;
+    snapshot_source_from_stat(path.c_str(), st, source);
+    return build_snapshot(source, out);
+  }
+
+  // compile settings to snapshot bytes which can be used with ConfigSnapshot
+  bool build_snapshot(const SnapshotSource &source,
+                      std::vector<char> &out) const {
+    // replacements given by bare names get resolved with PATH of this
+    // process, processes with another PATH resolve them on their own
+    const char *search_path = getenv("PATH");
+
+    std::string strings(1, '\0'); // offset 0 is an empty string
+    std::map<std::string, uint32_t> interned;
+    auto intern = [&](const std::string &s) -> uint32_t {
+      auto it = interned.find(s);
+      if (it != interned.end()) {
+        return it->second;
+      }
+      auto offset = static_cast<uint32_t>(strings.size());
+      strings.append(s.c_str(), s.size() + 1);
+      interned[s] = offset;
+      return offset;
+    };
+
+    std::vector<uint32_t> lists;
+    std::vector<uint32_t> list_actions; // only add-options may be scoped
+    auto add_list = [&](const options_t &opts, uint32_t &first,
+                        uint32_t &count) {
+      first = static_cast<uint32_t>(lists.size());
+      count = static_cast<uint32_t>(opts.size());
+      for (const auto &opt : opts) {
+        lists.push_back(intern(opt));
+        list_actions.push_back(EXEPTOR_ACTIONS_ALL);
+      }
+    };
+
+    // del-options of each group get their own small hash table
+    std::vector<SnapshotOptionSlot> option_slots;
+    auto add_option_slots = [&](const options_t &opts, SnapshotGroup &g) {
+      g.del_slots_first = static_cast<uint32_t>(option_slots.size());
+      g.del_slots_count = 0;
+      g.del_lead[0] = g.del_lead[1] = 0;
+      if (opts.empty()) {
+        return;
+      }
+
+      uint32_t count = 4;
+      while (count < opts.size() * 2) {
+        count *= 2;
+      }
+      option_slots.resize(option_slots.size() + count,
+                          SnapshotOptionSlot{0, 0});
+      auto slots = &option_slots[g.del_slots_first];
+      for (const auto &opt : opts) {
+        uint64_t h = snapshot_hash(opt.c_str(), opt.size());
+        uint32_t i = static_cast<uint32_t>(h) & (count - 1);
+        while (slots[i].option) {
+          i = (i + 1) & (count - 1);
+        }
+        slots[i].tag = static_cast<uint32_t>(h >> 32);
+        slots[i].option = intern(opt) + 1;
+
+        uint32_t bit = option_lead_bit(opt.c_str());
+        g.del_lead[bit / 32] |= 1u << (bit % 32);
+      }
+      g.del_slots_count = count;
+    };
+
+    // DFAs of groups go one after another, all of their parts are multiples
+    // of 4 bytes
+    std::vector<char> dfas;
+    auto add_dfa = [&](const options_t &res, SnapshotDfa &d,
+                       std::string &error) {
+      d = SnapshotDfa{0, 0, 0};
+      if (res.empty()) {
+        return true;
+      }
+      RegexSet set;
+      for (const auto &re : res) {
+        RegexCompiler rc;
+        if (!set.add(re, rc)) {
+          error = "bad regex '" + re + "': " + set.error;
+          return false;
+        }
+      }
+      DfaBuilder dfa;
+      if (!dfa.build(set.joined, set.classes, set.starts,
+                     EXEPTOR_MAX_DFA_STATES)) {
+        error = dfa.error;
+        return false;
+      }
+      d.offset = static_cast<uint32_t>(dfas.size());
+      d.states = dfa.num_states;
+      d.classes = dfa.num_classes;
+      auto append = [&](const void *p, size_t n) {
+        dfas.insert(dfas.end(), static_cast<const char *>(p),
+                    static_cast<const char *>(p) + n);
+      };
+      append(dfa.classmap, sizeof(dfa.classmap));
+      append(dfa.next.data(), dfa.next.size() * sizeof(uint32_t));
+      append(dfa.accept.data(), dfa.accept.size() * sizeof(uint32_t));
+      return true;
+    };
+
+    // options of GCC and Clang which take value from the next argument
+    static const char *const default_pairs[] = {
+        "-o",             "-x",             "-MF",            "-MT",
+        "-MQ",            "-include",       "-imacros",       "-isystem",
+        "-idirafter",     "-iquote",        "-isysroot",      "-Xclang",
+        "-Xlinker",       "-Xassembler",    "-Xpreprocessor", "-mllvm",
+        "-arch",          "-target",        "-I",             "-D",
+        "-U",             "-L",             "-z",             "-T",
+        "-u",
+    };
+    const std::string sep(1, EXEPTOR_RULE_SEPARATOR);
+
+    std::vector<SnapshotPhase> phs;
+    for (const auto &phase : phases) {
+      SnapshotPhase ph;
+      ph.on = phase.on;
+      add_list(phase.words, ph.words_first, ph.words_count);
+      phs.push_back(ph);
+    }
+
+    std::vector<SnapshotRule> rules;
+    std::vector<SnapshotGroup> grps;
+    for (const auto &group : groups) {
+      SnapshotGroup g;
+      g.name = intern(group.name);
+      add_list(group.add_options, g.add_first, g.add_count);
+      g.add_scoped = 0;
+      for (size_t i = 0; i < group.add_actions.size(); i++) {
+        list_actions[g.add_first + i] = group.add_actions[i];
+        g.add_scoped |= group.add_actions[i] != EXEPTOR_ACTIONS_ALL;
+      }
+      add_list(group.del_options, g.del_first, g.del_count);
+      add_option_slots(group.del_options, g);
+
+      // added variables replace whatever value envp had
+      options_t unset = group.del_environ;
+      for (const auto &entry : group.add_environ) {
+        add_option(unset, entry.substr(0, entry.find('=')));
+      }
+      add_list(group.add_environ, g.env_add_first, g.env_add_count);
+      add_list(unset, g.env_unset_first, g.env_unset_count);
+      g.env_lead[0] = g.env_lead[1] = 0;
+      for (const auto &name : unset) {
+        uint32_t bit = option_lead_bit(name.c_str());
+        g.env_lead[bit / 32] |= 1u << (bit % 32);
+      }
+      g.reintercept = group.reintercept;
+      g.match_inodes = group.match_inodes;
+
+      // rules see options together with their values, so pairs are only
+      // needed when there are rules or inputs must be found
+      options_t pairs;
+      bool scoped =
+          !group.include_paths.empty() || !group.exclude_paths.empty();
+      if (!group.rules.empty() || !group.insert_options.empty() ||
+          g.add_scoped || scoped) {
+        pairs.assign(std::begin(default_pairs), std::end(default_pairs));
+      }
+      for (const auto &opt : group.pairs) {
+        add_option(pairs, opt);
+      }
+
+      options_t rule_res;
+      g.rules_first = static_cast<uint32_t>(rules.size());
+      g.rules_count = static_cast<uint32_t>(group.rules.size());
+      for (const auto &rule : group.rules) {
+        SnapshotRule r;
+        r.action = rule.action;
+        r.keeps_value =
+            rule.action == RULE_REPLACE && rule.patterns.size() == 1;
+        add_list(rule.words, r.words_first, r.words_count);
+        rules.push_back(r);
+
+        std::string re = "(?:" + arg_regex(rule.patterns[0]) + ")";
+        if (rule.patterns.size() == 2) {
+          re += sep + "(?:" + arg_regex(rule.patterns[1]) + ")";
+          if (!is_arg_pattern(rule.patterns[0])) {
+            add_option(pairs, rule.patterns[0]);
+          }
+        } else {
+          re += "(?:" + sep + ".*)?";
+        }
+        rule_res.push_back(re);
+      }
+
+      options_t pair_res;
+      for (const auto &opt : pairs) {
+        pair_res.push_back(RegexCompiler::escape(opt));
+      }
+      std::string error;
+      if (!add_dfa(rule_res, g.rules_dfa, error) ||
+          !add_dfa(pair_res, g.pairs_dfa, error)) {
+        std::cerr << "Error: bad rewrite-args in group '" << group.name
+                  << "': " << error << std::endl;
+        return false;
+      }
+
+      options_t include_res, exclude_res;
+      for (const auto &glob : group.include_paths) {
+        include_res.push_back(path_regex(glob));
+      }
+      for (const auto &glob : group.exclude_paths) {
+        exclude_res.push_back(path_regex(glob));
+      }
+      if (!add_dfa(include_res, g.include_dfa, error) ||
+          !add_dfa(exclude_res, g.exclude_dfa, error)) {
+        std::cerr << "Error: bad paths in group '" << group.name
+                  << "': " << error << std::endl;
+        return false;
+      }
+      add_list(group.insert_options, g.insert_first, g.insert_count);
+      g.plugin = group.plugin.empty() ? 0 : intern(group.plugin);
+      grps.push_back(g);
+    }
+
+    auto resolve = [&](const std::string &path) -> uint32_t {
+      char resolved[PATH_MAX];
+      if (search_path && !strchr(path.c_str(), '/') &&
+          resolve_in_path(path.c_str(), search_path, resolved,
+                          sizeof(resolved))) {
+        return intern(resolved) + 1;
+      }
+      return 0;
+    };
+
+    std::vector<SnapshotProgram> progs;
+    for (const auto &prog : programs) {
+      if (prog.second.group >= groups.size()) {
+        std::cerr << "Error: program '" << prog.first
+                  << "' refers to unknown group" << std::endl;
+        return false;
+      }
+      SnapshotProgram p;
+      p.name = intern(prog.first);
+      p.replacement = intern(prog.second.path);
+      p.group = static_cast<uint32_t>(prog.second.group);
+      p.resolved = resolve(prog.second.path);
+      p.pattern = 0;
+      progs.push_back(p);
+    }
+
+    // binaries themselves get looked up by each build, see find_by_inode
+    uint32_t inode_programs = 0;
+    for (const auto &prog : programs) {
+      inode_programs += groups[prog.second.group].match_inodes;
+    }
+
+    // programs of all patterns get joined with absolute jumps for DFA.
+    // programs of patterns which need captures are also kept as they are
+    std::vector<SnapshotPattern> pats;
+    std::vector<RegexInst> regex;
+    RegexSet pattern_set;
+    for (const auto &pattern : patterns) {
+      const auto &key = pattern.first;
+      const auto &repl = pattern.second;
+      if (repl.group >= groups.size()) {
+        std::cerr << "Error: pattern '" << key << "' refers to unknown group"
+                  << std::endl;
+        return false;
+      }
+
+      std::string re;
+      if (key.compare(0, 5, "base:") == 0) {
+        re = RegexCompiler::from_basename(key.substr(5));
+      } else if (key.compare(0, 5, "glob:") == 0) {
+        re = RegexCompiler::from_glob(key.substr(5));
+      } else {
+        re = key.substr(3);
+      }
+
+      RegexCompiler rc;
+      if (!pattern_set.add(re, rc)) {
+        std::cerr << "Error: bad pattern '" << key << "': " << rc.error
+                  << std::endl;
+        return false;
+      }
+      int highest = regex_template_captures(repl.path.c_str());
+      if (highest > static_cast<int>(rc.groups)) {
+        std::cerr << "Error: replacement '" << repl.path << "' of pattern '"
+                  << key << "' refers to missing capture \\" << highest
+                  << std::endl;
+        return false;
+      }
+
+      SnapshotPattern pt;
+      pt.program = static_cast<uint32_t>(progs.size());
+      pt.regex_first = static_cast<uint32_t>(regex.size());
+      pt.regex_count = highest >= 0 ? static_cast<uint32_t>(rc.prog.size()) : 0;
+      if (highest >= 0) {
+        regex.insert(regex.end(), rc.prog.begin(), rc.prog.end());
+      }
+
+      // replacement without captures is the same for any matched path
+      SnapshotProgram p;
+      p.name = intern(key);
+      if (highest >= 0) {
+        p.replacement = intern(repl.path);
+        p.resolved = 0;
+      } else {
+        const char *no_caps[2 * EXEPTOR_REGEX_MAX_CAPTURES] = {};
+        std::string path(repl.path.size() + 1, '\0');
+        path.resize(regex_expand(repl.path.c_str(), no_caps, &path[0],
+                                 path.size()));
+        p.replacement = intern(path);
+        p.resolved = resolve(path);
+      }
+      p.group = static_cast<uint32_t>(repl.group);
+      p.pattern = static_cast<uint32_t>(pats.size() + 1);
+      progs.push_back(p);
+      pats.push_back(pt);
+    }
+
+    const auto &regex_classes = pattern_set.classes;
+    DfaBuilder dfa;
+    if (!patterns.empty() &&
+        !dfa.build(pattern_set.joined, regex_classes, pattern_set.starts,
+                   EXEPTOR_MAX_DFA_STATES)) {
+      std::cerr << "Error: " << dfa.error << std::endl;
+      return false;
+    }
+
+    // hash table of exact names is at most half full, so lookups of missing
+    // names stop early
+    uint32_t slots_count = 8;
+    while (slots_count < programs.size() * 2) {
+      slots_count *= 2;
+    }
+    std::vector<SnapshotSlot> slots(slots_count, SnapshotSlot{0, 0});
+    std::vector<uint32_t> prefilter(EXEPTOR_PREFILTER_BITS / 32, 0);
+
+    uint32_t index = 0;
+    for (const auto &prog : programs) {
+      const auto &name = prog.first;
+      uint64_t h = snapshot_hash(name.c_str(), name.size());
+      uint32_t i = static_cast<uint32_t>(h) & (slots_count - 1);
+      while (slots[i].program) {
+        i = (i + 1) & (slots_count - 1);
+      }
+      slots[i].tag = static_cast<uint32_t>(h >> 32);
+      slots[i].program = ++index;
+
+      uint32_t bit = prefilter_bit(name.c_str(), name.size());
+      prefilter[bit / 32] |= 1u << (bit % 32);
+    }
+
+    auto align = [](size_t n) { return (n + 7) & ~static_cast<size_t>(7); };
+
+    SnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, EXEPTOR_SNAPSHOT_MAGIC, sizeof(EXEPTOR_SNAPSHOT_MAGIC));
+    hdr.version = EXEPTOR_SNAPSHOT_VERSION;
+    hdr.source = source;
+    hdr.search_path_hash = search_path ? snapshot_hash(search_path) : 0;
+    hdr.inode_programs = inode_programs;
+
+    size_t size = align(sizeof(hdr));
+    hdr.programs_offset = static_cast<uint32_t>(size);
+    hdr.programs_count = static_cast<uint32_t>(progs.size());
+    size = align(size + progs.size() * sizeof(SnapshotProgram));
+    hdr.slots_offset = static_cast<uint32_t>(size);
+    hdr.slots_count = slots_count;
+    size = align(size + slots.size() * sizeof(SnapshotSlot));
+    hdr.prefilter_offset = static_cast<uint32_t>(size);
+    size = align(size + prefilter.size() * sizeof(uint32_t));
+    hdr.groups_offset = static_cast<uint32_t>(size);
+    hdr.groups_count = static_cast<uint32_t>(grps.size());
+    size = align(size + grps.size() * sizeof(SnapshotGroup));
+    hdr.option_slots_offset = static_cast<uint32_t>(size);
+    hdr.option_slots_count = static_cast<uint32_t>(option_slots.size());
+    size = align(size + option_slots.size() * sizeof(SnapshotOptionSlot));
+    hdr.lists_offset = static_cast<uint32_t>(size);
+    hdr.lists_count = static_cast<uint32_t>(lists.size());
+    size = align(size + lists.size() * sizeof(uint32_t));
+    hdr.list_actions_offset = static_cast<uint32_t>(size);
+    size = align(size + list_actions.size() * sizeof(uint32_t));
+    hdr.strings_offset = static_cast<uint32_t>(size);
+    hdr.strings_size = static_cast<uint32_t>(strings.size());
+    size = align(size + strings.size());
+    hdr.patterns_offset = static_cast<uint32_t>(size);
+    hdr.patterns_count = static_cast<uint32_t>(pats.size());
+    size = align(size + pats.size() * sizeof(SnapshotPattern));
+    hdr.dfa_offset = static_cast<uint32_t>(size);
+    hdr.dfa_states = dfa.num_states;
+    hdr.dfa_classes = dfa.num_classes;
+    if (dfa.num_states > 0) {
+      size = align(size + sizeof(dfa.classmap) +
+                   (dfa.next.size() + dfa.accept.size()) * sizeof(uint32_t));
+    }
+    hdr.regex_offset = static_cast<uint32_t>(size);
+    hdr.regex_count = static_cast<uint32_t>(regex.size());
+    size = align(size + regex.size() * sizeof(RegexInst));
+    hdr.regex_classes_offset = static_cast<uint32_t>(size);
+    hdr.regex_classes_count = static_cast<uint32_t>(regex_classes.size());
+    size = align(size + regex_classes.size() * sizeof(uint32_t));
+    hdr.rules_offset = static_cast<uint32_t>(size);
+    hdr.rules_count = static_cast<uint32_t>(rules.size());
+    size = align(size + rules.size() * sizeof(SnapshotRule));
+    hdr.dfas_offset = static_cast<uint32_t>(size);
+    hdr.dfas_size = static_cast<uint32_t>(dfas.size());
+    size = align(size + dfas.size());
+    hdr.phases_offset = static_cast<uint32_t>(size);
+    hdr.phases_count = static_cast<uint32_t>(phs.size());
+    size = align(size + phs.size() * sizeof(SnapshotPhase));
+
+    if (size > UINT32_MAX) {
+      std::cerr << "Error: config is too big to fit in snapshot" << std::endl;
+      return false;
+    }
+    hdr.size = static_cast<uint32_t>(size);
+
+    out.assign(size, '\0');
+    memcpy(&out[0], &hdr, sizeof(hdr));
+    if (!progs.empty()) {
+      memcpy(&out[hdr.programs_offset], progs.data(),
+             progs.size() * sizeof(SnapshotProgram));
+    }
+    memcpy(&out[hdr.slots_offset], slots.data(),
+           slots.size() * sizeof(SnapshotSlot));
+    memcpy(&out[hdr.prefilter_offset], prefilter.data(),
+           prefilter.size() * sizeof(uint32_t));
+    if (!grps.empty()) {
+      memcpy(&out[hdr.groups_offset], grps.data(),
+             grps.size() * sizeof(SnapshotGroup));
+    }
+    if (!option_slots.empty()) {
+      memcpy(&out[hdr.option_slots_offset], option_slots.data(),
+             option_slots.size() * sizeof(SnapshotOptionSlot));
+    }
+    if (!lists.empty()) {
+      memcpy(&out[hdr.lists_offset], lists.data(),
+             lists.size() * sizeof(uint32_t));
+      memcpy(&out[hdr.list_actions_offset], list_actions.data(),
+             list_actions.size() * sizeof(uint32_t));
+    }
+    memcpy(&out[hdr.strings_offset], strings.data(), strings.size());
+    if (!pats.empty()) {
+      memcpy(&out[hdr.patterns_offset], pats.data(),
+             pats.size() * sizeof(SnapshotPattern));
+    }
+    if (dfa.num_states > 0) {
+      char *p = &out[hdr.dfa_offset];
+      memcpy(p, dfa.classmap, sizeof(dfa.classmap));
+      p += sizeof(dfa.classmap);
+      memcpy(p, dfa.next.data(), dfa.next.size() * sizeof(uint32_t));
+      p += dfa.next.size() * sizeof(uint32_t);
+      memcpy(p, dfa.accept.data(), dfa.accept.size() * sizeof(uint32_t));
+    }
+    if (!regex.empty()) {
+      memcpy(&out[hdr.regex_offset], regex.data(),
+             regex.size() * sizeof(RegexInst));
+    }
+    if (!regex_classes.empty()) {
+      memcpy(&out[hdr.regex_classes_offset], regex_classes.data(),
+             regex_classes.size() * sizeof(uint32_t));
+    }
+    if (!rules.empty()) {
+      memcpy(&out[hdr.rules_offset], rules.data(),
+             rules.size() * sizeof(SnapshotRule));
+    }
+    if (!dfas.empty()) {
+      memcpy(&out[hdr.dfas_offset], dfas.data(), dfas.size());
+    }
+    if (!phs.empty()) {
+      memcpy(&out[hdr.phases_offset], phs.data(),
+             phs.size() * sizeof(SnapshotPhase));
+    }
+    return true;
+  }
+
+  // write snapshot so that concurrent readers never see partially written file
+  static bool write_snapshot_file(const std::string &path,
+                                  const std::vector<char> &data) {
+    std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+
+    FILE *f = fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+      return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      remove(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+};
@@ -9,61 +9,179 @@ check repository for more information
 
 libexeptor
 LD_PRELOAD this library to intercept calls to execl, execlp, execle, execv,
-execvp, execve, execvpe, posix_spawn and posix_spawnp
+execvp, execve, execvpe, execveat, fexecve, posix_spawn and posix_spawnp
 
-not (yet) implemented: execveat, fexecve
+exec hooks only use libc, so this file can also be built as lean libexeptor
+(EXEPTOR_LEAN) which depends neither on C++ runtime nor on yaml-cpp and only
+works with precompiled config snapshots
 
 */
 
-#include <algorithm>
-#include <iostream>
-#include <string>
-#include <vector>
-
+#include <atomic>
+#include <cinttypes>
 #include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <spawn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#ifdef EXEPTOR_LEAN
+#include "snapshot.hpp"
+#else
 #include "config.hpp"
+#endif
+#include "exeptor-plugin.h"
+#include "phase.hpp"
+#include "rspfile.hpp"
+#include "statcache.hpp"
+
+#ifdef EXEPTOR_EMBEDDED_CONFIG
+// generated by exeptor-compile-config --cxx
+#include "exeptor-embedded-config.hpp"
+#endif
+
+// only exec hooks are exported from lean libexeptor
+#define EXEPTOR_EXPORT __attribute__((visibility("default")))
+
+// process this memory belongs to, kept up to date in fork children. vfork
+// children share memory of their parent, so they see pid of the parent here
+pid_t g_pid = 0; // 0 until initlib
+
+void update_pid() { g_pid = getpid(); }
+
+bool in_vfork_child() { return g_pid != 0 && getpid() != g_pid; }
+
+// log records are formatted on stack and go to EXEPTOR_LOG with a single
+// write(2) on O_APPEND descriptor, so records of concurrent processes don't
+// interleave (up to PIPE_BUF bytes) and no stdio buffer is ever duplicated by
+// fork. descriptor is kept only by the process g_pid names (fork children
+// inherit it). vfork children can't keep descriptors in memory they share
+// with their parent, they open the log for each record of their own
+const char *logpath = nullptr; // logging is off unless it's set
+int logfd = -1;                // opened on first record
+
+int open_log() {
+  int fd = open(logpath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "libexeptor error: wasn't able to open file '%s'\n",
+            logpath);
+    exit(2);
+  }
+  return fd;
+}
+
+// append formatted message to record of at most PIPE_BUF bytes
+size_t logformat(char *buf, size_t used, const char *fmt, va_list args) {
+  if (used >= PIPE_BUF - 1) {
+    return used;
+  }
+  int n = vsnprintf(buf + used, PIPE_BUF - used, fmt, args);
+  if (n < 0) {
+    return used;
+  }
+  used += static_cast<size_t>(n);
+  if (used >= PIPE_BUF - 1) {
+    used = PIPE_BUF - 1;
+    buf[used - 1] = '\n'; // cut record still ends the line
+  }
+  return used;
+}
+
+void logwrite(const char *buf, size_t len) {
+  int saved_errno = errno; // hooks log right before returning errno of exec
+  bool owner = getpid() == g_pid;
+  int fd = __atomic_load_n(&logfd, __ATOMIC_ACQUIRE);
+  bool own = owner && fd >= 0;
+  if (!own) {
+    fd = open_log();
+  }
+
+  ssize_t n;
+  do {
+    n = write(fd, buf, len);
+  } while (n < 0 && errno == EINTR);
+
+  // owner keeps descriptor of its first record, other threads racing for
+  // it close theirs
+  int expected = -1;
+  if (!own &&
+      !(owner && __atomic_compare_exchange_n(&logfd, &expected, fd, false,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))) {
+    close(fd);
+  }
+  errno = saved_errno;
+}
+
+void logrecord(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void logrecord(const char *fmt, ...) {
+  char buf[PIPE_BUF];
+  va_list args;
+  va_start(args, fmt);
+  size_t len = logformat(buf, 0, fmt, args);
+  va_end(args);
+  logwrite(buf, len);
+}
 
-FILE *logfile = nullptr;
+// record with location of the call: head is formatted with function, file
+// and line, then goes the message and newline
+void logrecord_at(const char *head, const char *func, const char *file,
+                  unsigned line, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+void logrecord_at(const char *head, const char *func, const char *file,
+                  unsigned line, const char *fmt, ...) {
+  char buf[PIPE_BUF];
+  int n = snprintf(buf, sizeof(buf), head, func, file, line);
+  size_t len = n < 0 ? 0 : static_cast<size_t>(n);
+  if (len >= PIPE_BUF - 1) {
+    len = PIPE_BUF - 1;
+  }
+  va_list args;
+  va_start(args, fmt);
+  len = logformat(buf, len, fmt, args);
+  va_end(args);
+  if (len < PIPE_BUF - 1) {
+    buf[len++] = '\n';
+  }
+  logwrite(buf, len);
+}
 
 #if 0
 #define logprintf(...)
-#define logflush(...)
+#define logprintf_at(...)
 #else
+// arguments are not even evaluated when logging is off
 #define logprintf(...)                                                         \
-  if (logfile)                                                                 \
-  fprintf(logfile, __VA_ARGS__)
-#define logflush(...)                                                          \
-  if (logfile)                                                                 \
-  fflush(logfile)
+  do {                                                                         \
+    if (logpath) {                                                             \
+      logrecord(__VA_ARGS__);                                                  \
+    }                                                                          \
+  } while (false)
+#define logprintf_at(head, ...)                                                \
+  do {                                                                         \
+    if (logpath) {                                                             \
+      logrecord_at(head, __func__, __FILE__, __LINE__, __VA_ARGS__);           \
+    }                                                                          \
+  } while (false)
 #endif
 
 #define FATAL(...)                                                             \
   do {                                                                         \
-    logprintf("FATAL error in %s at %s:%u\nMessage: ", __func__, __FILE__,     \
-              __LINE__);                                                       \
-    logprintf(__VA_ARGS__);                                                    \
-    logprintf("\n");                                                           \
-    logflush();                                                                \
+    logprintf_at("FATAL error in %s at %s:%u\nMessage: ", __VA_ARGS__);        \
     _exit(7);                                                                  \
   } while (false)
 
 #ifndef NDEBUG
-#define DEBUG(...)                                                             \
-  do {                                                                         \
-    logprintf("DEBUG: %s at %s:%u. Message: ", __func__, __FILE__, __LINE__);  \
-    logprintf(__VA_ARGS__);                                                    \
-    logprintf("\n");                                                           \
-    logflush();                                                                \
-  } while (false)
+#define DEBUG(...) logprintf_at("DEBUG: %s at %s:%u. Message: ", __VA_ARGS__)
 #else
 #define DEBUG(...)
 #endif
@@ -98,409 +216,2145 @@ typedef int (*posix_spawnp_t)(
 
 posix_spawnp_t real_posix_spawnp = nullptr;
 
-ReplacementSettings g_settings;
-bool g_intercept_allowed = true;
-char cmdline[4096]; // cmdline of host application
+typedef int (*execveat_t)(int dirfd, const char *pathname, char *const argv[],
+                          char *const envp[], int flags);
+execveat_t real_execveat = nullptr;
 
-void initlib() {
-  static bool exeptor_initialized = false;
-  if (exeptor_initialized)
-    return;
+typedef int (*fexecve_t)(int fd, char *const argv[], char *const envp[]);
+fexecve_t real_fexecve = nullptr;
 
-  char *p = getenv("EXEPTOR_LOG");
-  if (p) {
-    logfile = fopen(p, "at");
-    if (!logfile) {
-      std::cerr << "libexeptor error: wasn't able to open file '" << p << "'"
-                << std::endl;
+// original functions get resolved on first use: most processes call only one.
+// threads may race here, but all of them store the same pointer
+template <typename func_t> func_t resolve_real(func_t &func, const char *name) {
+  func_t f = __atomic_load_n(&func, __ATOMIC_ACQUIRE);
+  if (!f) {
+    f = reinterpret_cast<func_t>(dlsym(RTLD_NEXT, name));
+    if (!f) {
+      fprintf(stderr, "libexeptor error: wasn't able to find original %s\n",
+              name);
       exit(2);
     }
+    __atomic_store_n(&func, f, __ATOMIC_RELEASE);
   }
+  return f;
+}
 
-  char *config_path = getenv("EXEPTOR_CONFIG");
-  char default_config_path[] = "/etc/libexeptor.yaml";
-  if (!config_path) {
-    config_path = default_config_path;
-  }
+#define REAL(name) resolve_real(real_##name, #name)
 
-  if (!g_settings.parse_from_file(config_path)) {
-    std::cerr << "ERROR: failed to parse config file" << std::endl;
-    exit(2);
+// config snapshot together with memory it lives in
+struct LoadedConfig {
+  ConfigSnapshot snapshot;
+  bool mapped = false; // snapshot bytes come from mmap
+#ifndef EXEPTOR_LEAN
+  std::vector<char> storage; // snapshot bytes if not mmap'ed
+#endif
+
+  void release() {
+    if (mapped) {
+      munmap(const_cast<SnapshotHeader *>(snapshot.header()), snapshot.size());
+      mapped = false;
+    }
+    snapshot.detach();
+#ifndef EXEPTOR_LEAN
+    std::vector<char>().swap(storage);
+#endif
+  }
+};
+
+// config in use and the spare one: the spare is either free, or retired by
+// reload and waiting for hooks which may still read it
+LoadedConfig g_configs[2];
+std::atomic<LoadedConfig *> g_config(&g_configs[0]);
+
+// read side of config reload. readers count themselves under parity of
+// current epoch, reload flips the epoch after swapping config in, so retired
+// config can be released once readers of the old parity are gone.
+// readers never wait, they only retry if they race with a flip
+std::atomic<unsigned> g_config_epoch(0);
+std::atomic<unsigned> g_config_readers[2];
+
+class ConfigPin {
+public:
+  explicit ConfigPin(bool pin) : pinned_(pin) {
+    while (pinned_) {
+      unsigned epoch = g_config_epoch.load();
+      parity_ = epoch & 1;
+      g_config_readers[parity_].fetch_add(1);
+      if (g_config_epoch.load() == epoch) {
+        break;
+      }
+      g_config_readers[parity_].fetch_sub(1);
+    }
+    config_ = g_config.load();
   }
 
-  real_execv = (execv_t)dlsym(RTLD_NEXT, "execv");
-  real_execvp = (execvp_t)dlsym(RTLD_NEXT, "execvp");
-  real_execve = (execve_t)dlsym(RTLD_NEXT, "execve");
-  real_execvpe = (execvpe_t)dlsym(RTLD_NEXT, "execvpe");
-  real_posix_spawn = (posix_spawn_t)dlsym(RTLD_NEXT, "posix_spawn");
-  real_posix_spawnp = (posix_spawnp_t)dlsym(RTLD_NEXT, "posix_spawnp");
+  ConfigPin(const ConfigPin &) = delete;
+  ConfigPin &operator=(const ConfigPin &) = delete;
 
-  if (!real_execv || !real_execvp || !real_execve || !real_execvpe ||
-      !real_posix_spawn || !real_posix_spawnp) {
-    std::cerr << "libexeptor error: wasn't able find original functions"
-              << std::endl;
-    exit(2);
-  }
+  ~ConfigPin() { release(); }
 
-  FILE *f = fopen("/proc/self/cmdline", "rt");
-  if (!f) {
-    std::cerr << "libexeptor error: wasn't able to read /proc/self/cmdline"
-              << std::endl;
-    exit(3);
+  // config must not be read after this
+  void release() {
+    if (pinned_) {
+      g_config_readers[parity_].fetch_sub(1, std::memory_order_release);
+      pinned_ = false;
+    }
   }
-  fread(cmdline, sizeof(cmdline), 1, f);
-  fclose(f);
 
-  logprintf("libexeptor: loaded to '%s'\n", cmdline);
-  logflush();
+  const ConfigSnapshot &snapshot() const { return config_->snapshot; }
 
-  for (const auto &it : g_settings.programs) {
-    if (it.second == cmdline) {
-      g_intercept_allowed = false;
-      break; // prevent recursive calls from tools that have already
-             // been replaced
-    }
+private:
+  bool pinned_;
+  unsigned parity_ = 0;
+  const LoadedConfig *config_;
+};
+
+// for tools and tests which don't race with reload
+const ConfigSnapshot &current_snapshot() {
+  return g_config.load(std::memory_order_acquire)->snapshot;
+}
+
+bool g_intercept_allowed = true;
+bool g_phase_off = false; // see check_phase
+const char *g_progname = ""; // argv[0] of host application
+
+#ifdef EXEPTOR_LEAN
+
+// lean libexeptor can't parse yaml, snapshot must be compiled in advance
+bool load_config(const char *config_path, LoadedConfig &config) {
+  config.release();
+  if (map_cached_snapshot(config_path, config.snapshot)) {
+    config.mapped = true;
+    return true;
   }
 
-  exeptor_initialized = true;
+  fprintf(stderr,
+          "libexeptor error: no up-to-date snapshot found, "
+          "use exeptor-compile-config to create it\n");
+  return false;
 }
 
-// static void __attribute__((constructor)) libmain() { initlib(); }
+#else
 
-#define num_exeptor_vars 4
-char exeptor_envs[num_exeptor_vars][PATH_MAX + 20] = {
-    "EXEPTOR_VERBOSE", "EXEPTOR_CONFIG", "EXEPTOR_LOG", "LD_PRELOAD"};
+ReplacementSettings g_settings;
 
-// for use with exec-calls that accept envp argument
-void prep_common_envp(std::vector<const char *> &envs) {
-  static char envs_tmp[num_exeptor_vars][sizeof(exeptor_envs[0])];
+// compile settings to in-memory snapshot and start using it
+bool apply_settings(const ReplacementSettings &settings,
+                    const SnapshotSource &source) {
+  LoadedConfig &config = *g_config.load();
+  config.release();
+  if (!settings.build_snapshot(source, config.storage)) {
+    return false;
+  }
+  return config.snapshot.attach(config.storage.data(), config.storage.size());
+}
 
-  for (size_t i = 0; i < num_exeptor_vars; i++) {
-    char *p = getenv(exeptor_envs[i]);
+bool apply_settings(const ReplacementSettings &settings) {
+  SnapshotSource source;
+  memset(&source, 0, sizeof(source));
+  return apply_settings(settings, source);
+}
 
-    if (!p) {
-      continue;
-    }
+// use snapshot cached next to config file if it's up to date.
+// otherwise parse yaml and try to refresh the cache for other processes
+bool load_config(const char *config_path, LoadedConfig &config) {
+  config.release();
+  if (map_cached_snapshot(config_path, config.snapshot)) {
+    config.mapped = true;
+    return true;
+  }
 
-    snprintf(envs_tmp[i], sizeof(envs_tmp[i]), "%s=%s", exeptor_envs[i], p);
-    envs.push_back(envs_tmp[i]);
+  // settings of previous load must not leak into reloaded config
+  ReplacementSettings settings;
+  if (!settings.compile_file(config_path, config.storage) ||
+      !config.snapshot.attach(config.storage.data(), config.storage.size())) {
+    return false;
   }
 
-  auto szorder = [](const char *left, const char *right) {
-    return strcmp(left, right) < 0;
-  };
-  auto szequal = [](const char *left, const char *right) {
-    return strcmp(left, right) == 0;
-  };
+  char cache_path[PATH_MAX];
+  if (snapshot_cache_path(config_path, cache_path, sizeof(cache_path)) &&
+      !ReplacementSettings::write_snapshot_file(cache_path, config.storage)) {
+    if (getenv("EXEPTOR_VERBOSE")) {
+      fprintf(stderr, "libexeptor: wasn't able to write config snapshot '%s'\n",
+              cache_path);
+    }
+  }
 
-  // deduplicate envs
-  std::sort(envs.begin(), envs.end(), szorder);
-  envs.erase(std::unique(envs.begin(), envs.end(), szequal), envs.end());
-  envs.push_back(nullptr); // insert NULL in any case (for execXXe functions)
+  return true;
 }
 
-void prep_prog_argv(std::string &prog, std::vector<const char *> &args) {
-  auto t = g_settings.programs.find(prog);
-  if (t != g_settings.programs.end()) {
-    auto &del_opts = g_settings.del_options[prog]; // [] may create vector here..
-    auto &add_opts = g_settings.add_options[prog]; // ..and here, but it's ok
+#endif // EXEPTOR_LEAN
 
-    if (args.size() > 0) {
-      args[0] = t->second.c_str();
-    }
+#define num_exeptor_vars 7
+const char *const exeptor_envs[num_exeptor_vars] = {
+    "EXEPTOR_VERBOSE", "EXEPTOR_CONFIG", "EXEPTOR_SNAPSHOT_FD", "EXEPTOR_LOG",
+    "LD_PRELOAD",      EXEPTOR_PHASE,    "EXEPTOR_STATCACHE_FD"};
 
-    if (args.size() > 1 && !del_opts.empty()) {
-      // don't replace argv[0]
-      for (auto it = args.begin() + 1; it != args.end();) {
-        if (del_opts.find(*it) != del_opts.end()) {
-          it = args.erase(it);
-        } else {
-          it++;
-        }
-      }
+// index of exeptor variable set by "NAME=value" entry, -1 if it's not ours
+int exeptor_var_index(const char *entry) {
+  if (entry[0] != 'E' && entry[0] != 'L') {
+    return -1;
+  }
+  for (int i = 0; i < num_exeptor_vars; i++) {
+    const char *name = exeptor_envs[i];
+    size_t k = 0;
+    while (name[k] && entry[k] == name[k]) {
+      k++;
     }
-
-    for (auto &opt : add_opts) {
-      args.push_back(opt.c_str());
+    if (!name[k] && entry[k] == '=') {
+      return i;
     }
-
-    prog = t->second.c_str();
   }
-
-  args.push_back(nullptr); // insert NULL in any case (for execvXX functions)
+  return -1;
 }
 
-void prep_prog_argv_env(std::string &prog, std::vector<const char *> &args,
-                        std::vector<const char *> &envs) {
-  prep_prog_argv(prog, args);
+// "NAME=value" entries of exeptor variables which children of this process
+// get instead of ones in environ, see prep_common_envp. environ itself isn't
+// changed: hooks initialize libexeptor in whichever thread of application
+// calls them first, setenv there would race with getenv of other threads
+const char *g_own_envs[num_exeptor_vars] = {};
 
-  // TODO: add-environ, del-environ
-  /*
-  auto t = g_settings.programs.find(prog);
-  if (t != g_settings.programs.end()) {
-  }
-  */
-  prep_common_envp(envs);
+void set_own_env(const char *entry) {
+  g_own_envs[exeptor_var_index(entry)] = entry;
 }
 
-// return vector from NULL-terminated argv or envp list
-std::vector<const char *> vec_from_argv_envp(const char *const *argv) {
-  std::vector<const char *> ret;
+int g_snapshot_fd = -1; // memfd children find in EXEPTOR_SNAPSHOT_FD
 
-  if (argv) {
-    size_t i = 0;
-    while (argv[i]) {
-      ret.push_back(argv[i]);
-      i++;
+// share snapshot with child processes
+void publish_config() {
+  int fd = publish_snapshot(current_snapshot());
+  if (fd < 0) {
+    if (getenv("EXEPTOR_VERBOSE")) {
+      fprintf(stderr, "libexeptor: wasn't able to publish config snapshot\n");
     }
+    return;
   }
 
-  return ret;
+  static char entry[sizeof("EXEPTOR_SNAPSHOT_FD=") + 16];
+  snprintf(entry, sizeof(entry), "EXEPTOR_SNAPSHOT_FD=%d", fd);
+  set_own_env(entry);
+  g_snapshot_fd = fd;
 }
 
-// return vector from va_list initialized with va_start.
-// this function doesn't call va_end
-std::vector<const char *> vec_from_va_list(va_list args, const char *arg) {
-  std::vector<const char *> ret;
+// path -> inode table of this build (see statcache.hpp), its descriptor is
+// known at initialization and it gets mapped on the first lookup by inode
+// (right away in the first process of a build, see publish_stat_cache)
+int g_stat_cache_fd = -1;
+StatCacheSlot *g_stat_cache = nullptr;
+bool g_stat_cache_failed = false;
+
+StatCacheSlot *stat_cache() {
+  StatCacheSlot *cache = __atomic_load_n(&g_stat_cache, __ATOMIC_ACQUIRE);
+  if (cache || __atomic_load_n(&g_stat_cache_failed, __ATOMIC_RELAXED)) {
+    return cache;
+  }
 
-  const char *parg = arg;
-  while (parg != nullptr) {
-    ret.push_back(parg);
-    parg = va_arg(args, const char *);
+  cache = map_statcache(g_stat_cache_fd);
+  if (!cache) {
+    __atomic_store_n(&g_stat_cache_failed, true, __ATOMIC_RELAXED);
+    return nullptr;
   }
 
-  return ret;
+  // another thread could have mapped it meanwhile
+  StatCacheSlot *expected = nullptr;
+  if (!__atomic_compare_exchange_n(&g_stat_cache, &expected, cache, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    munmap(cache, EXEPTOR_STATCACHE_SIZE);
+    cache = expected;
+  }
+  return cache;
 }
 
-// for posix_spawn & posix_spawnp
-int _posix_spawn(pid_t *__restrict pid, const char *__restrict path,
-                 const posix_spawn_file_actions_t *__restrict file_actions,
-                 const posix_spawnattr_t *__restrict attrp,
-                 char *const *__restrict argv, char *const *__restrict envp,
-                 const char *funcname, posix_spawn_t posix_spawn_func) {
-  logprintf("{intercept} app is calling %s('%s')\n", funcname, path);
-  logflush();
+// keys of table also depend on snapshot, so changed config never sees
+// entries made for the old one
+uint64_t stat_cache_salt(const ConfigSnapshot &snapshot) {
+  const SnapshotSource &source = snapshot.header()->source;
+  return snapshot_hash(reinterpret_cast<const char *>(&source),
+                       sizeof(source)) *
+         0x9e3779b97f4a7c15ULL;
+}
 
-  auto envs = vec_from_argv_envp(envp);
+// identity of file path leads to, as exec would find it. relative paths are
+// keyed by current directory, bare names of execvp-like calls by PATH
+bool path_inode(const ConfigSnapshot &snapshot, StatCacheSlot *cache,
+                const char *path, bool path_search, uint64_t &dev,
+                uint64_t &ino) {
+  const uint64_t mix = 0x9e3779b97f4a7c15ULL;
+  char buf[PATH_MAX];
+  const char *search_path = nullptr;
+  uint64_t key;
+  if (path[0] == '/') {
+    key = snapshot_hash(path);
+  } else if (path_search && !strchr(path, '/')) {
+    search_path = getenv("PATH");
+    if (!search_path) {
+      return false;
+    }
+    key = (snapshot_hash(search_path) * mix) ^ snapshot_hash(path);
+  } else {
+    if (!getcwd(buf, sizeof(buf))) {
+      return false;
+    }
+    key = (snapshot_hash(buf) * mix) ^ snapshot_hash(path);
+  }
+  key ^= stat_cache_salt(snapshot);
+  key = key ? key : 1;
 
-  if (g_intercept_allowed) {
-    logprintf("{intercept} -> replacement for '%s' is not blocked\n", path);
-    auto t = g_settings.programs.find(path);
-    if (t != g_settings.programs.end()) {
-      auto args = vec_from_argv_envp(argv);
+  if (cache && statcache_get(cache, key, dev, ino)) {
+    return true;
+  }
 
-      std::string prog = path;
-      prep_prog_argv_env(prog, args, envs);
+  const char *target = path;
+  if (search_path) {
+    if (!resolve_in_path(path, search_path, buf, sizeof(buf))) {
+      return false;
+    }
+    target = buf;
+  }
 
-      logprintf("[INTERCEPT] %s( /* pid = */ %p, \"%s\", ... ); // replaced "
-                "with '%s' \n",
-                funcname, pid, path, prog.c_str());
-      logflush();
+  struct stat st;
+  if (stat(target, &st) != 0) {
+    return false;
+  }
+  dev = static_cast<uint64_t>(st.st_dev);
+  ino = static_cast<uint64_t>(st.st_ino);
+  if (cache) {
+    statcache_put(cache, key, dev, ino);
+  }
+  return true;
+}
 
-      return posix_spawn_func(pid, prog.c_str(), file_actions, attrp,
-                              const_cast<char *const *>(args.data()),
-                              const_cast<char *const *>(envs.data()));
-    } else {
-      logprintf("{intercept} -> no replacement found for '%s'\n", path);
-    }
-  } else {
-    logprintf("{intercept} -> not allowed to replace '%s'\n", path);
+// binary of program matched by inode. relative names depend on current
+// directory of each process, so they only match by name
+bool program_inode(const ConfigSnapshot &snapshot, StatCacheSlot *cache,
+                   const SnapshotProgram &p, uint64_t &dev, uint64_t &ino) {
+  const char *name = snapshot.str(p.name);
+  if (strchr(name, '/') && name[0] != '/') {
+    return false;
   }
-  prep_common_envp(envs);
-  return posix_spawn_func(pid, path, file_actions, attrp, argv,
-                          const_cast<char *const *>(envs.data()));
+  return path_inode(snapshot, cache, name, true, dev, ino);
 }
 
-// for execv & execvp
-int _execv(const char *pathname, char *const argv[], const char *funcname,
-           execv_t execv_func) {
-  logprintf("{intercept} app is calling %s('%s')\n", funcname, pathname);
-  logflush();
+uint64_t inode_key(const ConfigSnapshot &snapshot, uint64_t dev,
+                   uint64_t ino) {
+  const uint64_t id[2] = {dev, ino};
+  uint64_t key = snapshot_hash(reinterpret_cast<const char *>(id),
+                               sizeof(id)) ^
+                 stat_cache_salt(snapshot);
+  return key ? key : 1;
+}
 
-  if (g_intercept_allowed) {
-    auto t = g_settings.programs.find(pathname);
-    if (t != g_settings.programs.end()) {
-      auto args = vec_from_argv_envp(argv);
+// present once every binary of config is in the table
+uint64_t inodes_recorded_key(const ConfigSnapshot &snapshot) {
+  uint64_t key = snapshot_hash("exeptor-inodes") ^ stat_cache_salt(snapshot);
+  return key ? key : 1;
+}
 
-      std::string prog = pathname;
-      prep_prog_argv(prog, args);
+// binaries of programs matched by inode are looked up by the first process
+// of a build, before it has any children, and go to the table as dev:ino ->
+// program index. the first name of a binary wins
+void record_inode_programs(const ConfigSnapshot &snapshot,
+                           StatCacheSlot *cache) {
+  for (uint32_t i = 0; i < snapshot.num_programs(); i++) {
+    const auto &p = snapshot.program(i);
+    uint64_t dev, ino;
+    if (p.pattern || !snapshot.group(p.group).match_inodes ||
+        !program_inode(snapshot, cache, p, dev, ino)) {
+      continue;
+    }
+    if (!statcache_put(cache, inode_key(snapshot, dev, ino), i, 0)) {
+      return;
+    }
+  }
+  statcache_put(cache, inodes_recorded_key(snapshot), 1, 0);
+}
 
-      logprintf("[INTERCEPT] %s(\"%s\", ...); // replaced with '%s' \n",
-                funcname, pathname, prog.c_str());
-      logflush();
-      return execv_func(prog.c_str(), const_cast<char *const *>(args.data()));
-    } else {
-      logprintf("{intercept} -> no replacement found for '%s'\n", pathname);
+// take table of the build from parent or, in the first process of a build
+// with programs to match by inode, make a new one for descendants
+void publish_stat_cache(const ConfigSnapshot &snapshot) {
+  const char *inherited = getenv("EXEPTOR_STATCACHE_FD");
+  if (inherited) {
+    char *end = nullptr;
+    long fd = strtol(inherited, &end, 10);
+    if (end != inherited && !*end && fd > STDERR_FILENO && fd <= INT_MAX) {
+      g_stat_cache_fd = static_cast<int>(fd);
     }
-  } else {
-    logprintf("{intercept} -> not allowed to replace '%s'\n", pathname);
+    return;
+  }
+  if (snapshot.num_inode_programs() == 0) {
+    return;
+  }
+
+  int fd = create_statcache();
+  if (fd < 0) {
+    return;
+  }
+  static char entry[sizeof("EXEPTOR_STATCACHE_FD=") + 16];
+  snprintf(entry, sizeof(entry), "EXEPTOR_STATCACHE_FD=%d", fd);
+  set_own_env(entry);
+  g_stat_cache_fd = fd;
+
+  StatCacheSlot *cache = stat_cache();
+  if (cache) {
+    record_inode_programs(snapshot, cache);
   }
-  return execv_func(pathname, argv);
 }
 
-// for execve & execvpe
-int _execve(const char *pathname, char *const argv[], char *const envp[],
-            const char *funcname, execve_t execve_func) {
-  logprintf("{intercept} app is calling %s('%s')\n", funcname, pathname);
-  logflush();
-  auto envs = vec_from_argv_envp(envp);
+// plugins of groups (see include/exeptor-plugin.h) get loaded together with
+// config: hooks may run in vfork children, where dlopen is unsafe. the table
+// only grows, so hooks read it without locks. plugins are never unloaded
+#define EXEPTOR_PLUGINS 16
+#define EXEPTOR_PLUGIN_ROOM 64      // items plugin may add to argv and envp
+#define EXEPTOR_PLUGIN_SCRATCH 4096 // bytes for strings made by plugin
+
+struct LoadedPlugin {
+  char path[PATH_MAX]; // as given in config
+  exeptor_plugin_rewrite_t rewrite;
+};
+
+LoadedPlugin g_plugins[EXEPTOR_PLUGINS];
+std::atomic<size_t> g_plugins_count(0);
+
+exeptor_plugin_rewrite_t find_plugin(const char *path) {
+  size_t count = g_plugins_count.load(std::memory_order_acquire);
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(g_plugins[i].path, path) == 0) {
+      return g_plugins[i].rewrite;
+    }
+  }
+  return nullptr;
+}
 
-  if (g_intercept_allowed) {
-    auto t = g_settings.programs.find(pathname);
-    if (t != g_settings.programs.end()) {
-      auto args = vec_from_argv_envp(argv);
-      std::string prog = pathname;
-      prep_prog_argv_env(prog, args, envs);
+// load plugins config refers to, unless this process never replaces
+// anything. returns false if some plugin can't be used
+bool load_plugins(const ConfigSnapshot &snapshot) {
+  if (!g_intercept_allowed || g_phase_off) {
+    return true;
+  }
 
-      logprintf("[INTERCEPT] %s(\"%s\", ...); // replaced with '%s' \n",
-                funcname, pathname, prog.c_str());
-      logflush();
+  for (uint32_t i = 0; i < snapshot.num_groups(); i++) {
+    const auto &group = snapshot.group(i);
+    const char *path = snapshot.str(group.plugin);
+    if (!group.plugin || find_plugin(path)) {
+      continue;
+    }
+    size_t count = g_plugins_count.load(std::memory_order_relaxed);
+    if (count == EXEPTOR_PLUGINS || strlen(path) >= PATH_MAX) {
+      fprintf(stderr, "libexeptor error: can't load plugin '%s': %s\n", path,
+              count == EXEPTOR_PLUGINS ? "too many plugins" : "path too long");
+      return false;
+    }
 
-      return execve_func(prog.c_str(), const_cast<char *const *>(args.data()),
-                  const_cast<char *const *>(envs.data()));
-    } else {
-      logprintf("{intercept} -> no replacement found for '%s'\n", pathname);
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    void *hook = handle ? dlsym(handle, EXEPTOR_PLUGIN_HOOK) : nullptr;
+    if (!hook) {
+      fprintf(stderr, "libexeptor error: can't load plugin '%s': %s\n", path,
+              dlerror());
+      if (handle) {
+        dlclose(handle);
+      }
+      return false;
     }
-  } else {
-    logprintf("{intercept} -> not allowed to replace '%s'\n", pathname);
+
+    LoadedPlugin &plugin = g_plugins[count];
+    strcpy(plugin.path, path);
+    plugin.rewrite = reinterpret_cast<exeptor_plugin_rewrite_t>(hook);
+    g_plugins_count.store(count + 1, std::memory_order_release);
+
+    logprintf("libexeptor: loaded plugin '%s'\n", path);
   }
-  prep_common_envp(envs);
-  return execve_func(pathname, argv, const_cast<char *const *>(envs.data()));
+  return true;
 }
 
-// for execl & execlp
-int _execl(const char *pathname, std::vector<const char *> args,
-           const char *origfuncname, execv_t execv_func) {
-  logprintf("{intercept} app is calling %s('%s')\n", origfuncname, pathname);
-  logflush();
+#ifndef EXEPTOR_EMBEDDED_CONFIG
+
+// long-lived spawners (make, build daemons) check their config for changes
+// once per this many spawns. one stat() is all it costs when nothing changed
+#define EXEPTOR_RELOAD_INTERVAL 64
+
+char g_config_path[PATH_MAX];
+std::atomic<unsigned> g_spawns(0);
+std::atomic_flag g_reloading = ATOMIC_FLAG_INIT;
+LoadedConfig *g_retired = nullptr; // owned by whoever holds g_reloading
+unsigned g_retired_parity = 0;
+
+// load changed config to the spare slot and swap it in. nobody waits here:
+// concurrent reloads and reloads while previous config is still being read
+// just give up until next check. returns true if config got replaced
+bool reload_config() {
+  if (!g_config_path[0] ||
+      g_reloading.test_and_set(std::memory_order_acquire)) {
+    return false;
+  }
 
-  if (g_intercept_allowed) {
-    auto t = g_settings.programs.find(pathname);
-    if (t != g_settings.programs.end()) {
-      std::string prog = pathname;
-      prep_prog_argv(prog, args);
+  if (g_retired && g_config_readers[g_retired_parity].load() == 0) {
+    g_retired->release();
+    g_retired = nullptr;
+  }
 
-      logprintf("[INTERCEPT] execl(\"%s\", ...); // replaced with '%s' \n",
-                pathname, prog.c_str());
-      logflush();
+  bool reloaded = false;
+  LoadedConfig *current = g_config.load();
+  LoadedConfig *next = current == &g_configs[0] ? &g_configs[1] : &g_configs[0];
+
+  struct stat st;
+  SnapshotSource source;
+  if (!g_retired && stat(g_config_path, &st) == 0) {
+    snapshot_source_from_stat(g_config_path, st, source);
+    if (!current->snapshot.built_from(source)) {
+      reloaded = load_config(g_config_path, *next) &&
+                 load_plugins(next->snapshot);
+      if (!reloaded) {
+        next->release();
+      }
+    }
+  }
 
-      return execv_func(prog.c_str(), const_cast<char *const *>(args.data()));
-    } else {
-      logprintf("{intercept} -> no replacement found for '%s'\n", pathname);
+  if (reloaded) {
+    // children get new snapshot under the same descriptor number, so
+    // EXEPTOR_SNAPSHOT_FD stays valid and environ isn't touched
+    int fd = publish_snapshot(next->snapshot);
+    if (fd >= 0 && g_snapshot_fd >= 0) {
+      dup2(fd, g_snapshot_fd);
     }
-  } else {
-    logprintf("{intercept} -> not allowed to replace '%s'\n", pathname);
+    if (fd >= 0 && fd != g_snapshot_fd) {
+      close(fd);
+    }
+
+    g_config.store(next);
+    g_retired_parity = g_config_epoch.fetch_add(1) & 1;
+    g_retired = current;
+
+    logprintf("libexeptor: reloaded config '%s'\n", g_config_path);
   }
-  args.push_back(nullptr);
-  return execv_func(pathname, const_cast<char *const *>(args.data()));
-}
 
-extern "C" {
+  g_reloading.clear(std::memory_order_release);
+  return reloaded;
+}
 
-int posix_spawn(pid_t *__restrict pid, const char *__restrict path,
-                const posix_spawn_file_actions_t *__restrict file_actions,
-                const posix_spawnattr_t *__restrict attrp,
-                char *const *__restrict argv, char *const *__restrict envp) {
-  initlib();
-  return _posix_spawn(pid, path, file_actions, attrp, argv, envp, "posix_spawn",
-                      real_posix_spawn);
+void maybe_reload_config() {
+  if (g_spawns.fetch_add(1, std::memory_order_relaxed) %
+          EXEPTOR_RELOAD_INTERVAL ==
+      EXEPTOR_RELOAD_INTERVAL - 1) {
+    reload_config();
+  }
 }
 
-int posix_spawnp(pid_t *__restrict pid, const char *__restrict file,
-                 const posix_spawn_file_actions_t *__restrict file_actions,
-                 const posix_spawnattr_t *__restrict attrp,
-                 char *const *__restrict argv, char *const *__restrict envp) {
-  initlib();
-  return _posix_spawn(pid, file, file_actions, attrp, argv, envp,
-                      "posix_spawnp", real_posix_spawnp);
+#else
+
+void maybe_reload_config() {}
+
+#endif // EXEPTOR_EMBEDDED_CONFIG
+
+// replacements get EXEPTOR_REPLACED=<group id>:<depth> in environment
+// when libexeptor runs them, so guard against recursion costs one getenv
+#define EXEPTOR_REPLACED "EXEPTOR_REPLACED"
+unsigned g_replaced_depth = 0; // 0 unless this process is a replacement
+
+bool is_replaced_marker(const char *entry) {
+  return strncmp(entry, EXEPTOR_REPLACED "=", sizeof(EXEPTOR_REPLACED)) == 0;
 }
 
-int execv(const char *pathname, char *const argv[]) {
-  initlib();
-  return _execv(pathname, argv, "execv", real_execv);
+// marker this process was started with, see take_replaced_marker
+char g_replaced_marker[32];
+bool g_has_replaced_marker = false;
+
+// marker is taken out of environ while libexeptor gets loaded, no threads
+// exist yet to read environ meanwhile. so other children of replacement get
+// intercepted as usual, even ones spawned without hooks (system() of glibc).
+// too long marker is kept as broken one
+__attribute__((constructor)) void take_replaced_marker() {
+  char **kept = environ;
+  for (char **e = environ; e && *e; e++) {
+    if (!is_replaced_marker(*e)) {
+      *kept++ = *e;
+    } else if (!g_has_replaced_marker) {
+      const char *value = *e + sizeof(EXEPTOR_REPLACED);
+      bool fits = strlen(value) < sizeof(g_replaced_marker);
+      strcpy(g_replaced_marker, fits ? value : "");
+      g_has_replaced_marker = true;
+    }
+  }
+  if (kept) {
+    *kept = nullptr;
+  }
 }
 
-int execvp(const char *pathname, char *const argv[]) {
-  initlib();
-  return _execv(pathname, argv, "execvp", real_execvp);
+// replacements don't intercept anything (e.g. afl-gcc-fast runs gcc),
+// unless reintercept of their group allows it for wrapper chains
+void check_replaced_marker(const ConfigSnapshot &snapshot) {
+  if (!g_has_replaced_marker) {
+    return;
+  }
+  const char *marker = g_replaced_marker;
+
+  char *end = nullptr;
+  unsigned long long id = strtoull(marker, &end, 16);
+  unsigned long depth = 0;
+  if (end != marker && *end == ':') {
+    const char *s = end + 1;
+    depth = strtoul(s, &end, 10);
+    if (end == s || *end != '\0') {
+      depth = 0;
+    }
+  }
+
+  // broken marker still means that some libexeptor ran this replacement
+  g_replaced_depth = depth > 0 && depth <= EXEPTOR_MAX_REINTERCEPT
+                         ? static_cast<unsigned>(depth)
+                         : EXEPTOR_MAX_REINTERCEPT + 1;
+  const SnapshotGroup *group =
+      end != marker ? snapshot.find_group(id) : nullptr;
+  g_intercept_allowed = group && g_replaced_depth <= group->reintercept;
+
+  logprintf("libexeptor: replacement of depth %u, intercepting: %s\n",
+            g_replaced_depth, g_intercept_allowed ? "yes" : "no");
 }
 
-int execvpe(const char *file, char *const argv[], char *const envp[]) {
-  initlib();
-  return _execve(file, argv, envp, "execvpe", real_execvpe);
+// argv libc gave to constructors of libexeptor, see take_phase
+char **g_argv = nullptr;
+bool g_phase_decided = false;
+
+// replacements are off in build phases like "make check", see phase.hpp.
+// decision is passed to children in EXEPTOR_PHASE, so only the first process
+// of a build looks at its ancestors
+void decide_build_phase(const ConfigSnapshot &snapshot) {
+  char *fallback_argv[] = {program_invocation_name, nullptr};
+  g_phase_off = decide_phase(snapshot, getenv(EXEPTOR_PHASE),
+                             g_argv ? g_argv : fallback_argv) == PHASE_OFF;
+  set_own_env(g_phase_off ? EXEPTOR_PHASE "=off" : EXEPTOR_PHASE "=on");
+  g_phase_decided = true;
 }
 
-int execve(const char *pathname, char *const argv[], char *const envp[]) {
-  initlib();
-  return _execve(pathname, argv, envp, "execve", real_execve);
+void check_phase(const ConfigSnapshot &snapshot) {
+  if (snapshot.num_phases() == 0) {
+    return;
+  }
+
+  if (!g_phase_decided) {
+    decide_build_phase(snapshot);
+  }
+  logprintf("libexeptor: replacements are %s in this build phase\n",
+            g_phase_off ? "off" : "on");
 }
 
-// call to execl gets converted to execv
-int execl(const char *pathname, const char *arg, ...) {
-  initlib();
+// snapshot mapped by take_phase, initlib takes it over
+const void *g_early_snapshot = nullptr;
+size_t g_early_snapshot_size = 0;
+
+// processes of builds with phases inherit EXEPTOR_PHASE. they decide their
+// own phase while libexeptor gets loaded and no threads exist yet, so the
+// entry in environ gets updated too: children spawned without hooks (system()
+// or popen() of glibc) get the decision as well. config is never loaded
+// here, only snapshot of parent gets mapped
+__attribute__((constructor)) void take_phase(int, char **argv, char **) {
+  g_argv = argv;
+  if (!getenv(EXEPTOR_PHASE)) {
+    return;
+  }
 
-  va_list vl;
-  va_start(vl, arg);
-  auto args = vec_from_va_list(vl, arg);
-  va_end(vl);
+  ConfigSnapshot snapshot;
+#ifdef EXEPTOR_EMBEDDED_CONFIG
+  if (!snapshot.attach(exeptor_embedded_snapshot,
+                       sizeof(exeptor_embedded_snapshot))) {
+    return;
+  }
+#else
+  const char *snapshot_fd = getenv("EXEPTOR_SNAPSHOT_FD");
+  const char *config_path = getenv("EXEPTOR_CONFIG");
+  if (!snapshot_fd ||
+      !map_inherited_snapshot(snapshot_fd,
+                              config_path ? config_path
+                                          : "/etc/libexeptor.yaml",
+                              snapshot)) {
+    return;
+  }
+  g_early_snapshot = snapshot.header();
+  g_early_snapshot_size = snapshot.size();
+#endif
 
-  return _execl(pathname, args, "execl", real_execv);
+  if (snapshot.num_phases() == 0) {
+    return;
+  }
+  decide_build_phase(snapshot);
+  int phase = exeptor_var_index(EXEPTOR_PHASE "=");
+  for (char **e = environ; *e; e++) {
+    if (exeptor_var_index(*e) == phase) {
+      *e = const_cast<char *>(g_own_envs[phase]);
+    }
+  }
 }
 
-// call to execlp gets converted to execvp
-int execlp(const char *file, const char *arg, ...) {
-  initlib();
+// multi-threaded build drivers may call exec hooks from many threads at
+// once. after initialization the only cost is one acquire load
+std::atomic<bool> exeptor_initialized(false);
+std::atomic<bool> exeptor_init_started(false);
 
-  va_list vl;
-  va_start(vl, arg);
-  auto args = vec_from_va_list(vl, arg);
-  va_end(vl);
+void initlib() {
+  if (exeptor_initialized.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  if (exeptor_init_started.exchange(true, std::memory_order_acq_rel)) {
+    // another thread loads config, hooks can't go on without it
+    while (!exeptor_initialized.load(std::memory_order_acquire)) {
+      sched_yield();
+    }
+    return;
+  }
+
+  update_pid();
+  pthread_atfork(nullptr, nullptr, update_pid);
+  logpath = getenv("EXEPTOR_LOG");
+
+#ifdef EXEPTOR_EMBEDDED_CONFIG
+  // config is baked into this build of libexeptor: no files, no parsing
+  if (!g_config.load()->snapshot.attach(exeptor_embedded_snapshot,
+                                        sizeof(exeptor_embedded_snapshot))) {
+    fprintf(stderr, "ERROR: embedded config snapshot is broken\n");
+    exit(2);
+  }
+#else
+  char *config_path = getenv("EXEPTOR_CONFIG");
+  char default_config_path[] = "/etc/libexeptor.yaml";
+  if (!config_path) {
+    config_path = default_config_path;
+  }
+
+  // config is parsed once per build by the first process which loads
+  // libexeptor, all of its descendants get the result through memfd
+  LoadedConfig &config = *g_config.load();
+  char *snapshot_fd = getenv("EXEPTOR_SNAPSHOT_FD");
+  if (g_early_snapshot &&
+      config.snapshot.attach(g_early_snapshot, g_early_snapshot_size, true)) {
+    config.mapped = true;
+    g_snapshot_fd = atoi(snapshot_fd);
+  } else if (snapshot_fd &&
+             map_inherited_snapshot(snapshot_fd, config_path,
+                                    config.snapshot)) {
+    config.mapped = true;
+    g_snapshot_fd = atoi(snapshot_fd);
+  } else {
+    if (!load_config(config_path, config)) {
+      fprintf(stderr, "ERROR: failed to load config file '%s'\n",
+              config_path);
+      exit(2);
+    }
+    publish_config();
+  }
+
+  // remembered for reloads, snapshot is keyed by the path exactly as given
+  if (strlen(config_path) < sizeof(g_config_path)) {
+    strcpy(g_config_path, config_path);
+  }
+#endif
+
+  // argv[0] saved by libc at startup, no need to read /proc/self/cmdline
+  if (program_invocation_name) {
+    g_progname = program_invocation_name;
+  }
+
+  logprintf("libexeptor: loaded to '%s'\n", g_progname);
+
+  publish_stat_cache(current_snapshot());
+  check_replaced_marker(current_snapshot());
+  check_phase(current_snapshot());
+  if (!load_plugins(current_snapshot())) {
+    exit(2);
+  }
 
-  return _execl(file, args, "execlp", real_execvp);
+  exeptor_initialized.store(true, std::memory_order_release);
 }
 
-// call to execle gets converted to execve
-int execle(const char *pathname, const char *arg,
-           ... /*, (char *) NULL, char *const envp[] */) {
-  initlib();
-  logprintf("{intercept} app is calling execle('%s')\n", pathname);
-  logflush();
+// static void __attribute__((constructor)) libmain() { initlib(); }
 
-  std::vector<const char *> args;
-  va_list vl;
-  va_start(vl, arg);
-  const char *parg = arg;
-  while (parg != nullptr) {
-    args.push_back(parg);
-    parg = va_arg(vl, const char *);
+// NULL-terminated list of pointers for argv or envp of exec calls.
+// exec hooks may run in vfork children (posix_spawn, GNU make) where malloc is
+// unsafe, so the list lives on the caller's stack and only moves to anonymous
+// mmap for huge command lines. nothing between hook entry and real exec
+// touches the heap
+#define EXEPTOR_ARGLIST_INLINE 512
+#define EXEPTOR_ARGLIST_INLINE_TEXT 128
+#define EXEPTOR_RSP_FILES 16    // response files rewritten per exec, at most
+#define EXEPTOR_RSP_ARG_SIZE 32 // "@/proc/self/fd/N"
+
+struct ArgList {
+  const char *inline_items[EXEPTOR_ARGLIST_INLINE];
+  const char **items = inline_items;
+  size_t size = 0; // not counting terminating NULL
+  size_t capacity = EXEPTOR_ARGLIST_INLINE;
+  char inline_text[EXEPTOR_ARGLIST_INLINE_TEXT];
+  char *text = nullptr; // strings made during the call, see reserve_text
+  size_t text_size = 0;
+  size_t text_used = 0;
+  int fds[EXEPTOR_RSP_FILES + 1]; // response files made for this exec
+  size_t fds_count = 0;
+
+  ArgList() { items[0] = nullptr; }
+  ArgList(const ArgList &) = delete;
+  ArgList &operator=(const ArgList &) = delete;
+  ~ArgList() {
+    if (items != inline_items) {
+      munmap(items, capacity * sizeof(const char *));
+    }
+    if (text && text != inline_text) {
+      munmap(text, text_size);
+    }
+    // exec'ed or spawned program has its own copies by now
+    for (size_t i = 0; i < fds_count; i++) {
+      close(fds[i]);
+    }
+  }
+
+  // strings must stay in place until exec, so room for all of them gets
+  // reserved once before the first join
+  void reserve_text(size_t n) {
+    if (text) {
+      FATAL("text of exec arguments is already reserved");
+    }
+    if (n <= sizeof(inline_text)) {
+      text = inline_text;
+      text_size = n;
+      return;
+    }
+    void *p = mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      FATAL("out of memory while preparing %zu bytes of exec arguments", n);
+    }
+    text = static_cast<char *>(p);
+    text_size = n;
   }
-  char *const *envp = va_arg(vl, char *const *);
-  va_end(vl);
 
-  auto envs = vec_from_argv_envp(envp);
+  // "NAME=value" from reserved text
+  const char *join(const char *name, const char *value) {
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    if (text_used + name_len + value_len + 2 > text_size) {
+      FATAL("not enough text reserved for '%s' variable", name);
+    }
+    char *s = text + text_used;
+    memcpy(s, name, name_len);
+    s[name_len] = '=';
+    memcpy(s + name_len + 1, value, value_len + 1);
+    text_used += name_len + value_len + 2;
+    return s;
+  }
 
-  if (g_intercept_allowed) {
-    auto t = g_settings.programs.find(pathname);
-    if (t != g_settings.programs.end()) {
-      std::string prog = pathname;
-      prep_prog_argv_env(prog, args, envs);
+  // n bytes of reserved text
+  char *take_text(size_t n) {
+    if (text_used + n > text_size) {
+      FATAL("not enough text reserved for %zu bytes", n);
+    }
+    char *s = text + text_used;
+    text_used += n;
+    return s;
+  }
 
-      logprintf("[INTERCEPT] execle(\"%s\", ...); // replaced with '%s' \n",
-                pathname, prog.c_str());
-      logflush();
+  // "@/proc/self/fd/N" from reserved text. descriptor gets closed together
+  // with the list
+  const char *response_file_arg(int fd) {
+    if (fds_count == sizeof(fds) / sizeof(fds[0])) {
+      FATAL("too many response files for one exec");
+    }
+    fds[fds_count++] = fd;
+    char *s = take_text(EXEPTOR_RSP_ARG_SIZE);
+    snprintf(s, EXEPTOR_RSP_ARG_SIZE, "@/proc/self/fd/%d", fd);
+    return s;
+  }
 
-      return real_execve(prog.c_str(), const_cast<char *const *>(args.data()),
-                  const_cast<char *const *>(envs.data()));
+  void reserve(size_t n) {
+    if (n + 1 <= capacity) {
+      return;
+    }
+    const size_t page = 4096 / sizeof(const char *);
+    size_t new_capacity = capacity * 2;
+    while (new_capacity < n + 1) {
+      new_capacity *= 2;
+    }
+    new_capacity = (new_capacity + page - 1) / page * page;
+
+    void *p;
+    if (items == inline_items) {
+      p = mmap(nullptr, new_capacity * sizeof(const char *),
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p != MAP_FAILED) {
+        memcpy(p, items, (size + 1) * sizeof(const char *));
+      }
     } else {
-      logprintf("{intercept} -> no replacement found for '%s'\n", pathname);
+      p = mremap(items, capacity * sizeof(const char *),
+                 new_capacity * sizeof(const char *), MREMAP_MAYMOVE);
     }
-  } else {
-    logprintf("{intercept} -> not allowed to replace '%s'\n", pathname);
+    if (p == MAP_FAILED) {
+      FATAL("out of memory while preparing %zu exec arguments", n);
+    }
+    items = static_cast<const char **>(p);
+    capacity = new_capacity;
   }
-  args.push_back(nullptr);
-  prep_common_envp(envs);
-  return real_execve(pathname, const_cast<char *const *>(args.data()),
-              const_cast<char *const *>(envs.data()));
+
+  void push(const char *s) {
+    reserve(size + 1);
+    items[size++] = s;
+    items[size] = nullptr;
+  }
+
+  // cut list to first n items
+  void truncate(size_t n) {
+    size = n;
+    items[size] = nullptr;
+  }
+
+  char *const *data() { return const_cast<char *const *>(items); }
+};
+
+// fill list from NULL-terminated argv or envp
+void args_from_argv_envp(ArgList &list, const char *const *argv) {
+  if (argv) {
+    size_t n = 0;
+    while (argv[n]) {
+      n++;
+    }
+    list.reserve(list.size + n);
+    for (size_t i = 0; i < n; i++) {
+      list.push(argv[i]);
+    }
+  }
+}
+
+// fill list from va_list initialized with va_start.
+// this function doesn't call va_end
+void args_from_va_list(ArgList &list, va_list args, const char *arg) {
+  const char *parg = arg;
+  while (parg != nullptr) {
+    list.push(parg);
+    parg = va_arg(args, const char *);
+  }
+}
+
+// for use with exec-calls that accept envp argument: exeptor variables of
+// this process must survive calls with custom environment, own ones (see
+// set_own_env) take precedence over environ. both lists are
+// scanned once and no strings get formatted. usually the variables are
+// already there and envp is returned as is, otherwise entries get patched in
+// place and missing ones get appended to a copy kept in envs, order of
+// variables doesn't change.
+// environment delta of group (if any) gets applied in the same pass, it takes
+// precedence over exeptor variables. group is given for replacements only,
+// they get replacement marker, stale markers are always dropped
+char *const *prep_common_envp(char *const *envp, ArgList &envs,
+                              const ConfigSnapshot *snapshot = nullptr,
+                              const SnapshotGroup *group = nullptr) {
+  bool delta = snapshot && group && snapshot->has_env_delta(*group);
+
+  // "NAME=value" entries of environ, just like getenv() finds them
+  const char *vars[num_exeptor_vars] = {};
+  for (char **e = environ; e && *e; e++) {
+    int i = exeptor_var_index(*e);
+    if (i >= 0 && !vars[i]) {
+      vars[i] = *e;
+    }
+  }
+  for (int i = 0; i < num_exeptor_vars; i++) {
+    vars[i] = g_own_envs[i] ? g_own_envs[i] : vars[i];
+  }
+
+  // some hosts (bash) override getenv and setenv to keep variables of their
+  // own, values set there have no entry in environ
+  const char *values[num_exeptor_vars] = {};
+  size_t text = 0;
+  for (int i = 0; i < num_exeptor_vars; i++) {
+    if (!vars[i] && (values[i] = getenv(exeptor_envs[i]))) {
+      text += strlen(exeptor_envs[i]) + strlen(values[i]) + 2;
+    }
+  }
+  char marker[32] = "";
+  if (group) {
+    snprintf(marker, sizeof(marker), "%" PRIx64 ":%u",
+             snapshot->group_id(*group), g_replaced_depth + 1);
+    text += sizeof(EXEPTOR_REPLACED) + strlen(marker) + 1;
+  }
+  if (text > 0) {
+    envs.reserve_text(text);
+    for (int i = 0; i < num_exeptor_vars; i++) {
+      if (values[i]) {
+        vars[i] = envs.join(exeptor_envs[i], values[i]);
+      }
+    }
+  }
+  const char *marker_entry =
+      group ? envs.join(EXEPTOR_REPLACED, marker) : nullptr;
+
+  for (int i = 0; delta && i < num_exeptor_vars; i++) {
+    if (vars[i] && snapshot->unsets_env(*group, vars[i])) {
+      vars[i] = nullptr;
+    }
+  }
+
+  bool present[num_exeptor_vars] = {};
+  bool changed = delta || marker_entry;
+  size_t n = 0;
+  for (; envp && envp[n]; n++) {
+    if (is_replaced_marker(envp[n])) {
+      changed = true;
+      continue;
+    }
+    int i = exeptor_var_index(envp[n]);
+    if (i >= 0 && vars[i]) {
+      if (strcmp(envp[n], vars[i]) == 0) {
+        present[i] = true;
+      } else {
+        changed = true;
+      }
+    }
+  }
+  for (int i = 0; i < num_exeptor_vars; i++) {
+    changed = changed || (vars[i] && !present[i]);
+  }
+  if (!changed) {
+    return envp;
+  }
+
+  bool done[num_exeptor_vars] = {};
+  uint32_t add_count = delta ? group->env_add_count : 0;
+  envs.reserve(envs.size + n + num_exeptor_vars + add_count + 1);
+  for (size_t k = 0; k < n; k++) {
+    const char *e = envp[k];
+    if (is_replaced_marker(e) || (delta && snapshot->unsets_env(*group, e))) {
+      continue;
+    }
+    int i = exeptor_var_index(e);
+    if (i >= 0 && vars[i]) {
+      if (done[i]) {
+        continue; // first definition is the one that counts
+      }
+      e = vars[i];
+      done[i] = true;
+    }
+    envs.items[envs.size++] = e;
+  }
+  for (int i = 0; i < num_exeptor_vars; i++) {
+    if (vars[i] && !done[i]) {
+      envs.items[envs.size++] = vars[i];
+    }
+  }
+  if (add_count > 0) {
+    auto add_envs = snapshot->list(group->env_add_first);
+    for (uint32_t i = 0; i < add_count; i++) {
+      envs.items[envs.size++] = snapshot->str(add_envs[i]);
+    }
+  }
+  if (marker_entry) {
+    envs.items[envs.size++] = marker_entry;
+  }
+  envs.items[envs.size] = nullptr;
+  return envs.data();
+}
+
+// memfd for response file made by exeptor. replacement reads it as
+// @/proc/self/fd/N, see SharedResponseFiles for how it gets there
+#define EXEPTOR_RSP_NAME "exeptor-rsp"
+
+int make_response_file() {
+  int fd = memfd_create(EXEPTOR_RSP_NAME, MFD_CLOEXEC);
+  if (fd >= 0 && fd <= STDERR_FILENO) {
+    int high_fd = fcntl(fd, F_DUPFD, STDERR_FILENO + 1);
+    close(fd);
+    fd = high_fd;
+  }
+  return fd;
+}
+
+// descriptor N of "@/proc/self/fd/N" argument if it's response file made by
+// exeptor, -1 otherwise
+int response_file_fd(const char *arg) {
+  static const char prefix[] = "@/proc/self/fd/";
+  if (arg[0] != '@' || strncmp(arg, prefix, sizeof(prefix) - 1) != 0) {
+    return -1;
+  }
+  char *end = nullptr;
+  long fd = strtol(arg + sizeof(prefix) - 1, &end, 10);
+  if (end == arg + sizeof(prefix) - 1 || *end || fd <= STDERR_FILENO ||
+      fd > INT_MAX) {
+    return -1;
+  }
+
+  // link of memfd reads "/memfd:NAME (deleted)"
+  static const char target[] = "/memfd:" EXEPTOR_RSP_NAME " ";
+  char link[EXEPTOR_RSP_ARG_SIZE];
+  char buf[sizeof(target) - 1];
+  snprintf(link, sizeof(link), "/proc/self/fd/%ld", fd);
+  ssize_t n = readlink(link, buf, sizeof(buf));
+  return n == sizeof(buf) && memcmp(buf, target, sizeof(buf)) == 0
+             ? static_cast<int>(fd)
+             : -1;
+}
+
+// replacement inherits response files without close-on-exec flag, it's set
+// back as soon as libexeptor gets loaded, so they don't leak to every
+// descendant of replacement. glibc passes argc, argv and envp to constructors
+// of shared objects
+__attribute__((constructor)) void keep_response_files(int, char **argv,
+                                                      char **) {
+  for (size_t i = 1; argv && argv[i]; i++) {
+    int fd = response_file_fd(argv[i]);
+    if (fd >= 0) {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+  }
+}
+
+// copy of response file without del-options of group. returns argument
+// for the copy, or nullptr if file has nothing to delete or can't be read
+const char *rewrite_response_file(const ConfigSnapshot &snapshot,
+                                  const SnapshotGroup &group, const char *path,
+                                  ArgList &args) {
+  int in = open(path, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  size_t size = 0;
+  void *data = MAP_FAILED;
+  if (fstat(in, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    size = static_cast<size_t>(st.st_size);
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0);
+  }
+  close(in);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+
+  const char *begin = static_cast<const char *>(data);
+  const char *result = nullptr;
+  void *scratch = mmap(nullptr, size + 1, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (scratch != MAP_FAILED) {
+    auto arg = static_cast<char *>(scratch);
+    size_t len;
+
+    // most response files have nothing to delete, copy is made only if needed
+    bool deletes = false;
+    RspParser scan{begin, begin + size};
+    while (!deletes && scan.next(arg, len)) {
+      deletes = snapshot.deletes(group, arg);
+    }
+
+    int out = deletes ? make_response_file() : -1;
+    if (out >= 0) {
+      RspWriter writer(out);
+      RspParser parser{begin, begin + size};
+      while (parser.next(arg, len)) {
+        if (!snapshot.deletes(group, arg)) {
+          writer.arg(arg);
+        }
+      }
+      if (writer.flush()) {
+        result = args.response_file_arg(out);
+      } else {
+        close(out);
+      }
+    }
+    munmap(scratch, size + 1);
+  }
+  munmap(data, size);
+  return result;
+}
+
+// file (or stdin) given to compiler, as opposed to option
+bool is_input_arg(const char *arg) { return arg[0] != '-' || !arg[1]; }
+
+// apply rewrite plan of matched program: argv[0] gets replaced, del-options
+// and rewrite-args rules get applied in one in-place pass (del-options also
+// inside of response files), inserted options go before the first input and
+// add-options for action classes of the command get appended. argv is left
+// alone if captures of matched pattern can't be found, false is returned then
+bool rewrite_argv(const ConfigSnapshot &snapshot, const SnapshotProgram &t,
+                  const char *&prog, ArgList &args) {
+  const char *replacement = snapshot.str(t.replacement);
+  const auto &group = snapshot.group(t.group);
+
+  // text for replacement built from captures of matched pattern, arguments
+  // of rewritten response files and of spilled argv (see spill_args)
+  const char *caps[2 * EXEPTOR_REGEX_MAX_CAPTURES];
+  bool expand = snapshot.uses_captures(t);
+  if (expand && !snapshot.captures(t, prog, caps)) {
+    return false;
+  }
+  size_t expanded_len =
+      expand ? regex_expand(replacement, caps, nullptr, 0) : 0;
+  size_t rsp_files = 0;
+  for (size_t i = 1; group.del_count > 0 && i < args.size; i++) {
+    rsp_files += args.items[i][0] == '@' && args.items[i][1];
+  }
+  if (rsp_files > EXEPTOR_RSP_FILES) {
+    rsp_files = EXEPTOR_RSP_FILES;
+  }
+  args.reserve_text(expanded_len + 1 + (rsp_files + 1) * EXEPTOR_RSP_ARG_SIZE +
+                    (group.plugin ? EXEPTOR_PLUGIN_SCRATCH : 0));
+
+  if (expand) {
+    char *s = args.take_text(expanded_len + 1);
+    regex_expand(replacement, caps, s, expanded_len + 1);
+    replacement = s;
+  }
+
+  if (args.size > 0) {
+    args.items[0] = replacement;
+  }
+
+  size_t input_at = 0; // where the first input is, 0 if there is none
+  if (args.size > 1 && snapshot.has_rewrite_plan(group)) {
+    // don't replace argv[0]. rules never make more arguments than they
+    // match, so kept never overtakes i
+    size_t kept = 1;
+    for (size_t i = 1; i < args.size; i++) {
+      const char *arg = args.items[i];
+      if (arg[0] == '@' && arg[1] && args.fds_count < rsp_files) {
+        const char *rewritten =
+            rewrite_response_file(snapshot, group, arg + 1, args);
+        arg = rewritten ? rewritten : arg;
+      }
+      if (snapshot.deletes(group, arg)) {
+        continue;
+      }
+
+      const char *value = i + 1 < args.size && snapshot.takes_value(group, arg)
+                              ? args.items[i + 1]
+                              : nullptr;
+      if (!value && !input_at && is_input_arg(arg)) {
+        input_at = kept;
+      }
+      const SnapshotRule *rule = snapshot.match_rule(group, arg, value);
+      i += value ? 1 : 0;
+      if (!rule || rule->action == RULE_KEEP) {
+        args.items[kept++] = arg;
+        if (value) {
+          args.items[kept++] = value;
+        }
+      } else if (rule->action == RULE_REPLACE) {
+        auto words = snapshot.list(rule->words_first);
+        for (uint32_t w = 0; w < rule->words_count; w++) {
+          args.items[kept++] = snapshot.str(words[w]);
+        }
+        if (value && rule->keeps_value) {
+          args.items[kept++] = value;
+        }
+      }
+    }
+    args.truncate(kept);
+  }
+
+  // what rewritten command does decides which add-options it gets
+  uint32_t actions = EXEPTOR_ACTIONS_ALL;
+  if (group.add_scoped) {
+    actions = classify_action(args.items, args.size, [&](const char *arg) {
+      return snapshot.takes_value(group, arg);
+    });
+  }
+
+  args.reserve(args.size + group.insert_count + group.add_count);
+  if (args.size > 0 && group.insert_count > 0) {
+    size_t at = input_at ? input_at : args.size;
+    memmove(&args.items[at + group.insert_count], &args.items[at],
+            (args.size - at) * sizeof(const char *));
+    auto inserts = snapshot.list(group.insert_first);
+    for (uint32_t i = 0; i < group.insert_count; i++) {
+      args.items[at + i] = snapshot.str(inserts[i]);
+    }
+    args.size += group.insert_count;
+  }
+
+  auto add_opts = snapshot.list(group.add_first);
+  auto add_actions = snapshot.list_actions(group.add_first);
+  for (uint32_t i = 0; i < group.add_count; i++) {
+    if (add_actions[i] & actions) {
+      args.items[args.size++] = snapshot.str(add_opts[i]);
+    }
+  }
+  args.items[args.size] = nullptr;
+
+  prog = replacement;
+  return true;
+}
+
+// kernel refuses exec with E2BIG when argv and envp together come close to
+// ARG_MAX or one string is longer than MAX_ARG_STRLEN. arguments of such
+// replacement get moved to response file, so long build doesn't fail at
+// the final link after hours of work
+#define EXEPTOR_MAX_ARG_STRLEN (32 * 4096)
+#define EXEPTOR_MIN_ARG_MAX (32 * 4096) // kernel never allows less
+
+size_t exec_size(char *const *list, size_t &longest) {
+  size_t size = sizeof(char *); // terminating NULL
+  for (size_t i = 0; list && list[i]; i++) {
+    size_t len = strlen(list[i]) + 1;
+    longest = len > longest ? len : longest;
+    size += len + sizeof(char *);
+  }
+  return size;
+}
+
+void spill_args(ArgList &args, char *const *envp) {
+  if (args.size < 2) {
+    return;
+  }
+
+  size_t longest = 0;
+  size_t size = exec_size(args.data(), longest) + exec_size(envp, longest);
+  if (size < EXEPTOR_MIN_ARG_MAX / 8 * 7 && longest < EXEPTOR_MAX_ARG_STRLEN) {
+    return;
+  }
+  long arg_max = sysconf(_SC_ARG_MAX);
+  if (arg_max > 0 && size < static_cast<size_t>(arg_max) / 8 * 7 &&
+      longest < EXEPTOR_MAX_ARG_STRLEN) {
+    return;
+  }
+
+  int fd = make_response_file();
+  if (fd < 0) {
+    return;
+  }
+  RspWriter writer(fd);
+  for (size_t i = 1; i < args.size; i++) {
+    writer.arg(args.items[i]);
+  }
+  if (!writer.flush()) {
+    close(fd);
+    return;
+  }
+
+  logprintf("{intercept} -> %zu bytes of arguments moved to response file\n",
+            size);
+  args.items[1] = args.response_file_arg(fd);
+  args.truncate(2);
+}
+
+// plugin of group edits program, argv and envp of replacement in place, see
+// include/exeptor-plugin.h. envp is nullptr when caller's environment can't
+// be changed, envp which is still caller's array gets copied to envs first
+// (pointers only). returns envp to run replacement with
+char *const *run_plugin(const ConfigSnapshot &snapshot,
+                        const SnapshotGroup &group, const char *original,
+                        const char *&prog, ArgList &args, char *const *envp,
+                        ArgList &envs) {
+  exeptor_plugin_rewrite_t rewrite =
+      group.plugin ? find_plugin(snapshot.str(group.plugin)) : nullptr;
+  if (!rewrite) {
+    return envp;
+  }
+
+  if (envp && envp != envs.data()) {
+    envs.truncate(0);
+    args_from_argv_envp(envs, envp);
+  }
+  args.reserve(args.size + EXEPTOR_PLUGIN_ROOM);
+  envs.reserve(envs.size + EXEPTOR_PLUGIN_ROOM);
+
+  exeptor_plugin_call call;
+  call.api = EXEPTOR_PLUGIN_API;
+  call.group = snapshot.str(group.name);
+  call.original = original;
+  call.program = prog;
+  call.argv = {args.items, args.size, args.capacity - 1};
+  call.envp = {nullptr, 0, 0};
+  if (envp) {
+    call.envp = {envs.items, envs.size, envs.capacity - 1};
+  }
+  call.scratch = args.take_text(EXEPTOR_PLUGIN_SCRATCH);
+  call.scratch_size = EXEPTOR_PLUGIN_SCRATCH;
+  rewrite(&call);
+
+  if (call.argv.size >= args.capacity ||
+      (envp && call.envp.size >= envs.capacity) || !call.program) {
+    FATAL("plugin of group '%s' returned broken command", call.group);
+  }
+  logprintf("{intercept} -> plugin '%s' ran for '%s'\n",
+            snapshot.str(group.plugin), call.program);
+
+  prog = call.program;
+  args.truncate(call.argv.size);
+  if (!envp) {
+    return nullptr;
+  }
+  envs.truncate(call.envp.size);
+  return envs.data();
+}
+
+char *const *rewrite_argv_env(const ConfigSnapshot &snapshot,
+                              const SnapshotProgram &t, const char *&prog,
+                              ArgList &args, char *const *envp,
+                              ArgList &envs) {
+  const char *original = prog;
+  const auto &group = snapshot.group(t.group);
+  if (!rewrite_argv(snapshot, t, prog, args)) {
+    return prep_common_envp(envp, envs);
+  }
+  envp = prep_common_envp(envp, envs, &snapshot, &group);
+  return run_plugin(snapshot, group, original, prog, args, envp, envs);
+}
+
+// programs of groups with match-inodes are found by binary that path leads
+// to: symlinks, relative paths and other names of the same file match too.
+// binaries are never taken from snapshot, it may be older than them: table
+// of the build has them unless config got changed after the build started,
+// then each binary gets compared
+const SnapshotProgram *find_by_inode(const ConfigSnapshot &snapshot,
+                                     const char *path, bool path_search) {
+  if (snapshot.num_inode_programs() == 0 || !path || !*path) {
+    return nullptr;
+  }
+
+  StatCacheSlot *cache = stat_cache();
+  uint64_t dev, ino;
+  if (!path_inode(snapshot, cache, path, path_search, dev, ino)) {
+    return nullptr;
+  }
+
+  uint64_t index, unused;
+  if (cache && statcache_get(cache, inodes_recorded_key(snapshot), index,
+                             unused)) {
+    return statcache_get(cache, inode_key(snapshot, dev, ino), index,
+                         unused) &&
+                   index < snapshot.num_programs()
+               ? &snapshot.program(static_cast<uint32_t>(index))
+               : nullptr;
+  }
+
+  for (uint32_t i = 0; i < snapshot.num_programs(); i++) {
+    const auto &p = snapshot.program(i);
+    uint64_t prog_dev, prog_ino;
+    if (!p.pattern && snapshot.group(p.group).match_inodes &&
+        program_inode(snapshot, cache, p, prog_dev, prog_ino) &&
+        prog_dev == dev && prog_ino == ino) {
+      return &p;
+    }
+  }
+  return nullptr;
+}
+
+// by name or pattern first, by inode only if that fails
+const SnapshotProgram *find_program(const ConfigSnapshot &snapshot,
+                                    const char *path, bool path_search) {
+  const SnapshotProgram *t = snapshot.find(path);
+  return t ? t : find_by_inode(snapshot, path, path_search);
+}
+
+// groups with include-paths or exclude-paths only replace programs working
+// absolute path as seen from dir, lexically normal: without "." and ".."
+// components and repeated slashes, so "src/../third_party/a.c" can't get
+// past exclude-paths. symlinks are left as they are. false if result
+// doesn't fit into buf
+bool normalize_path(const char *dir, const char *path, char *buf,
+                    size_t size) {
+  size_t len = 0;
+  auto append = [&](const char *s) {
+    while (*s) {
+      const char *end = s;
+      while (*end && *end != '/') {
+        end++;
+      }
+      size_t n = static_cast<size_t>(end - s);
+      if (n == 2 && s[0] == '.' && s[1] == '.') {
+        // parent of root is root
+        while (len > 0 && buf[--len] != '/') {
+        }
+      } else if (n > 0 && !(n == 1 && s[0] == '.')) {
+        if (len + n + 2 > size) {
+          return false;
+        }
+        buf[len++] = '/';
+        memcpy(buf + len, s, n);
+        len += n;
+      }
+      s = *end ? end + 1 : end;
+    }
+    return true;
+  };
+
+  if (size < 2 || (path[0] != '/' && !append(dir)) || !append(path)) {
+    return false;
+  }
+  if (len == 0) {
+    buf[len++] = '/';
+  }
+  buf[len] = '\0';
+  return true;
+}
+
+// in scope: current directory and source files of argv (relative ones as
+// seen from current directory) must not be excluded and something must be
+// included, unless group has no includes. paths are matched in normal form
+bool in_scope(const ConfigSnapshot &snapshot, const SnapshotGroup &group,
+              char *const *argv) {
+  if (!snapshot.has_scope(group)) {
+    return true;
+  }
+
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    return false;
+  }
+  if (snapshot.path_matches(group.exclude_dfa, cwd)) {
+    return false;
+  }
+  bool included = group.include_dfa.states == 0 ||
+                  snapshot.path_matches(group.include_dfa, cwd);
+
+  char buf[PATH_MAX];
+  for (size_t i = 1; argv && argv[i]; i++) {
+    const char *arg = argv[i];
+    if (arg[0] == '-') {
+      i += argv[i + 1] && snapshot.takes_value(group, arg) ? 1 : 0;
+      continue;
+    }
+    if (input_kind_of_file(arg) == INPUT_OTHER) {
+      continue;
+    }
+
+    if (!normalize_path(cwd, arg, buf, sizeof(buf))) {
+      continue;
+    }
+    if (snapshot.path_matches(group.exclude_dfa, buf)) {
+      return false;
+    }
+    included = included || snapshot.path_matches(group.include_dfa, buf);
+  }
+  return included;
+}
+
+// lookup and rewrite with current config, for callers outside of exec hooks
+void prep_prog_argv(const char *&prog, ArgList &args) {
+  const ConfigSnapshot &snapshot = current_snapshot();
+  auto t = find_program(snapshot, prog, false);
+  const char *original = prog;
+  if (t && in_scope(snapshot, snapshot.group(t->group), args.data()) &&
+      rewrite_argv(snapshot, *t, prog, args)) {
+    ArgList envs;
+    run_plugin(snapshot, snapshot.group(t->group), original, prog, args,
+               nullptr, envs);
+  }
+}
+
+char *const *prep_prog_argv_env(const char *&prog, ArgList &args,
+                                char *const *envp, ArgList &envs) {
+  const ConfigSnapshot &snapshot = current_snapshot();
+  auto t = find_program(snapshot, prog, false);
+  if (t && in_scope(snapshot, snapshot.group(t->group), args.data())) {
+    return rewrite_argv_env(snapshot, *t, prog, args, envp, envs);
+  }
+  return prep_common_envp(envp, envs);
+}
+
+// arguments of intercepted call. families of exec functions only use the
+// fields they have
+struct ExecCall {
+  const char *path = nullptr; // what app wants to run
+  char *const *argv = nullptr;
+  char *const *envp = nullptr;
+  ArgList *args = nullptr; // argv already collected by execl-like hooks
+  int fd = AT_FDCWD;       // execveat & fexecve
+  int flags = 0;           // execveat
+  pid_t *pid = nullptr;    // posix_spawn & posix_spawnp
+  const posix_spawn_file_actions_t *file_actions = nullptr;
+  const posix_spawnattr_t *attrp = nullptr;
+};
+
+// name of file opened as fd, for fexecve & execveat with AT_EMPTY_PATH
+const char *path_of_fd(int fd, char *buf, size_t bufsize) {
+  char link[32];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(link, buf, bufsize - 1);
+  if (n <= 0) {
+    return nullptr;
+  }
+  buf[n] = '\0';
+  return buf;
+}
+
+// replacements given by bare names which were resolved in this process,
+// for PATH other than the one snapshot was built with. slots are filled once
+// and never change, so readers need no locks. names not found are cached too
+#define EXEPTOR_RESOLVED_SLOTS 32
+
+struct ResolvedName {
+  std::atomic<int> state; // 0 - free, 1 - being filled, 2 - ready
+  uint64_t key;           // hash of PATH and name
+  bool found;
+  char path[PATH_MAX];
+};
+
+ResolvedName g_resolved[EXEPTOR_RESOLVED_SLOTS];
+
+// absolute path to run replacement by, so libc doesn't try execve in every
+// PATH directory. nullptr means libc has to search PATH as usual
+const char *resolve_replacement(const ConfigSnapshot &snapshot,
+                                const SnapshotProgram &t, const char *prog,
+                                char *buf, size_t bufsize) {
+  const char *search_path = getenv("PATH");
+  if (!search_path || strchr(prog, '/')) {
+    return nullptr;
+  }
+
+  uint64_t path_hash = snapshot_hash(search_path);
+  const char *resolved = snapshot.resolved(t, path_hash);
+  if (resolved) {
+    return resolved;
+  }
+
+  uint64_t key = path_hash ^ (snapshot_hash(prog) * 0x9e3779b97f4a7c15ULL);
+  for (auto &slot : g_resolved) {
+    int state = slot.state.load(std::memory_order_acquire);
+    if (state == 0) {
+      break; // slots are taken in order
+    }
+    if (state == 2 && slot.key == key) {
+      return slot.found ? slot.path : nullptr;
+    }
+  }
+
+  bool found = resolve_in_path(prog, search_path, buf, bufsize);
+  for (auto &slot : g_resolved) {
+    int expected = 0;
+    if (slot.state.compare_exchange_strong(expected, 1)) {
+      slot.key = key;
+      slot.found = found;
+      if (found) {
+        strcpy(slot.path, buf);
+      }
+      slot.state.store(2, std::memory_order_release);
+      break;
+    }
+  }
+  return found ? buf : nullptr;
+}
+
+// policies of exec families. each one tells whether its functions take envp,
+// search PATH, spawn a child or run files given by descriptor, and how to
+// call original function with original or rewritten arguments.
+// envp given to exec_original and exec_replacement is nullptr when families
+// without envp don't need to change environment
+template <bool PathSearch> struct ExecvFamily {
+  static const bool has_envp = false;
+  static const bool path_search = PathSearch;
+  static const bool spawn = false;
+  static const bool by_fd = false;
+
+  static const char *lookup_path(const ExecCall &c, char *, size_t) {
+    return c.path;
+  }
+
+  static int exec_original(const ExecCall &c, char *const *argv,
+                           char *const *envp) {
+    return exec_replacement(c, c.path, argv, envp);
+  }
+
+  static int exec_replacement(const ExecCall &, const char *prog,
+                              char *const *argv, char *const *envp) {
+    if (envp) {
+      return PathSearch ? REAL(execvpe)(prog, argv, envp)
+                        : REAL(execve)(prog, argv, envp);
+    }
+    return PathSearch ? REAL(execvp)(prog, argv) : REAL(execv)(prog, argv);
+  }
+};
+
+template <bool PathSearch> struct ExecveFamily {
+  static const bool has_envp = true;
+  static const bool path_search = PathSearch;
+  static const bool spawn = false;
+  static const bool by_fd = false;
+
+  static const char *lookup_path(const ExecCall &c, char *, size_t) {
+    return c.path;
+  }
+
+  static int exec_original(const ExecCall &c, char *const *argv,
+                           char *const *envp) {
+    return exec_replacement(c, c.path, argv, envp);
+  }
+
+  static int exec_replacement(const ExecCall &, const char *prog,
+                              char *const *argv, char *const *envp) {
+    return PathSearch ? REAL(execvpe)(prog, argv, envp)
+                      : REAL(execve)(prog, argv, envp);
+  }
+};
+
+template <bool PathSearch> struct SpawnFamily {
+  static const bool has_envp = true;
+  static const bool path_search = PathSearch;
+  static const bool spawn = true;
+  static const bool by_fd = false;
+
+  static const char *lookup_path(const ExecCall &c, char *, size_t) {
+    return c.path;
+  }
+
+  static int exec_original(const ExecCall &c, char *const *argv,
+                           char *const *envp) {
+    return exec_replacement(c, c.path, argv, envp);
+  }
+
+  static int exec_replacement(const ExecCall &c, const char *prog,
+                              char *const *argv, char *const *envp) {
+    return PathSearch ? REAL(posix_spawnp)(c.pid, prog, c.file_actions,
+                                           c.attrp, argv, envp)
+                      : REAL(posix_spawn)(c.pid, prog, c.file_actions,
+                                          c.attrp, argv, envp);
+  }
+};
+
+// path of file named relative to directory fd, nullptr if it's too long
+const char *path_at(int dirfd, const char *path, char *buf, size_t bufsize) {
+  if (!path_of_fd(dirfd, buf, bufsize)) {
+    return nullptr;
+  }
+  size_t len = strlen(buf);
+  int n = snprintf(buf + len, bufsize - len, "/%s", path);
+  return n > 0 && static_cast<size_t>(n) < bufsize - len ? buf : nullptr;
+}
+
+// families running files by descriptor have no path to search, replacement
+// named by config is run like execve or, for bare names, like execvpe runs it
+int exec_named_replacement(const char *prog, char *const *argv,
+                           char *const *envp) {
+  return strchr(prog, '/') ? REAL(execve)(prog, argv, envp)
+                           : REAL(execvpe)(prog, argv, envp);
+}
+
+// execveat runs pathname relative to dirfd or, with AT_EMPTY_PATH, the file
+// dirfd refers to. replacement isn't relative to either of them. the program
+// still starts in current directory and reads files of argv from there, so
+// scope of group is judged by current directory like for execve
+struct ExecveatFamily {
+  static const bool has_envp = true;
+  static const bool path_search = false;
+  static const bool spawn = false;
+  static const bool by_fd = true;
+
+  static const char *lookup_path(const ExecCall &c, char *buf, size_t n) {
+    if ((c.flags & AT_EMPTY_PATH) && c.path && !c.path[0]) {
+      return path_of_fd(c.fd, buf, n);
+    }
+    if (c.path && c.path[0] != '/' && c.fd != AT_FDCWD) {
+      return path_at(c.fd, c.path, buf, n);
+    }
+    return c.path;
+  }
+
+  static int exec_original(const ExecCall &c, char *const *argv,
+                           char *const *envp) {
+    return REAL(execveat)(c.fd, c.path, argv, envp, c.flags);
+  }
+
+  static int exec_replacement(const ExecCall &c, const char *prog,
+                              char *const *argv, char *const *envp) {
+    if (!strchr(prog, '/')) {
+      return exec_named_replacement(prog, argv, envp);
+    }
+    return REAL(execveat)(AT_FDCWD, prog, argv, envp,
+                          c.flags & ~AT_EMPTY_PATH);
+  }
+};
+
+// fexecve runs the file fd refers to, replacement is run by its path
+struct FexecveFamily {
+  static const bool has_envp = true;
+  static const bool path_search = false;
+  static const bool spawn = false;
+  static const bool by_fd = true;
+
+  static const char *lookup_path(const ExecCall &c, char *buf, size_t n) {
+    return path_of_fd(c.fd, buf, n);
+  }
+
+  static int exec_original(const ExecCall &c, char *const *argv,
+                           char *const *envp) {
+    return REAL(fexecve)(c.fd, argv, envp);
+  }
+
+  static int exec_replacement(const ExecCall &, const char *prog,
+                              char *const *argv, char *const *envp) {
+    return exec_named_replacement(prog, argv, envp);
+  }
+};
+
+// copies of snapshot strings which exec'ed program gets, for vfork children
+// which can't keep config pinned until exec is done
+void copy_snapshot_strings(const ConfigSnapshot &snapshot, const char *&prog,
+                           const char *&bare, ArgList &args, char *const *envp,
+                           ArgList &envs, ArgList &copies) {
+  auto begin = reinterpret_cast<uintptr_t>(snapshot.header());
+  uintptr_t end = begin + snapshot.size();
+  auto inside = [&](const char *s) {
+    auto p = reinterpret_cast<uintptr_t>(s);
+    return p >= begin && p < end;
+  };
+  // envp that is still caller's array has no strings of snapshot
+  size_t envs_size = envp && envp == envs.data() ? envs.size : 0;
+
+  size_t text = inside(prog) ? strlen(prog) + 1 : 0;
+  text += inside(bare) ? strlen(bare) + 1 : 0;
+  for (size_t i = 0; i < args.size; i++) {
+    text += inside(args.items[i]) ? strlen(args.items[i]) + 1 : 0;
+  }
+  for (size_t i = 0; i < envs_size; i++) {
+    text += inside(envs.items[i]) ? strlen(envs.items[i]) + 1 : 0;
+  }
+  if (text == 0) {
+    return;
+  }
+
+  copies.reserve_text(text);
+  auto copy = [&](const char *&s) {
+    if (inside(s)) {
+      size_t len = strlen(s) + 1;
+      s = static_cast<const char *>(memcpy(copies.take_text(len), s, len));
+    }
+  };
+  copy(prog);
+  copy(bare);
+  for (size_t i = 0; i < args.size; i++) {
+    copy(args.items[i]);
+  }
+  for (size_t i = 0; i < envs_size; i++) {
+    copy(envs.items[i]);
+  }
+}
+
+// glibc clears close-on-exec flag of descriptor dup'ed onto itself by file
+// actions of posix_spawn since 2.29, older ones leave it set
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 29)
+#define EXEPTOR_SPAWN_DUP2_SHARES 0
+#else
+#define EXEPTOR_SPAWN_DUP2_SHARES 1
+#endif
+
+// response files of libexeptor named in argv of one exec or spawn. the files
+// stay close-on-exec all the time: other threads may be spawning children
+// which must not inherit them. spawned program gets them by file actions when
+// app passes none of its own. otherwise argv names copies dup'ed without the
+// flag right before the call, they're closed once spawn is done or exec
+// fails. spawn runs in the app itself, never in vfork child, so its file
+// actions may use heap
+struct SharedResponseFiles {
+  ExecCall call;
+  char *const *argv;
+  ArgList copies;
+  posix_spawn_file_actions_t actions;
+  bool has_actions = false;
+
+  SharedResponseFiles(const ExecCall &c, char *const *args, bool spawn)
+      : call(c), argv(args) {
+    size_t count = 0;
+    for (size_t i = 1; argv && argv[i]; i++) {
+      count += response_file_fd(argv[i]) >= 0 ? 1 : 0;
+    }
+    if (count == 0) {
+      return;
+    }
+    int saved_errno = errno;
+    if (EXEPTOR_SPAWN_DUP2_SHARES && spawn && !c.file_actions &&
+        share_by_actions()) {
+      call.file_actions = &actions;
+      errno = saved_errno;
+      return;
+    }
+
+    const size_t max_copies = sizeof(copies.fds) / sizeof(copies.fds[0]);
+    count = count < max_copies ? count : max_copies;
+    args_from_argv_envp(copies, argv);
+    copies.reserve_text(count * EXEPTOR_RSP_ARG_SIZE);
+    for (size_t i = 1; copies.items[i] && copies.fds_count < count; i++) {
+      int fd = response_file_fd(copies.items[i]);
+      int copy = fd >= 0 ? fcntl(fd, F_DUPFD, STDERR_FILENO + 1) : -1;
+      if (copy >= 0) {
+        copies.items[i] = copies.response_file_arg(copy);
+      }
+    }
+    argv = copies.data();
+    errno = saved_errno;
+  }
+
+  SharedResponseFiles(const SharedResponseFiles &) = delete;
+  SharedResponseFiles &operator=(const SharedResponseFiles &) = delete;
+  ~SharedResponseFiles() {
+    if (has_actions) {
+      posix_spawn_file_actions_destroy(&actions);
+    }
+  }
+
+  // dup2 onto itself clears close-on-exec flag in spawned child only
+  bool share_by_actions() {
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+      return false;
+    }
+    has_actions = true;
+    for (size_t i = 1; argv[i]; i++) {
+      int fd = response_file_fd(argv[i]);
+      if (fd >= 0 && posix_spawn_file_actions_adddup2(&actions, fd, fd) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        has_actions = false;
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// interception core shared by all exec hooks: one lookup, argv rewritten by
+// plan of matched program, envp merged in one pass.
+// config is pinned against reload until exec or spawn is done. the only
+// exception are vfork children: they share memory with their parent, so
+// their pin would stay taken forever once exec succeeds. they let the pin go
+// right before exec and run with copies of snapshot strings instead
+template <typename Family>
+int intercept(const char *funcname, const ExecCall &call) {
+  if (Family::spawn) {
+    maybe_reload_config();
+  }
+  ConfigPin pin(true);
+  bool unpin_before_exec = !Family::spawn && in_vfork_child();
+  const ConfigSnapshot &snapshot = pin.snapshot();
+
+  char fd_path[Family::by_fd ? PATH_MAX : 1];
+  const char *path = Family::lookup_path(call, fd_path, sizeof(fd_path));
+  const char *shown = path ? path : "";
+
+  logprintf("{intercept} app is calling %s('%s')\n", funcname, shown);
+
+  ArgList envs;
+  const SnapshotProgram *t = nullptr;
+  char *const *argv = call.args ? call.args->data() : call.argv;
+  if (!g_intercept_allowed) {
+    logprintf("{intercept} -> not allowed to replace '%s'\n", shown);
+  } else if (g_phase_off) {
+    logprintf("{intercept} -> replacements are off in this build phase\n");
+  } else if (!path ||
+             !(t = find_program(snapshot, path, Family::path_search))) {
+    logprintf("{intercept} -> no replacement found for '%s'\n", shown);
+  } else if (!in_scope(snapshot, snapshot.group(t->group), argv)) {
+    logprintf("{intercept} -> '%s' works on files out of scope\n", shown);
+    t = nullptr;
+  }
+
+  ArgList own_args;
+  ArgList &args = call.args ? *call.args : own_args;
+  const char *prog = path;
+  if (t) {
+    if (!call.args) {
+      args_from_argv_envp(args, call.argv);
+    }
+    if (!rewrite_argv(snapshot, *t, prog, args)) {
+      logprintf("{intercept} -> captures of '%s' can't be found\n", shown);
+      t = nullptr;
+    }
+  }
+
+  if (!t) {
+    if (unpin_before_exec) {
+      pin.release();
+    }
+    // families without envp keep environ unless it lacks own variables
+    char *const *envp =
+        prep_common_envp(Family::has_envp ? call.envp : environ, envs);
+    if (!Family::has_envp && envp == environ) {
+      envp = nullptr;
+    }
+    SharedResponseFiles shared(call, argv, Family::spawn);
+    return Family::exec_original(shared.call, shared.argv, envp);
+  }
+
+  // argv[0] keeps bare name of replacement, like shells do. resolved path
+  // may be stale, then bare name gets searched in PATH by libc after all.
+  // families running files by descriptor search PATH for replacements too
+  const bool search = Family::path_search || Family::by_fd;
+  const char *bare = prog;
+  char resolved_buf[search ? PATH_MAX : 1];
+  if (search) {
+    const char *resolved = resolve_replacement(snapshot, *t, prog,
+                                               resolved_buf,
+                                               sizeof(resolved_buf));
+    if (resolved) {
+      prog = resolved;
+    }
+  }
+
+  // replacement always gets its marker, so even families without envp
+  // run it with environment of their own
+  char *const *envp = prep_common_envp(Family::has_envp ? call.envp : environ,
+                                       envs, &snapshot,
+                                       &snapshot.group(t->group));
+  envp = run_plugin(snapshot, snapshot.group(t->group), path, prog, args, envp,
+                    envs);
+
+  spill_args(args, envp);
+
+  logprintf("[INTERCEPT] %s(\"%s\", ...); // replaced with '%s' \n", funcname,
+            path, prog);
+
+  ArgList copies;
+  if (unpin_before_exec) {
+    copy_snapshot_strings(snapshot, prog, bare, args, envp, envs, copies);
+    pin.release();
+  }
+
+  SharedResponseFiles shared(call, args.data(), Family::spawn);
+  int ret = Family::exec_replacement(shared.call, prog, shared.argv, envp);
+  int error = Family::spawn ? ret : (ret < 0 ? errno : 0);
+  if (prog != bare && (error == ENOENT || error == EACCES)) {
+    logprintf("{intercept} -> '%s' can't be run, searching PATH for '%s'\n",
+              prog, bare);
+    ret = Family::exec_replacement(shared.call, bare, shared.argv, envp);
+  }
+  return ret;
+}
+
+extern "C" {
+
+EXEPTOR_EXPORT int
+posix_spawn(pid_t *__restrict pid, const char *__restrict path,
+            const posix_spawn_file_actions_t *__restrict file_actions,
+            const posix_spawnattr_t *__restrict attrp,
+            char *const *__restrict argv, char *const *__restrict envp) {
+  initlib();
+  ExecCall call;
+  call.pid = pid;
+  call.path = path;
+  call.file_actions = file_actions;
+  call.attrp = attrp;
+  call.argv = argv;
+  call.envp = envp;
+  return intercept<SpawnFamily<false>>("posix_spawn", call);
+}
+
+EXEPTOR_EXPORT int
+posix_spawnp(pid_t *__restrict pid, const char *__restrict file,
+             const posix_spawn_file_actions_t *__restrict file_actions,
+             const posix_spawnattr_t *__restrict attrp,
+             char *const *__restrict argv, char *const *__restrict envp) {
+  initlib();
+  ExecCall call;
+  call.pid = pid;
+  call.path = file;
+  call.file_actions = file_actions;
+  call.attrp = attrp;
+  call.argv = argv;
+  call.envp = envp;
+  return intercept<SpawnFamily<true>>("posix_spawnp", call);
+}
+
+EXEPTOR_EXPORT int execv(const char *pathname, char *const argv[]) {
+  initlib();
+  ExecCall call;
+  call.path = pathname;
+  call.argv = argv;
+  return intercept<ExecvFamily<false>>("execv", call);
+}
+
+EXEPTOR_EXPORT int execvp(const char *file, char *const argv[]) {
+  initlib();
+  ExecCall call;
+  call.path = file;
+  call.argv = argv;
+  return intercept<ExecvFamily<true>>("execvp", call);
+}
+
+EXEPTOR_EXPORT int execvpe(const char *file, char *const argv[],
+                           char *const envp[]) {
+  initlib();
+  ExecCall call;
+  call.path = file;
+  call.argv = argv;
+  call.envp = envp;
+  return intercept<ExecveFamily<true>>("execvpe", call);
+}
+
+EXEPTOR_EXPORT int execve(const char *pathname, char *const argv[],
+                          char *const envp[]) {
+  initlib();
+  ExecCall call;
+  call.path = pathname;
+  call.argv = argv;
+  call.envp = envp;
+  return intercept<ExecveFamily<false>>("execve", call);
+}
+
+EXEPTOR_EXPORT int execveat(int dirfd, const char *pathname,
+                            char *const argv[], char *const envp[],
+                            int flags) {
+  initlib();
+  ExecCall call;
+  call.fd = dirfd;
+  call.path = pathname;
+  call.argv = argv;
+  call.envp = envp;
+  call.flags = flags;
+  return intercept<ExecveatFamily>("execveat", call);
+}
+
+EXEPTOR_EXPORT int fexecve(int fd, char *const argv[], char *const envp[]) {
+  initlib();
+  ExecCall call;
+  call.fd = fd;
+  call.argv = argv;
+  call.envp = envp;
+  return intercept<FexecveFamily>("fexecve", call);
+}
+
+// call to execl gets converted to execv (or execve if environment changes)
+EXEPTOR_EXPORT int execl(const char *pathname, const char *arg, ...) {
+  initlib();
+
+  ArgList args;
+  va_list vl;
+  va_start(vl, arg);
+  args_from_va_list(args, vl, arg);
+  va_end(vl);
+
+  ExecCall call;
+  call.path = pathname;
+  call.args = &args;
+  return intercept<ExecvFamily<false>>("execl", call);
+}
+
+// call to execlp gets converted to execvp (or execvpe if environment
+// changes)
+EXEPTOR_EXPORT int execlp(const char *file, const char *arg, ...) {
+  initlib();
+
+  ArgList args;
+  va_list vl;
+  va_start(vl, arg);
+  args_from_va_list(args, vl, arg);
+  va_end(vl);
+
+  ExecCall call;
+  call.path = file;
+  call.args = &args;
+  return intercept<ExecvFamily<true>>("execlp", call);
+}
+
+// call to execle gets converted to execve
+EXEPTOR_EXPORT int execle(const char *pathname, const char *arg,
+                          ... /*, (char *) NULL, char *const envp[] */) {
+  initlib();
+
+  ArgList args;
+  va_list vl;
+  va_start(vl, arg);
+  const char *parg = arg;
+  while (parg != nullptr) {
+    args.push(parg);
+    parg = va_arg(vl, const char *);
+  }
+  char *const *envp = va_arg(vl, char *const *);
+  va_end(vl);
+
+  ExecCall call;
+  call.path = pathname;
+  call.args = &args;
+  call.envp = envp;
+  return intercept<ExecveFamily<false>>("execle", call);
 }
 
 } // extern "C"
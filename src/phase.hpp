@@ -0,0 +1,200 @@
+/*
+
+file    :  src/phase.hpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+build phases: replacements may be switched off below processes like
+"make check", "make install" or "ctest", so test suites and install steps
+don't get rebuilt with instrumented compilers.
+
+each process decides once: its own argv is matched against phase rules of
+config, otherwise it takes phase its parent passed in EXEPTOR_PHASE.
+own argv is the one libc gave to libexeptor, only the first process of a
+build (no marker yet) walks its ancestors in /proc. nothing here touches
+the heap
+
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "snapshot.hpp"
+
+#define EXEPTOR_PHASE "EXEPTOR_PHASE"
+#define EXEPTOR_PHASE_CMDLINE 4096 // longer command lines get cut
+#define EXEPTOR_PHASE_ANCESTORS 64
+
+enum PhaseDecision { PHASE_NONE, PHASE_ON, PHASE_OFF };
+
+// shell-like glob with '*' and '?' matching the whole string
+inline bool phase_glob(const char *p, const char *s) {
+  const char *star = nullptr;
+  const char *resume = nullptr;
+  while (*s) {
+    if (*p == '*') {
+      star = p++;
+      resume = s;
+    } else if (*p == '?' || *p == *s) {
+      p++;
+      s++;
+    } else if (star) {
+      p = star + 1;
+      s = ++resume;
+    } else {
+      return false;
+    }
+  }
+  while (*p == '*') {
+    p++;
+  }
+  return !*p;
+}
+
+// first word of rule matches basename of argv[0], every other word matches
+// some of the arguments. cmdline is NUL-separated like /proc/PID/cmdline
+inline bool phase_rule_matches(const ConfigSnapshot &snapshot,
+                               const SnapshotPhase &rule, const char *cmdline,
+                               size_t len) {
+  if (len == 0 || rule.words_count == 0) {
+    return false;
+  }
+  auto words = snapshot.list(rule.words_first);
+  const char *end = cmdline + len;
+
+  const char *base = strrchr(cmdline, '/');
+  if (!phase_glob(snapshot.str(words[0]), base ? base + 1 : cmdline)) {
+    return false;
+  }
+  for (uint32_t w = 1; w < rule.words_count; w++) {
+    bool found = false;
+    for (const char *arg = cmdline + strlen(cmdline) + 1; !found && arg < end;
+         arg += strlen(arg) + 1) {
+      found = phase_glob(snapshot.str(words[w]), arg);
+    }
+    if (!found) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// "on" rules win over "off" rules matching the same command
+inline PhaseDecision phase_of_cmdline(const ConfigSnapshot &snapshot,
+                                      const char *cmdline, size_t len) {
+  PhaseDecision decision = PHASE_NONE;
+  for (uint32_t i = 0; i < snapshot.num_phases(); i++) {
+    const auto &rule = snapshot.phase(i);
+    if (phase_rule_matches(snapshot, rule, cmdline, len)) {
+      if (rule.on) {
+        return PHASE_ON;
+      }
+      decision = PHASE_OFF;
+    }
+  }
+  return decision;
+}
+
+// arguments NUL-separated like in /proc/PID/cmdline, the ones which don't
+// fit get cut
+inline size_t join_cmdline(char *const *argv, char *buf, size_t bufsize) {
+  size_t len = 0;
+  for (size_t i = 0; argv && argv[i]; i++) {
+    size_t n = strlen(argv[i]) + 1;
+    if (n > bufsize - len) {
+      break;
+    }
+    memcpy(buf + len, argv[i], n);
+    len += n;
+  }
+  return len;
+}
+
+// NUL-terminated arguments of process, 0 if they can't be read
+inline size_t read_cmdline(pid_t pid, char *buf, size_t bufsize) {
+  char path[48];
+  if (pid > 0) {
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", static_cast<int>(pid));
+  } else {
+    snprintf(path, sizeof(path), "/proc/self/cmdline");
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  size_t len = 0;
+  ssize_t n;
+  while (len < bufsize - 1 &&
+         (n = read(fd, buf + len, bufsize - 1 - len)) > 0) {
+    len += static_cast<size_t>(n);
+  }
+  close(fd);
+  buf[len] = '\0';
+  return len;
+}
+
+// parent of process, 0 if it's unknown. comm in stat may contain anything,
+// ppid follows the last ')'
+inline pid_t parent_of(pid_t pid) {
+  char buf[512];
+  char path[48];
+  snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return 0;
+  }
+  buf[n] = '\0';
+  // ") S PPID ..."
+  const char *p = strrchr(buf, ')');
+  if (!p || p[1] != ' ' || !p[2] || p[3] != ' ') {
+    return 0;
+  }
+  long ppid = strtol(p + 4, nullptr, 10);
+  return ppid > 0 ? static_cast<pid_t>(ppid) : 0;
+}
+
+// phase of this process: own argv first, then marker of parent, then the
+// nearest matching ancestor. replacements are on unless a rule says
+// otherwise
+inline PhaseDecision decide_phase(const ConfigSnapshot &snapshot,
+                                  const char *marker, char *const *argv) {
+  char cmdline[EXEPTOR_PHASE_CMDLINE];
+  size_t len = join_cmdline(argv, cmdline, sizeof(cmdline));
+  PhaseDecision decision = phase_of_cmdline(snapshot, cmdline, len);
+  if (decision != PHASE_NONE) {
+    return decision;
+  }
+
+  if (marker && strcmp(marker, "on") == 0) {
+    return PHASE_ON;
+  }
+  if (marker && strcmp(marker, "off") == 0) {
+    return PHASE_OFF;
+  }
+
+  pid_t pid = getppid();
+  for (int depth = 0; depth < EXEPTOR_PHASE_ANCESTORS && pid > 1; depth++) {
+    len = read_cmdline(pid, cmdline, sizeof(cmdline));
+    decision = phase_of_cmdline(snapshot, cmdline, len);
+    if (decision != PHASE_NONE) {
+      return decision;
+    }
+    pid = parent_of(pid);
+  }
+  return PHASE_ON;
+}
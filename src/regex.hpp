@@ -0,0 +1,741 @@
+/*
+
+file    :  src/regex.hpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+regular expressions of replacement patterns ("base:", "glob:" and "re:" keys
+in config). patterns get compiled to small programs when snapshot is built:
+all of them together are turned into one DFA which finds matching pattern in
+a single pass over exec path, no matter how many patterns there are.
+programs of patterns whose replacements refer to captures are kept too, so
+captures get found by backtracking once the pattern is known.
+rewrite-args rules of groups are compiled to DFAs the same way (see RegexSet).
+
+supported syntax: literals, '.', bracket classes with ranges, '*', '+', '?',
+'|', capturing '(...)' and non-capturing '(?:...)' groups, escapes \d \w \s.
+regex always has to match the whole path, '^' and '$' around it are optional
+
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define EXEPTOR_REGEX_MAX_CAPTURES 10 // \0 (whole match) to \9
+#define EXEPTOR_REGEX_BACKTRACK 256   // depth of backtracking stack
+#define EXEPTOR_REGEX_MAX_STEPS 100000
+
+enum RegexOp : uint32_t {
+  RE_CHAR,  // arg is the char
+  RE_ANY,   // any char
+  RE_CLASS, // arg is the first word of 256-bit class bitmap
+  RE_SPLIT, // try x, then y
+  RE_JMP,   // go to x
+  RE_SAVE,  // remember position in capture slot arg
+  RE_MATCH, // arg is index of pattern
+};
+
+// instructions refer to each other by index within program of their pattern
+struct RegexInst {
+  uint32_t op;
+  uint32_t arg;
+  uint32_t x;
+  uint32_t y;
+};
+
+inline bool regex_consumes(const RegexInst &in, const uint32_t *classes,
+                           unsigned char c) {
+  switch (in.op) {
+  case RE_CHAR:
+    return in.arg == c;
+  case RE_ANY:
+    return true;
+  case RE_CLASS:
+    return (classes[in.arg + c / 32] & (1u << (c % 32))) != 0;
+  default:
+    return false;
+  }
+}
+
+// find captures of regex in whole string s, caps gets
+// 2 * EXEPTOR_REGEX_MAX_CAPTURES pointers (nullptr for unset captures).
+// returns false if regex doesn't match or too much backtracking is needed.
+// works on fixed stack without allocations, so it's fine for exec hooks
+inline bool regex_captures(const RegexInst *prog, uint32_t count,
+                           const uint32_t *classes, const char *s,
+                           const char **caps) {
+  // frame either resumes matching at pc or restores a capture slot
+  struct Frame {
+    uint32_t pc;
+    uint32_t slot; // UINT32_MAX unless it's a restore frame
+    const char *sp;
+  };
+  Frame stack[EXEPTOR_REGEX_BACKTRACK];
+  size_t depth = 0;
+  unsigned steps = 0;
+
+  for (size_t i = 0; i < 2 * EXEPTOR_REGEX_MAX_CAPTURES; i++) {
+    caps[i] = nullptr;
+  }
+  stack[depth++] = Frame{0, UINT32_MAX, s};
+
+  while (depth > 0) {
+    Frame f = stack[--depth];
+    if (f.slot != UINT32_MAX) {
+      caps[f.slot] = f.sp;
+      continue;
+    }
+
+    uint32_t pc = f.pc;
+    const char *sp = f.sp;
+    bool alive = true;
+    while (alive) {
+      if (++steps > EXEPTOR_REGEX_MAX_STEPS || pc >= count) {
+        return false;
+      }
+      const RegexInst &in = prog[pc];
+      switch (in.op) {
+      case RE_CHAR:
+      case RE_ANY:
+      case RE_CLASS:
+        alive = *sp && regex_consumes(in, classes, *sp);
+        sp++;
+        pc++;
+        break;
+      case RE_SPLIT:
+        if (depth == EXEPTOR_REGEX_BACKTRACK) {
+          return false;
+        }
+        stack[depth++] = Frame{in.y, UINT32_MAX, sp};
+        pc = in.x;
+        break;
+      case RE_JMP:
+        pc = in.x;
+        break;
+      case RE_SAVE:
+        if (in.arg < 2 * EXEPTOR_REGEX_MAX_CAPTURES) {
+          if (depth == EXEPTOR_REGEX_BACKTRACK) {
+            return false;
+          }
+          stack[depth++] = Frame{0, in.arg, caps[in.arg]};
+          caps[in.arg] = sp;
+        }
+        pc++;
+        break;
+      case RE_MATCH:
+        if (!*sp) {
+          return true;
+        }
+        alive = false;
+        break;
+      default:
+        return false;
+      }
+    }
+  }
+  return false;
+}
+
+// write replacement template with \0 - \9 substituted by captures.
+// returns length of result, buf gets at most bufsize - 1 chars and NUL
+inline size_t regex_expand(const char *tmpl, const char *const *caps,
+                           char *buf, size_t bufsize) {
+  size_t n = 0;
+  auto put = [&](char c) {
+    if (n + 1 < bufsize) {
+      buf[n] = c;
+    }
+    n++;
+  };
+
+  for (const char *t = tmpl; *t; t++) {
+    if (t[0] == '\\' && t[1] >= '0' && t[1] <= '9') {
+      int i = t[1] - '0';
+      if (caps[2 * i] && caps[2 * i + 1]) {
+        for (const char *c = caps[2 * i]; c < caps[2 * i + 1]; c++) {
+          put(*c);
+        }
+      }
+      t++;
+    } else if (t[0] == '\\' && t[1] == '\\') {
+      put('\\');
+      t++;
+    } else {
+      put(*t);
+    }
+  }
+
+  if (bufsize > 0) {
+    buf[n < bufsize ? n : bufsize - 1] = '\0';
+  }
+  return n;
+}
+
+// highest capture referenced by replacement template, -1 if there are none
+inline int regex_template_captures(const char *tmpl) {
+  int highest = -1;
+  for (const char *t = tmpl; *t; t++) {
+    if (t[0] == '\\' && t[1] >= '0' && t[1] <= '9') {
+      highest = t[1] - '0' > highest ? t[1] - '0' : highest;
+      t++;
+    } else if (t[0] == '\\' && t[1] == '\\') {
+      t++;
+    }
+  }
+  return highest;
+}
+
+#ifndef EXEPTOR_LEAN
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+// compiles one regex to program for regex_captures and for DfaBuilder
+class RegexCompiler {
+public:
+  std::vector<RegexInst> prog;
+  std::vector<uint32_t> classes; // 8 words per class
+  unsigned groups = 0;           // capturing groups, not counting \0
+  std::string error;
+
+  bool compile(const std::string &re, uint32_t pattern) {
+    prog.clear();
+    classes.clear();
+    nodes_.clear();
+    groups = 0;
+    error.clear();
+    re_ = re;
+    pos_ = 0;
+
+    // anchors are implied
+    size_t end = re_.size();
+    if (pos_ < end && re_[pos_] == '^') {
+      pos_++;
+    }
+    if (end > pos_ && re_[end - 1] == '$' &&
+        (end < 2 || re_[end - 2] != '\\')) {
+      re_.erase(end - 1);
+    }
+
+    int root = parse_alt();
+    if (root < 0) {
+      return false;
+    }
+    if (pos_ != re_.size()) {
+      return fail("unmatched ')'");
+    }
+
+    emit(RE_SAVE, 0);
+    gen(root);
+    emit(RE_SAVE, 1);
+    emit(RE_MATCH, pattern);
+    return true;
+  }
+
+  static std::string escape(const std::string &s) {
+    std::string re;
+    for (char c : s) {
+      if (strchr("\\.[]()*+?|^${}", c)) {
+        re += '\\';
+      }
+      re += c;
+    }
+    return re;
+  }
+
+  // glob without '/' matches basename. every '*' and '?' is a capture
+  static std::string from_glob(const std::string &glob) {
+    std::string re;
+    if (glob.find('/') == std::string::npos) {
+      re = "(?:.*/)?";
+    }
+    for (size_t i = 0; i < glob.size(); i++) {
+      char c = glob[i];
+      if (c == '*') {
+        re += "([^/]*)";
+      } else if (c == '?') {
+        re += "([^/])";
+      } else if (c == '[' && glob.find(']', i + 2) != std::string::npos) {
+        size_t close = glob.find(']', i + 2);
+        std::string set = glob.substr(i + 1, close - i - 1);
+        if (set[0] == '!') {
+          set[0] = '^';
+        }
+        re += "[" + set + "]";
+        i = close;
+      } else if (c == '\\' && i + 1 < glob.size()) {
+        re += escape(std::string(1, glob[++i]));
+      } else {
+        re += escape(std::string(1, c));
+      }
+    }
+    return re;
+  }
+
+  static std::string from_basename(const std::string &name) {
+    return "(?:.*/)?" + escape(name);
+  }
+
+private:
+  enum NodeType { N_EMPTY, N_CHAR, N_ANY, N_CLASS, N_CAT, N_ALT, N_STAR,
+                  N_PLUS, N_QUEST, N_GROUP };
+
+  struct Node {
+    NodeType type;
+    uint32_t arg; // char, class or capture group (0 if not capturing)
+    int left;
+    int right;
+  };
+
+  std::vector<Node> nodes_;
+  std::string re_;
+  size_t pos_ = 0;
+
+  bool fail(const char *what) {
+    error = std::string(what) + " at position " + std::to_string(pos_);
+    return false;
+  }
+
+  int node(NodeType type, uint32_t arg = 0, int left = -1, int right = -1) {
+    nodes_.push_back(Node{type, arg, left, right});
+    return static_cast<int>(nodes_.size() - 1);
+  }
+
+  bool nullable(int n) const {
+    const Node &nd = nodes_[n];
+    switch (nd.type) {
+    case N_EMPTY:
+    case N_STAR:
+    case N_QUEST:
+      return true;
+    case N_CAT:
+      return nullable(nd.left) && nullable(nd.right);
+    case N_ALT:
+      return nullable(nd.left) || nullable(nd.right);
+    case N_PLUS:
+    case N_GROUP:
+      return nullable(nd.left);
+    default:
+      return false;
+    }
+  }
+
+  bool more() const { return pos_ < re_.size(); }
+
+  int parse_alt() {
+    int left = parse_cat();
+    while (left >= 0 && more() && re_[pos_] == '|') {
+      pos_++;
+      int right = parse_cat();
+      if (right < 0) {
+        return -1;
+      }
+      left = node(N_ALT, 0, left, right);
+    }
+    return left;
+  }
+
+  int parse_cat() {
+    int result = node(N_EMPTY);
+    while (more() && re_[pos_] != '|' && re_[pos_] != ')') {
+      int r = parse_repeat();
+      if (r < 0) {
+        return -1;
+      }
+      result = nodes_[result].type == N_EMPTY ? r : node(N_CAT, 0, result, r);
+    }
+    return result;
+  }
+
+  int parse_repeat() {
+    int a = parse_atom();
+    while (a >= 0 && more() && strchr("*+?", re_[pos_])) {
+      char op = re_[pos_++];
+      if (op != '?' && nullable(a)) {
+        fail("repeated expression may be empty");
+        return -1;
+      }
+      a = node(op == '*' ? N_STAR : op == '+' ? N_PLUS : N_QUEST, 0, a);
+    }
+    return a;
+  }
+
+  int parse_atom() {
+    char c = re_[pos_++];
+    switch (c) {
+    case '(': {
+      uint32_t group = 0;
+      if (re_.compare(pos_, 2, "?:") == 0) {
+        pos_ += 2;
+      } else {
+        group = ++groups;
+      }
+      int inner = parse_alt();
+      if (inner < 0) {
+        return -1;
+      }
+      if (!more() || re_[pos_] != ')') {
+        fail("missing ')'");
+        return -1;
+      }
+      pos_++;
+      return node(N_GROUP, group, inner);
+    }
+    case '[':
+      return parse_class();
+    case '.':
+      return node(N_ANY);
+    case '\\':
+      if (!more()) {
+        fail("trailing '\\'");
+        return -1;
+      }
+      return parse_escape(re_[pos_++]);
+    case '*':
+    case '+':
+    case '?':
+      pos_--;
+      fail("nothing to repeat");
+      return -1;
+    case '{':
+    case '}':
+      pos_--;
+      fail("counted repetition is not supported");
+      return -1;
+    default:
+      return node(N_CHAR, static_cast<unsigned char>(c));
+    }
+  }
+
+  uint32_t new_class() {
+    classes.resize(classes.size() + 8, 0);
+    return static_cast<uint32_t>(classes.size() - 8);
+  }
+
+  void class_add(uint32_t k, unsigned char from, unsigned char to) {
+    for (unsigned c = from; c <= to; c++) {
+      classes[k + c / 32] |= 1u << (c % 32);
+    }
+  }
+
+  // \d, \w and \s, returns false for other chars
+  bool class_add_escape(uint32_t k, char c) {
+    switch (c) {
+    case 'd':
+      class_add(k, '0', '9');
+      return true;
+    case 'w':
+      class_add(k, '0', '9');
+      class_add(k, 'A', 'Z');
+      class_add(k, 'a', 'z');
+      class_add(k, '_', '_');
+      return true;
+    case 's':
+      class_add(k, ' ', ' ');
+      class_add(k, '\t', '\r');
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  int parse_escape(char c) {
+    if (!strchr("dws", c)) {
+      return node(N_CHAR, static_cast<unsigned char>(c));
+    }
+    uint32_t k = new_class();
+    class_add_escape(k, c);
+    return node(N_CLASS, k);
+  }
+
+  int parse_class() {
+    uint32_t k = new_class();
+    bool negate = more() && re_[pos_] == '^';
+    pos_ += negate;
+
+    bool first = true;
+    while (more() && (re_[pos_] != ']' || first)) {
+      first = false;
+      unsigned char from = static_cast<unsigned char>(re_[pos_++]);
+      if (from == '\\' && more()) {
+        char e = re_[pos_++];
+        if (class_add_escape(k, e)) {
+          continue;
+        }
+        from = static_cast<unsigned char>(e);
+      }
+      unsigned char to = from;
+      if (pos_ + 1 < re_.size() && re_[pos_] == '-' && re_[pos_ + 1] != ']') {
+        to = static_cast<unsigned char>(re_[pos_ + 1]);
+        pos_ += 2;
+        if (to < from) {
+          fail("bad range in brackets");
+          return -1;
+        }
+      }
+      class_add(k, from, to);
+    }
+    if (!more()) {
+      fail("missing ']'");
+      return -1;
+    }
+    pos_++;
+
+    if (negate) {
+      for (int i = 0; i < 8; i++) {
+        classes[k + i] = ~classes[k + i];
+      }
+    }
+    return node(N_CLASS, k);
+  }
+
+  uint32_t here() const { return static_cast<uint32_t>(prog.size()); }
+
+  uint32_t emit(uint32_t op, uint32_t arg = 0, uint32_t x = 0,
+                uint32_t y = 0) {
+    prog.push_back(RegexInst{op, arg, x, y});
+    return here() - 1;
+  }
+
+  void gen(int n) {
+    const Node nd = nodes_[n];
+    switch (nd.type) {
+    case N_EMPTY:
+      break;
+    case N_CHAR:
+      emit(RE_CHAR, nd.arg);
+      break;
+    case N_ANY:
+      emit(RE_ANY);
+      break;
+    case N_CLASS:
+      emit(RE_CLASS, nd.arg);
+      break;
+    case N_CAT:
+      gen(nd.left);
+      gen(nd.right);
+      break;
+    case N_ALT: {
+      uint32_t split = emit(RE_SPLIT);
+      gen(nd.left);
+      uint32_t jmp = emit(RE_JMP);
+      prog[split].x = split + 1;
+      prog[split].y = here();
+      gen(nd.right);
+      prog[jmp].x = here();
+      break;
+    }
+    case N_STAR: {
+      uint32_t split = emit(RE_SPLIT);
+      gen(nd.left);
+      emit(RE_JMP, 0, split);
+      prog[split].x = split + 1;
+      prog[split].y = here();
+      break;
+    }
+    case N_PLUS: {
+      uint32_t start = here();
+      gen(nd.left);
+      emit(RE_SPLIT, 0, start, here() + 1);
+      break;
+    }
+    case N_QUEST: {
+      uint32_t split = emit(RE_SPLIT);
+      gen(nd.left);
+      prog[split].x = split + 1;
+      prog[split].y = here();
+      break;
+    }
+    case N_GROUP:
+      if (nd.arg > 0 && nd.arg < EXEPTOR_REGEX_MAX_CAPTURES) {
+        emit(RE_SAVE, 2 * nd.arg);
+        gen(nd.left);
+        emit(RE_SAVE, 2 * nd.arg + 1);
+      } else {
+        gen(nd.left);
+      }
+      break;
+    }
+  }
+};
+
+// programs of several regexes joined for DfaBuilder. regex accepts with its
+// index in set, earlier regexes take priority
+struct RegexSet {
+  std::vector<RegexInst> joined; // jumps are absolute
+  std::vector<uint32_t> classes; // shared by all programs
+  std::vector<uint32_t> starts;
+  std::string error;
+
+  // rc keeps program of regex with classes of the set, jumps stay relative
+  bool add(const std::string &re, RegexCompiler &rc) {
+    auto index = static_cast<uint32_t>(starts.size());
+    if (!rc.compile(re, index)) {
+      error = rc.error;
+      return false;
+    }
+
+    auto class_base = static_cast<uint32_t>(classes.size());
+    classes.insert(classes.end(), rc.classes.begin(), rc.classes.end());
+    auto first = static_cast<uint32_t>(joined.size());
+    starts.push_back(first);
+    for (auto &in : rc.prog) {
+      if (in.op == RE_CLASS) {
+        in.arg += class_base;
+      }
+      RegexInst abs = in;
+      if (in.op == RE_SPLIT || in.op == RE_JMP) {
+        abs.x += first;
+        abs.y += first;
+      }
+      joined.push_back(abs);
+    }
+    return true;
+  }
+
+  size_t size() const { return starts.size(); }
+};
+
+// one DFA for programs of all patterns. state is a set of program positions
+// that can consume next char, bytes which no instruction tells apart share
+// a column in transition table. state 0 is dead, state 1 is the start
+class DfaBuilder {
+public:
+  uint8_t classmap[256];
+  uint32_t num_classes = 0;
+  uint32_t num_states = 0;
+  std::vector<uint32_t> next;   // num_states * num_classes
+  std::vector<uint32_t> accept; // pattern index + 1, 0 if state accepts none
+  std::string error;
+
+  // prog holds programs of all patterns one after another, starts are their
+  // first instructions. jumps are absolute here
+  bool build(const std::vector<RegexInst> &prog,
+             const std::vector<uint32_t> &classes,
+             const std::vector<uint32_t> &starts, uint32_t max_states) {
+    build_classmap(prog, classes);
+
+    std::map<std::vector<uint32_t>, uint32_t> ids;
+    std::vector<std::vector<uint32_t>> sets;
+    auto state_of = [&](std::vector<uint32_t> &&set) -> uint32_t {
+      auto it = ids.find(set);
+      if (it != ids.end()) {
+        return it->second;
+      }
+      auto id = static_cast<uint32_t>(sets.size());
+      ids[set] = id;
+      sets.push_back(std::move(set));
+      return id;
+    };
+
+    mark_.assign(prog.size(), 0);
+    state_of({});                      // dead
+    state_of(closure(prog, starts));   // start
+
+    std::vector<unsigned char> representative(num_classes);
+    for (int c = 255; c >= 0; c--) {
+      representative[classmap[c]] = static_cast<unsigned char>(c);
+    }
+
+    next.clear();
+    accept.clear();
+    for (size_t s = 0; s < sets.size(); s++) {
+      if (sets.size() > max_states) {
+        error = "patterns need more than " + std::to_string(max_states) +
+                " DFA states";
+        return false;
+      }
+
+      uint32_t best = 0;
+      for (uint32_t pc : sets[s]) {
+        if (prog[pc].op == RE_MATCH &&
+            (best == 0 || prog[pc].arg + 1 < best)) {
+          best = prog[pc].arg + 1;
+        }
+      }
+      accept.push_back(best);
+
+      for (uint32_t k = 0; k < num_classes; k++) {
+        std::vector<uint32_t> targets;
+        for (uint32_t pc : sets[s]) {
+          if (regex_consumes(prog[pc], classes.data(), representative[k])) {
+            targets.push_back(pc + 1);
+          }
+        }
+        // sets[] may grow, so the state is looked up by index again
+        uint32_t target = state_of(closure(prog, targets));
+        next.push_back(target);
+      }
+    }
+    num_states = static_cast<uint32_t>(sets.size());
+    return true;
+  }
+
+private:
+  std::vector<uint32_t> mark_;
+  uint32_t generation_ = 0;
+
+  void build_classmap(const std::vector<RegexInst> &prog,
+                      const std::vector<uint32_t> &classes) {
+    std::map<std::string, uint8_t> signatures;
+    for (int c = 0; c < 256; c++) {
+      std::string sig;
+      for (const auto &in : prog) {
+        if (in.op == RE_CHAR || in.op == RE_CLASS) {
+          sig += regex_consumes(in, classes.data(), c) ? '1' : '0';
+        }
+      }
+      auto it = signatures.find(sig);
+      if (it == signatures.end()) {
+        it = signatures
+                 .emplace(sig, static_cast<uint8_t>(signatures.size()))
+                 .first;
+      }
+      classmap[c] = it->second;
+    }
+    num_classes = static_cast<uint32_t>(signatures.size());
+  }
+
+  // positions reachable without consuming anything, only those which
+  // consume or match are kept
+  std::vector<uint32_t> closure(const std::vector<RegexInst> &prog,
+                                const std::vector<uint32_t> &from) {
+    generation_++;
+    std::vector<uint32_t> set;
+    std::vector<uint32_t> todo(from.rbegin(), from.rend());
+    while (!todo.empty()) {
+      uint32_t pc = todo.back();
+      todo.pop_back();
+      if (pc >= prog.size() || mark_[pc] == generation_) {
+        continue;
+      }
+      mark_[pc] = generation_;
+      const auto &in = prog[pc];
+      switch (in.op) {
+      case RE_SPLIT:
+        todo.push_back(in.y);
+        todo.push_back(in.x);
+        break;
+      case RE_JMP:
+        todo.push_back(in.x);
+        break;
+      case RE_SAVE:
+        todo.push_back(pc + 1);
+        break;
+      default:
+        set.push_back(pc);
+      }
+    }
+    std::sort(set.begin(), set.end());
+    return set;
+  }
+};
+
+#endif // EXEPTOR_LEAN
@@ -0,0 +1,106 @@
+/*
+
+file    :  src/rspfile.hpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+response files (@file arguments) in syntax of GCC, Clang and binutils
+(libiberty buildargv): arguments are separated by whitespace, quotes and
+backslash keep them together. files are parsed in place from mmap'ed memory
+and written through small buffer, so nothing here touches the heap
+
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#include <unistd.h>
+
+#define EXEPTOR_RSP_BUFFER 4096
+
+inline bool rsp_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+         c == '\v';
+}
+
+struct RspParser {
+  const char *p;
+  const char *end;
+
+  // next argument without quotes. buf must have room for the rest of file
+  // and NUL, unquoted argument is never longer than that
+  bool next(char *buf, size_t &len) {
+    while (p < end && rsp_space(*p)) {
+      p++;
+    }
+    if (p == end) {
+      return false;
+    }
+
+    len = 0;
+    char quote = 0;
+    for (; p < end && (quote || !rsp_space(*p)); p++) {
+      if (*p == '\\' && p + 1 < end) {
+        buf[len++] = *++p;
+      } else if (quote && *p == quote) {
+        quote = 0;
+      } else if (!quote && (*p == '\'' || *p == '"')) {
+        quote = *p;
+      } else {
+        buf[len++] = *p;
+      }
+    }
+    buf[len] = '\0';
+    return true;
+  }
+};
+
+// writes arguments quoted so that RspParser gets them back as they were
+struct RspWriter {
+  int fd;
+  char buf[EXEPTOR_RSP_BUFFER];
+  size_t used = 0;
+  bool failed = false;
+
+  explicit RspWriter(int fd) : fd(fd) {}
+
+  void put(char c) {
+    if (used == sizeof(buf)) {
+      flush();
+    }
+    buf[used++] = c;
+  }
+
+  void arg(const char *s) {
+    if (!*s) {
+      put('"');
+      put('"');
+    }
+    for (; *s; s++) {
+      if (rsp_space(*s) || *s == '\\' || *s == '\'' || *s == '"') {
+        put('\\');
+      }
+      put(*s);
+    }
+    put('\n');
+  }
+
+  // false if anything wasn't written
+  bool flush() {
+    size_t written = 0;
+    while (!failed && written < used) {
+      ssize_t n = write(fd, buf + written, used - written);
+      if (n <= 0) {
+        failed = true;
+      } else {
+        written += static_cast<size_t>(n);
+      }
+    }
+    used = 0;
+    return !failed;
+  }
+};
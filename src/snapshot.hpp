@@ -0,0 +1,982 @@
+/*
+
+file    :  src/snapshot.hpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+compact binary snapshot of replacement settings.
+snapshot is built once from yaml config (see config.hpp) and then gets mapped
+read-only by every process, so lookups work directly on mapped memory without
+parsing and without heap allocations.
+
+all references inside of snapshot are 32-bit offsets, so it doesn't matter
+at which address snapshot gets mapped.
+
+programs given by patterns ("base:", "glob:" and "re:" keys) are matched by
+single DFA built from all of them (see regex.hpp), exact names are tried first.
+programs of groups with match-inodes are also found by identity of the file
+they name. identities are not stored here: snapshot gets cached on disk and
+outlives binaries, so each build takes them with stat() (see find_by_inode
+in exeptor.cpp).
+
+rewrite-args rules of each group are compiled to one DFA too, it runs over
+every argument (or option and its value) once, see match_rule.
+
+*/
+
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "action.hpp"
+#include "regex.hpp"
+
+#define EXEPTOR_SNAPSHOT_MAGIC "EXEPTOR"
+#define EXEPTOR_SNAPSHOT_VERSION 15
+#define EXEPTOR_SNAPSHOT_SUFFIX ".snapshot"
+
+// snapshot published through memfd must be immutable
+#define EXEPTOR_SNAPSHOT_SEALS                                                 \
+  (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+// key of yaml file snapshot was built from. stale snapshots are detected
+// by comparing this key with what stat() says about the yaml file
+struct SnapshotSource {
+  uint64_t path_hash;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t size; // size of whole snapshot in bytes
+  SnapshotSource source;
+  uint64_t search_path_hash; // PATH replacements were resolved with, 0 if
+                             // there was no PATH
+  uint32_t programs_offset; // SnapshotProgram[], exact names sorted, then
+  uint32_t programs_count;  // programs of patterns in config order
+  uint32_t slots_offset; // SnapshotSlot[], hash table of program names
+  uint32_t slots_count;  // power of 2, always has empty slots
+  uint32_t prefilter_offset; // EXEPTOR_PREFILTER_BITS bits, see prefilter_bit
+  uint32_t groups_offset;    // SnapshotGroup[]
+  uint32_t groups_count;
+  uint32_t option_slots_offset; // SnapshotOptionSlot[], del-options of groups
+  uint32_t option_slots_count;
+  uint32_t lists_offset; // uint32_t[] with string offsets
+  uint32_t lists_count;
+  uint32_t list_actions_offset; // uint32_t[] with action classes (see
+                                // action.hpp) of each list item
+  uint32_t strings_offset; // NUL-terminated strings
+  uint32_t strings_size;
+  uint32_t patterns_offset; // SnapshotPattern[], in config order
+  uint32_t patterns_count;
+  uint32_t dfa_offset; // uint8_t classmap[256], then uint32_t next state for
+                       // each state and byte class, then uint32_t accept for
+                       // each state (pattern index + 1 or 0)
+  uint32_t dfa_states; // 0 if there are no patterns
+  uint32_t dfa_classes;
+  uint32_t regex_offset; // RegexInst[] of patterns with captures
+  uint32_t regex_count;
+  uint32_t regex_classes_offset; // uint32_t[], 8 words per bracket class
+  uint32_t regex_classes_count;
+  uint32_t inode_programs; // exact names of groups with match-inodes
+  uint32_t rules_offset; // SnapshotRule[], rewrite-args rules of all groups
+  uint32_t rules_count;
+  uint32_t dfas_offset; // DFAs of groups, each laid out like the one of
+  uint32_t dfas_size;   // patterns and aligned to 4 bytes
+  uint32_t phases_offset; // SnapshotPhase[], see phase.hpp
+  uint32_t phases_count;
+};
+
+struct SnapshotProgram {
+  uint32_t name;        // string offset
+  uint32_t replacement; // string offset
+  uint32_t group;       // index in groups
+  uint32_t resolved;    // string offset + 1 of replacement found in PATH,
+                        // 0 if replacement isn't a bare name or wasn't found
+  uint32_t pattern;     // index + 1 in patterns, 0 for exact names
+};
+
+// replacement of pattern may refer to captures as \1 - \9 (\0 is the whole
+// path). program of such pattern is kept to find captures of matched path
+struct SnapshotPattern {
+  uint32_t program;     // index in programs
+  uint32_t regex_first; // index in regex instructions
+  uint32_t regex_count; // 0 if replacement doesn't use captures
+};
+
+// DFA of patterns can't grow beyond this number of states
+#define EXEPTOR_MAX_DFA_STATES 16384
+
+// DFA in dfas section of snapshot
+struct SnapshotDfa {
+  uint32_t offset; // from the start of dfas section
+  uint32_t states; // 0 if there is no DFA
+  uint32_t classes;
+};
+
+enum RuleAction : uint32_t {
+  RULE_DELETE,
+  RULE_REPLACE, // put words in place of matched arguments
+  RULE_KEEP,    // leave arguments as they are, later rules don't apply
+};
+
+// rewrite-args rule. words are never more than arguments rule matches, so
+// argv gets rewritten in place
+struct SnapshotRule {
+  uint32_t action;
+  uint32_t keeps_value; // replace option, but not its value
+  uint32_t words_first; // index in lists
+  uint32_t words_count;
+};
+
+// build phase rule: replacements are switched on or off below processes
+// whose command line matches words (globs) of the rule
+struct SnapshotPhase {
+  uint32_t on;
+  uint32_t words_first; // index in lists
+  uint32_t words_count;
+};
+
+// separates option from its value when both are fed to rules DFA
+#define EXEPTOR_RULE_SEPARATOR '\x1f'
+
+// transitions of DFA in mapped snapshot
+struct DfaView {
+  const uint8_t *classmap;
+  const uint32_t *next;
+  const uint32_t *accept; // index + 1 of what state accepts, 0 for nothing
+  uint32_t classes;
+
+  uint32_t step(uint32_t state, char c) const {
+    return next[state * classes + classmap[static_cast<unsigned char>(c)]];
+  }
+
+  // state 0 is dead, so matching stops early
+  uint32_t feed(uint32_t state, const char *s) const {
+    for (; *s && state; s++) {
+      state = step(state, *s);
+    }
+    return state;
+  }
+};
+
+// argv rewrite plan shared by all programs of a group. options are stored
+// once per group in config order, del-options are also hashed, so argv gets
+// compacted in one pass without comparing every argument with every option
+struct SnapshotGroup {
+  uint32_t name;      // string offset
+  uint32_t add_first; // index in lists
+  uint32_t add_count;
+  uint32_t del_first; // index in lists
+  uint32_t del_count;
+  uint32_t del_slots_first; // index in option slots
+  uint32_t del_slots_count; // power of 2, 0 if there's nothing to delete
+  uint32_t del_lead[2];     // bitmap of first chars of del-options, see
+                            // option_lead_bit
+  // environment delta of replaced programs: variables named in unset list
+  // (del-environ and names of add-environ) get dropped from envp, then
+  // ready-made "NAME=value" entries of add-environ get appended
+  uint32_t env_add_first; // index in lists
+  uint32_t env_add_count;
+  uint32_t env_unset_first; // index in lists
+  uint32_t env_unset_count;
+  uint32_t env_lead[2]; // bitmap of first chars of unset names
+  // replacements run with EXEPTOR_REPLACED=<group id>:<depth> in environment.
+  // their own exec calls get intercepted only while depth <= reintercept
+  uint32_t reintercept;
+  // rewrite-args: options taking value in the next argument are recognized
+  // by pairs DFA, then option (with its value) goes through rules DFA.
+  // insert list goes before the first input file
+  uint32_t rules_first; // index in rules
+  uint32_t rules_count;
+  SnapshotDfa rules_dfa;
+  SnapshotDfa pairs_dfa;
+  uint32_t insert_first; // index in lists
+  uint32_t insert_count;
+  uint32_t add_scoped; // some add-options are only for some action classes
+  // include-paths and exclude-paths, matched against current directory and
+  // source files. programs of group get replaced only for files in scope
+  SnapshotDfa include_dfa;
+  SnapshotDfa exclude_dfa;
+  uint32_t plugin; // string offset of shared object, 0 if there is none
+  uint32_t match_inodes; // programs also match any path of their binary
+};
+
+// deepest chain of replacements config may allow
+#define EXEPTOR_MAX_REINTERCEPT 16
+
+// open addressing slot. tag is upper half of name hash: most mismatching
+// slots get skipped without comparing strings
+struct SnapshotSlot {
+  uint32_t tag;
+  uint32_t program; // index + 1, 0 means empty slot
+};
+
+struct SnapshotOptionSlot {
+  uint32_t tag;
+  uint32_t option; // string offset + 1, 0 means empty slot
+};
+
+// arguments which can't be deleted (object files and such usually don't start
+// with '-') get rejected by their first char before anything gets hashed
+inline uint32_t option_lead_bit(const char *s) {
+  return static_cast<unsigned char>(s[0]) & 0x3f;
+}
+
+// most exec'ed paths (sh, sed, rm, ...) match nothing in config. such paths
+// get rejected by bitmap indexed by length and last char of program names
+// before anything gets hashed
+#define EXEPTOR_PREFILTER_BITS 4096
+
+inline uint32_t prefilter_bit(const char *s, size_t len) {
+  unsigned char last = len ? static_cast<unsigned char>(s[len - 1]) : 0;
+  return static_cast<uint32_t>(((len & 0x3f) << 6) | (last & 0x3f));
+}
+
+// FNV-1a, for program names and for path of yaml file
+inline uint64_t snapshot_hash(const char *s, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= static_cast<unsigned char>(s[i]);
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+inline uint64_t snapshot_hash(const char *s) {
+  return snapshot_hash(s, strlen(s));
+}
+
+inline void snapshot_source_from_stat(const char *path, const struct stat &st,
+                                      SnapshotSource &src) {
+  src.path_hash = snapshot_hash(path);
+  src.size = static_cast<uint64_t>(st.st_size);
+  src.mtime_sec = st.st_mtim.tv_sec;
+  src.mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+// find executable like execvp does, but only in absolute directories of
+// search path: result must not depend on current directory. gives up at the
+// first relative directory, as it could be the one execvp would pick
+inline bool resolve_in_path(const char *name, const char *search_path,
+                            char *buf, size_t bufsize) {
+  const char *dir = search_path;
+  for (;;) {
+    const char *end = strchrnul(dir, ':');
+    auto dir_len = static_cast<int>(end - dir);
+    if (dir_len == 0 || dir[0] != '/') {
+      return false;
+    }
+
+    struct stat st;
+    int n = snprintf(buf, bufsize, "%.*s/%s", dir_len, dir, name);
+    if (n > 0 && static_cast<size_t>(n) < bufsize && stat(buf, &st) == 0 &&
+        S_ISREG(st.st_mode) && access(buf, X_OK) == 0) {
+      return true;
+    }
+
+    if (!*end) {
+      return false;
+    }
+    dir = end + 1;
+  }
+}
+
+// path of snapshot cached next to yaml config file
+inline bool snapshot_cache_path(const char *config_path, char *buf,
+                                size_t bufsize) {
+  int n = snprintf(buf, bufsize, "%s" EXEPTOR_SNAPSHOT_SUFFIX, config_path);
+  return n > 0 && static_cast<size_t>(n) < bufsize;
+}
+
+// read-only view of snapshot bytes. all offsets get validated once per build
+// in attach(), so lookups don't need any bounds checks
+class ConfigSnapshot {
+public:
+  ConfigSnapshot() {}
+
+  // process which builds snapshot or reads it from file validates every
+  // entry. its descendants map the same bytes from sealed memfd, which can't
+  // change since, so they pass validated and only check header and bounds
+  // of sections
+  bool attach(const void *data, size_t size, bool validated = false) {
+    detach();
+
+    if (!data || size < sizeof(SnapshotHeader)) {
+      return false;
+    }
+
+    auto base = static_cast<const char *>(data);
+    auto hdr = reinterpret_cast<const SnapshotHeader *>(base);
+
+    if (memcmp(hdr->magic, EXEPTOR_SNAPSHOT_MAGIC,
+               sizeof(EXEPTOR_SNAPSHOT_MAGIC)) != 0 ||
+        hdr->version != EXEPTOR_SNAPSHOT_VERSION || hdr->size != size) {
+      return false;
+    }
+
+    if (!section_ok(hdr->programs_offset, hdr->programs_count,
+                    sizeof(SnapshotProgram), size) ||
+        !section_ok(hdr->slots_offset, hdr->slots_count, sizeof(SnapshotSlot),
+                    size) ||
+        hdr->patterns_count > hdr->programs_count ||
+        hdr->slots_count <= hdr->programs_count - hdr->patterns_count ||
+        (hdr->slots_count & (hdr->slots_count - 1)) != 0 ||
+        !section_ok(hdr->prefilter_offset, EXEPTOR_PREFILTER_BITS / 32,
+                    sizeof(uint32_t), size) ||
+        !section_ok(hdr->groups_offset, hdr->groups_count,
+                    sizeof(SnapshotGroup), size) ||
+        !section_ok(hdr->option_slots_offset, hdr->option_slots_count,
+                    sizeof(SnapshotOptionSlot), size) ||
+        !section_ok(hdr->lists_offset, hdr->lists_count, sizeof(uint32_t),
+                    size) ||
+        !section_ok(hdr->list_actions_offset, hdr->lists_count,
+                    sizeof(uint32_t), size) ||
+        !section_ok(hdr->strings_offset, hdr->strings_size, 1, size) ||
+        hdr->strings_size == 0 ||
+        base[hdr->strings_offset + hdr->strings_size - 1] != '\0' ||
+        !section_ok(hdr->patterns_offset, hdr->patterns_count,
+                    sizeof(SnapshotPattern), size) ||
+        !section_ok(hdr->regex_offset, hdr->regex_count, sizeof(RegexInst),
+                    size) ||
+        !section_ok(hdr->regex_classes_offset, hdr->regex_classes_count,
+                    sizeof(uint32_t), size) ||
+        !dfa_fits(base + hdr->dfa_offset,
+                  hdr->dfa_offset <= size ? size - hdr->dfa_offset : 0,
+                  hdr->dfa_states, hdr->dfa_classes) ||
+        (hdr->dfa_states == 0 && hdr->patterns_count > 0) ||
+        hdr->inode_programs > hdr->programs_count ||
+        !section_ok(hdr->rules_offset, hdr->rules_count, sizeof(SnapshotRule),
+                    size) ||
+        !section_ok(hdr->dfas_offset, hdr->dfas_size, 1, size) ||
+        !section_ok(hdr->phases_offset, hdr->phases_count,
+                    sizeof(SnapshotPhase), size) ||
+        (!validated && !entries_ok(base, hdr))) {
+      return false;
+    }
+
+    auto programs =
+        reinterpret_cast<const SnapshotProgram *>(base + hdr->programs_offset);
+    auto slots =
+        reinterpret_cast<const SnapshotSlot *>(base + hdr->slots_offset);
+    auto lists = reinterpret_cast<const uint32_t *>(base + hdr->lists_offset);
+    auto option_slots = reinterpret_cast<const SnapshotOptionSlot *>(
+        base + hdr->option_slots_offset);
+    auto groups =
+        reinterpret_cast<const SnapshotGroup *>(base + hdr->groups_offset);
+    auto phases =
+        reinterpret_cast<const SnapshotPhase *>(base + hdr->phases_offset);
+    auto rules =
+        reinterpret_cast<const SnapshotRule *>(base + hdr->rules_offset);
+    auto patterns =
+        reinterpret_cast<const SnapshotPattern *>(base + hdr->patterns_offset);
+    auto regex = reinterpret_cast<const RegexInst *>(base + hdr->regex_offset);
+
+    header_ = hdr;
+    programs_ = programs;
+    slots_ = slots;
+    groups_ = groups;
+    option_slots_ = option_slots;
+    prefilter_ =
+        reinterpret_cast<const uint32_t *>(base + hdr->prefilter_offset);
+    lists_ = lists;
+    list_actions_ =
+        reinterpret_cast<const uint32_t *>(base + hdr->list_actions_offset);
+    strings_ = base + hdr->strings_offset;
+    patterns_ = patterns;
+    regex_ = regex;
+    regex_classes_ =
+        reinterpret_cast<const uint32_t *>(base + hdr->regex_classes_offset);
+    patterns_dfa_ = dfa_view(base + hdr->dfa_offset, hdr->dfa_states,
+                             hdr->dfa_classes);
+    rules_ = rules;
+    dfas_ = base + hdr->dfas_offset;
+    phases_ = phases;
+    return true;
+  }
+
+  void detach() {
+    header_ = nullptr;
+    programs_ = nullptr;
+    slots_ = nullptr;
+    groups_ = nullptr;
+    option_slots_ = nullptr;
+    prefilter_ = nullptr;
+    lists_ = nullptr;
+    list_actions_ = nullptr;
+    strings_ = nullptr;
+    patterns_ = nullptr;
+    regex_ = nullptr;
+    regex_classes_ = nullptr;
+    patterns_dfa_ = DfaView{nullptr, nullptr, nullptr, 0};
+    rules_ = nullptr;
+    dfas_ = nullptr;
+    phases_ = nullptr;
+  }
+
+  bool attached() const { return header_ != nullptr; }
+
+  const SnapshotHeader *header() const { return header_; }
+
+  size_t size() const { return header_ ? header_->size : 0; }
+
+  bool built_from(const SnapshotSource &src) const {
+    return header_ && memcmp(&header_->source, &src, sizeof(src)) == 0;
+  }
+
+  uint32_t num_programs() const {
+    return header_ ? header_->programs_count : 0;
+  }
+
+  const SnapshotProgram &program(uint32_t i) const { return programs_[i]; }
+
+  uint32_t num_groups() const { return header_ ? header_->groups_count : 0; }
+
+  const SnapshotGroup &group(uint32_t i) const { return groups_[i]; }
+
+  // id of group in EXEPTOR_REPLACED marker. index of group may point to
+  // another group once config gets reloaded, its name still points to it
+  uint64_t group_id(const SnapshotGroup &g) const {
+    return snapshot_hash(str(g.name));
+  }
+
+  const SnapshotGroup *find_group(uint64_t id) const {
+    for (uint32_t i = 0; i < num_groups(); i++) {
+      if (group_id(groups_[i]) == id) {
+        return &groups_[i];
+      }
+    }
+    return nullptr;
+  }
+
+  const char *str(uint32_t offset) const { return strings_ + offset; }
+
+  // absolute path of replacement resolved when snapshot was built, only
+  // valid for the same PATH
+  const char *resolved(const SnapshotProgram &p,
+                       uint64_t search_path_hash) const {
+    if (!p.resolved || header_->search_path_hash != search_path_hash) {
+      return nullptr;
+    }
+    return strings_ + p.resolved - 1;
+  }
+
+  // string offsets of add-options or del-options of group
+  const uint32_t *list(uint32_t first) const { return lists_ + first; }
+
+  // action classes of list items, all classes unless group scopes them
+  const uint32_t *list_actions(uint32_t first) const {
+    return list_actions_ + first;
+  }
+
+  // exact name first, then the first matching pattern
+  const SnapshotProgram *find(const char *name) const {
+    if (!header_ || !name) {
+      return nullptr;
+    }
+
+    size_t len = strlen(name);
+    const SnapshotProgram *p = find_exact(name, len);
+    return p ? p : find_pattern(name);
+  }
+
+  // one DFA transition per char of path, whatever the number of patterns
+  const SnapshotProgram *find_pattern(const char *name) const {
+    if (header_->dfa_states == 0) {
+      return nullptr;
+    }
+
+    uint32_t pattern = patterns_dfa_.accept[patterns_dfa_.feed(1, name)];
+    return pattern ? &programs_[patterns_[pattern - 1].program] : nullptr;
+  }
+
+  uint32_t num_phases() const { return header_ ? header_->phases_count : 0; }
+
+  const SnapshotPhase &phase(uint32_t i) const { return phases_[i]; }
+
+  uint32_t num_inode_programs() const {
+    return header_ ? header_->inode_programs : 0;
+  }
+
+  // whether replacement of pattern program is built from captures
+  bool uses_captures(const SnapshotProgram &p) const {
+    return p.pattern && patterns_[p.pattern - 1].regex_count > 0;
+  }
+
+  // captures of path matched by program which uses them, see
+  // regex_captures. false if path takes too much backtracking: DFA has
+  // matched it, but replacement can't be built
+  bool captures(const SnapshotProgram &p, const char *name,
+                const char **caps) const {
+    const auto &pt = patterns_[p.pattern - 1];
+    return regex_captures(regex_ + pt.regex_first, pt.regex_count,
+                          regex_classes_, name, caps);
+  }
+
+  const SnapshotProgram *find_exact(const char *name, size_t len) const {
+    uint32_t bit = prefilter_bit(name, len);
+    if (!(prefilter_[bit / 32] & (1u << (bit % 32)))) {
+      return nullptr;
+    }
+
+    uint64_t h = snapshot_hash(name, len);
+    auto tag = static_cast<uint32_t>(h >> 32);
+    uint32_t mask = header_->slots_count - 1;
+    for (uint32_t i = static_cast<uint32_t>(h) & mask; slots_[i].program;
+         i = (i + 1) & mask) {
+      if (slots_[i].tag == tag) {
+        const auto &p = programs_[slots_[i].program - 1];
+        if (strcmp(name, strings_ + p.name) == 0) {
+          return &p;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  // whether argument is one of del-options of group
+  bool deletes(const SnapshotGroup &g, const char *arg) const {
+    uint32_t bit = option_lead_bit(arg);
+    if (!(g.del_lead[bit / 32] & (1u << (bit % 32)))) {
+      return false;
+    }
+
+    uint64_t h = snapshot_hash(arg);
+    auto tag = static_cast<uint32_t>(h >> 32);
+    const SnapshotOptionSlot *slots = option_slots_ + g.del_slots_first;
+    uint32_t mask = g.del_slots_count - 1;
+    for (uint32_t i = static_cast<uint32_t>(h) & mask; slots[i].option;
+         i = (i + 1) & mask) {
+      if (slots[i].tag == tag &&
+          strcmp(arg, strings_ + slots[i].option - 1) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // whether option takes its value from the next argument
+  bool takes_value(const SnapshotGroup &g, const char *arg) const {
+    if (g.pairs_dfa.states == 0) {
+      return false;
+    }
+    DfaView dfa = group_dfa(g.pairs_dfa);
+    return dfa.accept[dfa.feed(1, arg)] != 0;
+  }
+
+  // the first rule of group matching argument, value is the next argument
+  // if option takes one, otherwise nullptr
+  const SnapshotRule *match_rule(const SnapshotGroup &g, const char *arg,
+                                 const char *value) const {
+    if (g.rules_dfa.states == 0) {
+      return nullptr;
+    }
+    DfaView dfa = group_dfa(g.rules_dfa);
+    uint32_t state = dfa.feed(1, arg);
+    if (value && state) {
+      state = dfa.feed(dfa.step(state, EXEPTOR_RULE_SEPARATOR), value);
+    }
+    uint32_t rule = dfa.accept[state];
+    return rule ? &rules_[g.rules_first + rule - 1] : nullptr;
+  }
+
+  bool has_scope(const SnapshotGroup &g) const {
+    return g.include_dfa.states > 0 || g.exclude_dfa.states > 0;
+  }
+
+  // whether absolute path is covered by globs of group DFA
+  bool path_matches(const SnapshotDfa &d, const char *path) const {
+    if (d.states == 0) {
+      return false;
+    }
+    DfaView dfa = group_dfa(d);
+    return dfa.accept[dfa.feed(1, path)] != 0;
+  }
+
+  bool has_rewrite_plan(const SnapshotGroup &g) const {
+    return g.del_count > 0 || g.rules_count > 0 || g.insert_count > 0;
+  }
+
+  bool has_env_delta(const SnapshotGroup &g) const {
+    return g.env_add_count > 0 || g.env_unset_count > 0;
+  }
+
+  // whether "NAME=value" entry of envp must be dropped for group
+  bool unsets_env(const SnapshotGroup &g, const char *entry) const {
+    uint32_t bit = option_lead_bit(entry);
+    if (!(g.env_lead[bit / 32] & (1u << (bit % 32)))) {
+      return false;
+    }
+
+    for (uint32_t i = 0; i < g.env_unset_count; i++) {
+      const char *name = strings_ + lists_[g.env_unset_first + i];
+      size_t k = 0;
+      while (name[k] && entry[k] == name[k]) {
+        k++;
+      }
+      if (!name[k] && entry[k] == '=') {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool list_contains(uint32_t first, uint32_t count, const char *s) const {
+    for (uint32_t i = 0; i < count; i++) {
+      if (strcmp(strings_ + lists_[first + i], s) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  // every index stored in entries of sections is in range, DFA tables
+  // included. costs a pass over the whole snapshot
+  static bool entries_ok(const char *base, const SnapshotHeader *hdr) {
+    auto programs =
+        reinterpret_cast<const SnapshotProgram *>(base + hdr->programs_offset);
+    auto slots =
+        reinterpret_cast<const SnapshotSlot *>(base + hdr->slots_offset);
+    auto lists = reinterpret_cast<const uint32_t *>(base + hdr->lists_offset);
+
+    if (!dfa_ok(base + hdr->dfa_offset, hdr->dfa_states, hdr->dfa_classes,
+                hdr->patterns_count)) {
+      return false;
+    }
+
+    for (uint32_t i = 0; i < hdr->slots_count; i++) {
+      if (slots[i].program > hdr->programs_count) {
+        return false;
+      }
+    }
+
+    for (uint32_t i = 0; i < hdr->lists_count; i++) {
+      if (lists[i] >= hdr->strings_size) {
+        return false;
+      }
+    }
+
+    auto option_slots = reinterpret_cast<const SnapshotOptionSlot *>(
+        base + hdr->option_slots_offset);
+    for (uint32_t i = 0; i < hdr->option_slots_count; i++) {
+      if (option_slots[i].option > hdr->strings_size) {
+        return false;
+      }
+    }
+
+    auto groups =
+        reinterpret_cast<const SnapshotGroup *>(base + hdr->groups_offset);
+    for (uint32_t i = 0; i < hdr->groups_count; i++) {
+      const auto &g = groups[i];
+      if (g.name >= hdr->strings_size || g.plugin >= hdr->strings_size ||
+          !range_ok(g.add_first, g.add_count, hdr->lists_count) ||
+          !range_ok(g.del_first, g.del_count, hdr->lists_count) ||
+          !range_ok(g.del_slots_first, g.del_slots_count,
+                    hdr->option_slots_count) ||
+          (g.del_slots_count & (g.del_slots_count - 1)) != 0 ||
+          (g.del_count > 0 && g.del_slots_count <= g.del_count) ||
+          !range_ok(g.env_add_first, g.env_add_count, hdr->lists_count) ||
+          !range_ok(g.env_unset_first, g.env_unset_count, hdr->lists_count) ||
+          !range_ok(g.rules_first, g.rules_count, hdr->rules_count) ||
+          !range_ok(g.insert_first, g.insert_count, hdr->lists_count) ||
+          !group_dfa_ok(base, hdr, g.rules_dfa, g.rules_count) ||
+          !group_dfa_ok(base, hdr, g.pairs_dfa, UINT32_MAX) ||
+          !group_dfa_ok(base, hdr, g.include_dfa, UINT32_MAX) ||
+          !group_dfa_ok(base, hdr, g.exclude_dfa, UINT32_MAX)) {
+        return false;
+      }
+    }
+
+    auto phases =
+        reinterpret_cast<const SnapshotPhase *>(base + hdr->phases_offset);
+    for (uint32_t i = 0; i < hdr->phases_count; i++) {
+      if (!range_ok(phases[i].words_first, phases[i].words_count,
+                    hdr->lists_count)) {
+        return false;
+      }
+    }
+
+    auto rules =
+        reinterpret_cast<const SnapshotRule *>(base + hdr->rules_offset);
+    for (uint32_t i = 0; i < hdr->rules_count; i++) {
+      if (rules[i].action > RULE_KEEP ||
+          !range_ok(rules[i].words_first, rules[i].words_count,
+                    hdr->lists_count)) {
+        return false;
+      }
+    }
+
+    for (uint32_t i = 0; i < hdr->programs_count; i++) {
+      const auto &p = programs[i];
+      if (p.name >= hdr->strings_size || p.replacement >= hdr->strings_size ||
+          p.resolved > hdr->strings_size || p.group >= hdr->groups_count ||
+          p.pattern > hdr->patterns_count) {
+        return false;
+      }
+    }
+
+    auto patterns =
+        reinterpret_cast<const SnapshotPattern *>(base + hdr->patterns_offset);
+    auto regex = reinterpret_cast<const RegexInst *>(base + hdr->regex_offset);
+    for (uint32_t i = 0; i < hdr->patterns_count; i++) {
+      const auto &pt = patterns[i];
+      if (pt.program >= hdr->programs_count ||
+          !range_ok(pt.regex_first, pt.regex_count, hdr->regex_count)) {
+        return false;
+      }
+    }
+    for (uint32_t i = 0; i < hdr->regex_count; i++) {
+      if (regex[i].op > RE_MATCH ||
+          (regex[i].op == RE_CLASS &&
+           !range_ok(regex[i].arg, 8, hdr->regex_classes_count))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool section_ok(uint32_t offset, uint32_t count, size_t item_size,
+                         size_t total) {
+    return offset <= total && count <= (total - offset) / item_size &&
+           offset % alignof(uint32_t) == 0;
+  }
+
+  static bool range_ok(uint32_t first, uint32_t count, uint32_t total) {
+    return first <= total && count <= total - first;
+  }
+
+  // sizes and alignment of DFA tables. avail is the number of bytes DFA may
+  // take
+  static bool dfa_fits(const char *p, size_t avail, uint32_t states,
+                       uint32_t classes) {
+    return states == 0 ||
+           (states <= EXEPTOR_MAX_DFA_STATES && classes > 0 &&
+            classes <= 256 && states >= 2 &&
+            reinterpret_cast<uintptr_t>(p) % alignof(uint32_t) == 0 &&
+            avail >= 256 &&
+            (avail - 256) / sizeof(uint32_t) >=
+                static_cast<size_t>(classes + 1) * states);
+  }
+
+  // every transition and accepted index must be in range, so matching
+  // doesn't check anything. tables must fit, see dfa_fits
+  static bool dfa_ok(const char *p, uint32_t states, uint32_t classes,
+                     uint32_t max_accept) {
+    if (states == 0) {
+      return true;
+    }
+    auto classmap = reinterpret_cast<const uint8_t *>(p);
+    for (int c = 0; c < 256; c++) {
+      if (classmap[c] >= classes) {
+        return false;
+      }
+    }
+    auto next = reinterpret_cast<const uint32_t *>(classmap + 256);
+    uint32_t transitions = states * classes;
+    for (uint32_t i = 0; i < transitions; i++) {
+      if (next[i] >= states) {
+        return false;
+      }
+    }
+    for (uint32_t i = 0; i < states; i++) {
+      if (next[transitions + i] > max_accept) {
+        return false;
+      }
+    }
+    // dead state stays dead
+    for (uint32_t k = 0; k < classes; k++) {
+      if (next[k] != 0) {
+        return false;
+      }
+    }
+    return next[transitions] == 0;
+  }
+
+  static bool group_dfa_ok(const char *base, const SnapshotHeader *hdr,
+                           const SnapshotDfa &dfa, uint32_t max_accept) {
+    if (dfa.states == 0) {
+      return true;
+    }
+    if (dfa.offset > hdr->dfas_size) {
+      return false;
+    }
+    const char *p = base + hdr->dfas_offset + dfa.offset;
+    return dfa_fits(p, hdr->dfas_size - dfa.offset, dfa.states, dfa.classes) &&
+           dfa_ok(p, dfa.states, dfa.classes, max_accept);
+  }
+
+  static DfaView dfa_view(const char *p, uint32_t states, uint32_t classes) {
+    auto classmap = reinterpret_cast<const uint8_t *>(p);
+    auto next = reinterpret_cast<const uint32_t *>(classmap + 256);
+    return DfaView{classmap, next, next + states * classes, classes};
+  }
+
+  DfaView group_dfa(const SnapshotDfa &dfa) const {
+    return dfa_view(dfas_ + dfa.offset, dfa.states, dfa.classes);
+  }
+
+  const SnapshotHeader *header_ = nullptr;
+  const SnapshotProgram *programs_ = nullptr;
+  const SnapshotSlot *slots_ = nullptr;
+  const SnapshotGroup *groups_ = nullptr;
+  const SnapshotOptionSlot *option_slots_ = nullptr;
+  const uint32_t *prefilter_ = nullptr;
+  const uint32_t *lists_ = nullptr;
+  const uint32_t *list_actions_ = nullptr;
+  const char *strings_ = nullptr;
+  const SnapshotPattern *patterns_ = nullptr;
+  const RegexInst *regex_ = nullptr;
+  const uint32_t *regex_classes_ = nullptr;
+  DfaView patterns_dfa_ = {nullptr, nullptr, nullptr, 0};
+  const SnapshotRule *rules_ = nullptr;
+  const char *dfas_ = nullptr;
+  const SnapshotPhase *phases_ = nullptr;
+};
+
+// map snapshot file read-only. returns nullptr on any error.
+// mapping stays alive until munmap(), descriptor gets closed here
+inline const void *map_snapshot_file(const char *path, size_t &size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SnapshotHeader)) {
+    size = static_cast<size_t>(st.st_size);
+    p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+// map snapshot cached next to yaml config, but only if it was built from
+// the current version of config
+inline bool map_cached_snapshot(const char *config_path,
+                                ConfigSnapshot &snapshot) {
+  struct stat st;
+  char cache_path[PATH_MAX];
+
+  if (stat(config_path, &st) != 0 ||
+      !snapshot_cache_path(config_path, cache_path, sizeof(cache_path))) {
+    return false;
+  }
+
+  size_t size = 0;
+  const void *p = map_snapshot_file(cache_path, size);
+  if (!p) {
+    return false;
+  }
+
+  SnapshotSource src;
+  snapshot_source_from_stat(config_path, st, src);
+
+  if (!snapshot.attach(p, size) || !snapshot.built_from(src)) {
+    snapshot.detach();
+    munmap(const_cast<void *>(p), size);
+    return false;
+  }
+
+  return true;
+}
+
+// map snapshot published by some ancestor process through sealed memfd.
+// descriptor number comes from environment, so anything could be behind it:
+// only sealed snapshots built from the same config path are accepted. their
+// entries were validated by the ancestor, see attach
+inline bool map_inherited_snapshot(const char *fd_str, const char *config_path,
+                                   ConfigSnapshot &snapshot) {
+  char *end = nullptr;
+  long fd = strtol(fd_str, &end, 10);
+  if (end == fd_str || *end != '\0' || fd < 0 || fd > INT_MAX) {
+    return false;
+  }
+
+  int seals = fcntl(static_cast<int>(fd), F_GET_SEALS);
+  if (seals < 0 ||
+      (seals & EXEPTOR_SNAPSHOT_SEALS) != EXEPTOR_SNAPSHOT_SEALS) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(static_cast<int>(fd), &st) != 0 ||
+      st.st_size < (off_t)sizeof(SnapshotHeader)) {
+    return false;
+  }
+
+  auto size = static_cast<size_t>(st.st_size);
+  void *p =
+      mmap(nullptr, size, PROT_READ, MAP_PRIVATE, static_cast<int>(fd), 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+
+  if (!snapshot.attach(p, size, true) ||
+      snapshot.header()->source.path_hash != snapshot_hash(config_path)) {
+    snapshot.detach();
+    munmap(p, size);
+    return false;
+  }
+
+  return true;
+}
+
+// copy snapshot to sealed memfd which gets inherited by child processes.
+// returns descriptor or -1 on error
+inline int publish_snapshot(const ConfigSnapshot &snapshot) {
+  if (!snapshot.attached()) {
+    return -1;
+  }
+
+  int fd = memfd_create("exeptor-config", MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // don't let snapshot take place of closed stdin/stdout/stderr
+  if (fd <= STDERR_FILENO) {
+    int high_fd = fcntl(fd, F_DUPFD, STDERR_FILENO + 1);
+    close(fd);
+    if (high_fd < 0) {
+      return -1;
+    }
+    fd = high_fd;
+  }
+
+  auto data = reinterpret_cast<const char *>(snapshot.header());
+  size_t size = snapshot.size();
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = write(fd, data + written, size - written);
+    if (n <= 0) {
+      close(fd);
+      return -1;
+    }
+    written += static_cast<size_t>(n);
+  }
+
+  if (fcntl(fd, F_ADD_SEALS, EXEPTOR_SNAPSHOT_SEALS) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
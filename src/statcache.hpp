@@ -0,0 +1,147 @@
+/*
+
+file    :  src/statcache.hpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+path -> (st_dev, st_ino) table shared by all processes of a build, so
+matching by inode costs one stat() per distinct path per build instead of
+one per exec. the first process of a build also puts binaries of programs
+matched by inode there, as (st_dev, st_ino) -> program entries.
+
+table is a memfd made by the first process of a build, descendants inherit
+it by number like config snapshot. it goes away together with the build:
+inodes cached by one build are never seen by the next, even if some path
+gets re-pointed meanwhile. path re-pointed while build runs keeps its old
+inode until the build ends.
+
+table is written without locks: a slot is claimed by compare-and-swap of its
+key, then dev and ino get written, then the slot gets marked ready. readers
+treat slots which are not ready yet as missing. slots are never reused, when
+table is full results just don't get cached for the rest of the build
+
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EXEPTOR_STATCACHE_NAME "exeptor-stat"
+#define EXEPTOR_STATCACHE_SLOTS 8192 // power of 2
+#define EXEPTOR_STATCACHE_PROBES 16
+
+struct StatCacheSlot {
+  uint64_t key; // see find_by_inode, 0 means free slot
+  uint64_t dev;
+  uint64_t ino;
+  uint32_t ready; // dev and ino are written
+  uint32_t reserved;
+};
+
+#define EXEPTOR_STATCACHE_SIZE                                                 \
+  (EXEPTOR_STATCACHE_SLOTS * sizeof(StatCacheSlot))
+
+// new empty table, descriptor is inherited by children. -1 on failure
+inline int create_statcache() {
+  int fd = memfd_create(EXEPTOR_STATCACHE_NAME, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // don't let table take place of closed stdin/stdout/stderr
+  if (fd <= STDERR_FILENO) {
+    int high_fd = fcntl(fd, F_DUPFD, STDERR_FILENO + 1);
+    close(fd);
+    if (high_fd < 0) {
+      return -1;
+    }
+    fd = high_fd;
+  }
+
+  if (ftruncate(fd, static_cast<off_t>(EXEPTOR_STATCACHE_SIZE)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// map table made by create_statcache. inherited number may have been closed
+// and reused by the time it gets here, so anything but table of the right
+// size is refused. returns nullptr on failure
+inline StatCacheSlot *map_statcache(int fd) {
+  // link of memfd reads "/memfd:NAME (deleted)"
+  static const char target[] = "/memfd:" EXEPTOR_STATCACHE_NAME " ";
+  char link[32];
+  char buf[sizeof(target) - 1];
+  if (fd < 0) {
+    return nullptr;
+  }
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  if (readlink(link, buf, sizeof(buf)) != sizeof(buf) ||
+      memcmp(buf, target, sizeof(buf)) != 0) {
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size != static_cast<off_t>(EXEPTOR_STATCACHE_SIZE)) {
+    return nullptr;
+  }
+  void *p = mmap(nullptr, EXEPTOR_STATCACHE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  return p == MAP_FAILED ? nullptr : static_cast<StatCacheSlot *>(p);
+}
+
+inline bool statcache_get(const StatCacheSlot *slots, uint64_t key,
+                          uint64_t &dev, uint64_t &ino) {
+  uint32_t mask = EXEPTOR_STATCACHE_SLOTS - 1;
+  auto i = static_cast<uint32_t>(key) & mask;
+  for (int probe = 0; probe < EXEPTOR_STATCACHE_PROBES;
+       probe++, i = (i + 1) & mask) {
+    uint64_t k = __atomic_load_n(&slots[i].key, __ATOMIC_ACQUIRE);
+    if (k == 0) {
+      return false;
+    }
+    if (k == key) {
+      if (!__atomic_load_n(&slots[i].ready, __ATOMIC_ACQUIRE)) {
+        return false;
+      }
+      dev = slots[i].dev;
+      ino = slots[i].ino;
+      return true;
+    }
+  }
+  return false;
+}
+
+// false if there was no room for entry
+inline bool statcache_put(StatCacheSlot *slots, uint64_t key, uint64_t dev,
+                          uint64_t ino) {
+  uint32_t mask = EXEPTOR_STATCACHE_SLOTS - 1;
+  auto i = static_cast<uint32_t>(key) & mask;
+  for (int probe = 0; probe < EXEPTOR_STATCACHE_PROBES;
+       probe++, i = (i + 1) & mask) {
+    uint64_t k = 0;
+    if (__atomic_compare_exchange_n(&slots[i].key, &k, key, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      slots[i].dev = dev;
+      slots[i].ino = ino;
+      __atomic_store_n(&slots[i].ready, 1u, __ATOMIC_RELEASE);
+      return true;
+    }
+    if (k == key) {
+      return true; // somebody else is caching the same path
+    }
+  }
+  return false;
+}
@@ -3,25 +3,29 @@
 #include "../src/exeptor.cpp"
 
 #include <map>
+#include <thread>
 
-SCENARIO("vector-generating functions should work on argv/envp", "[generic]") {
+#include <sys/wait.h>
+
+SCENARIO("list-generating functions should work on argv/envp", "[generic]") {
   GIVEN("list with some elements in argv") {
     const size_t num_argv = 4;
     const char *argv[num_argv] = {"prog", "--arg1", "--a2", nullptr};
 
     REQUIRE(argv[num_argv - 1] == nullptr);
 
-    WHEN("converting argv to vector") {
-      auto args = vec_from_argv_envp(argv);
+    WHEN("converting argv to list") {
+      ArgList args;
+      args_from_argv_envp(args, argv);
 
-      // + 1 because args don't include nullptr
-      THEN("vector size + 1 equals argv size") {
-        REQUIRE(args.size() + 1 == num_argv);
+      // + 1 because list size doesn't include nullptr
+      THEN("list size + 1 equals argv size") {
+        REQUIRE(args.size + 1 == num_argv);
       }
 
-      THEN("vector elements point to same argv elements") {
-        for (size_t i = 0; i < num_argv - 1; i++) {
-          REQUIRE(args[i] == argv[i]);
+      THEN("list elements point to same argv elements") {
+        for (size_t i = 0; i < num_argv; i++) {
+          REQUIRE(args.items[i] == argv[i]);
         }
       }
     }
@@ -31,42 +35,47 @@ SCENARIO("vector-generating functions should work on argv/envp", "[generic]") {
 SCENARIO("argument replacement should work correctly", "[argv]") {
   GIVEN("Settings loaded with two distinct programs and arguments") {
     g_settings.programs.clear();
-    g_settings.add_options.clear();
-    g_settings.del_options.clear();
+    g_settings.groups.clear();
 
     std::string orig1_name = "orig_prog";
     std::string repl1_name = "rep_prog";
-    g_settings.programs[orig1_name] = repl1_name;
-    g_settings.add_options[orig1_name] = {"--add1", "--add2"};
-    g_settings.del_options[orig1_name] = {"--rem1", "--rem2", "--rem3"};
+    auto group1 = g_settings.add_group("group1");
+    g_settings.programs[orig1_name] = {repl1_name, group1};
+    g_settings.groups[group1].add_options = {"--add1", "--add2"};
+    g_settings.groups[group1].del_options = {"--rem1", "--rem2", "--rem3"};
 
     std::string orig2_name = "orig_prog2";
     std::string repl2_name = "rep_prog2";
-    g_settings.programs[orig2_name] = repl2_name;
-    g_settings.add_options[orig2_name] = {"--added1", "--added2", "--added3"};
+    auto group2 = g_settings.add_group("group2");
+    g_settings.programs[orig2_name] = {repl2_name, group2};
+    g_settings.groups[group2].add_options = {"--added1", "--added2",
+                                             "--added3"};
+
+    REQUIRE(apply_settings(g_settings));
 
     REQUIRE(g_settings.programs.size() == 2);
-    REQUIRE(g_settings.add_options.size() == 2);
-    REQUIRE(g_settings.del_options.size() ==
-            1); // second program has only "add-options"
+    REQUIRE(g_settings.groups.size() == 2);
+    // second program has only "add-options"
+    REQUIRE(g_settings.groups[group2].del_options.empty());
 
     WHEN("input program doesn't match") {
-      std::string prog = "something";
+      const char *prog = "something";
       auto argv_vec =
-          std::vector<const char *>{prog.c_str(),  "--add1", "--added2", "-a",
+          std::vector<const char *>{prog,          "--add1", "--added2", "-a",
                                     "--something", "--rem3", nullptr};
       // argv as seen in execv-like calls
       auto argv = const_cast<char *const *>(argv_vec.data());
 
-      auto args = vec_from_argv_envp(argv); // argv as used in prep_argv_envp
+      ArgList args;
+      args_from_argv_envp(args, argv); // argv as used in prep_argv_envp
 
       // + 1 because args don't include nullptr
-      REQUIRE(args.size() + 1 == argv_vec.size());
+      REQUIRE(args.size + 1 == argv_vec.size());
 
       prep_prog_argv(prog, args);
 
       THEN("resulting program should stay unchanged") {
-        REQUIRE(prog == "something");
+        REQUIRE(std::string(prog) == "something");
       }
 
       THEN("resulting argv should stay unchanged") {
@@ -74,27 +83,28 @@ SCENARIO("argument replacement should work correctly", "[argv]") {
             std::vector<const char *>{"something",   "--add1", "--added2", "-a",
                                       "--something", "--rem3", nullptr};
 
-        REQUIRE(args.size() == check.size());
+        REQUIRE(args.size + 1 == check.size());
 
-        for (size_t i = 0; i < args.size() - 1; i++) {
-          REQUIRE(std::strcmp(args[i], check[i]) == 0);
+        for (size_t i = 0; i < args.size; i++) {
+          REQUIRE(std::strcmp(args.items[i], check[i]) == 0);
         }
-        REQUIRE(args[args.size() - 1] == nullptr);
+        REQUIRE(args.items[args.size] == nullptr);
       }
     }
 
     WHEN("input program matches program with add-options") {
-      std::string prog = orig2_name;
+      const char *prog = orig2_name.c_str();
       auto argv_vec =
-          std::vector<const char *>{prog.c_str(),  "--add1", "--added2", "-a",
+          std::vector<const char *>{prog,          "--add1", "--added2", "-a",
                                     "--something", "--rem3", nullptr};
       // argv as seen in execv-like calls
       auto argv = const_cast<char *const *>(argv_vec.data());
 
-      auto args = vec_from_argv_envp(argv); // argv as used in prep_argv_envp
+      ArgList args;
+      args_from_argv_envp(args, argv); // argv as used in prep_argv_envp
 
       // + 1 because args don't include nullptr
-      REQUIRE(args.size() + 1 == argv_vec.size());
+      REQUIRE(args.size + 1 == argv_vec.size());
 
       prep_prog_argv(prog, args);
 
@@ -103,7 +113,7 @@ SCENARIO("argument replacement should work correctly", "[argv]") {
       }
 
       THEN("argv[0] should change to correct replacement") {
-        REQUIRE(repl2_name == args[0]);
+        REQUIRE(repl2_name == args.items[0]);
       }
 
       THEN("resulting argv should pass check") {
@@ -112,28 +122,29 @@ SCENARIO("argument replacement should work correctly", "[argv]") {
             "--something",      "--rem3", "--added1", "--added2",
             "--added3",         nullptr};
 
-        REQUIRE(args.size() == check.size());
+        REQUIRE(args.size + 1 == check.size());
 
-        for (size_t i = 0; i < args.size() - 1; i++) {
-          REQUIRE(std::strcmp(args[i], check[i]) == 0);
+        for (size_t i = 0; i < args.size; i++) {
+          REQUIRE(std::strcmp(args.items[i], check[i]) == 0);
         }
 
-        REQUIRE(args[args.size() - 1] == nullptr);
+        REQUIRE(args.items[args.size] == nullptr);
       }
     }
 
     WHEN("input program matches program with both add-options & del-options") {
-      std::string prog = orig1_name;
+      const char *prog = orig1_name.c_str();
       auto argv_vec =
-          std::vector<const char *>{prog.c_str(),  "--add1", "--added2", "-a",
+          std::vector<const char *>{prog,          "--add1", "--added2", "-a",
                                     "--something", "--rem3", nullptr};
       auto argv = const_cast<char *const *>(
           argv_vec.data()); // argv as seen in execv-like calls
 
-      auto args = vec_from_argv_envp(argv); // argv as used in prep_argv_envp
+      ArgList args;
+      args_from_argv_envp(args, argv); // argv as used in prep_argv_envp
 
       // + 1 because args don't include nullptr
-      REQUIRE(args.size() + 1 == argv_vec.size());
+      REQUIRE(args.size + 1 == argv_vec.size());
 
       prep_prog_argv(prog, args);
 
@@ -142,7 +153,7 @@ SCENARIO("argument replacement should work correctly", "[argv]") {
       }
 
       THEN("argv[0] should change to correct replacement") {
-        REQUIRE(repl1_name == args[0]);
+        REQUIRE(repl1_name == args.items[0]);
       }
 
       THEN("resulting argv should pass check") {
@@ -150,13 +161,57 @@ SCENARIO("argument replacement should work correctly", "[argv]") {
             repl1_name.c_str(), "--add1", "--added2", "-a",
             "--something",      "--add1", "--add2",   nullptr};
 
-        REQUIRE(args.size() == check.size());
+        REQUIRE(args.size + 1 == check.size());
 
-        for (size_t i = 0; i < args.size() - 1; i++) {
-          REQUIRE(std::strcmp(args[i], check[i]) == 0);
+        for (size_t i = 0; i < args.size; i++) {
+          REQUIRE(std::strcmp(args.items[i], check[i]) == 0);
         }
 
-        REQUIRE(args[args.size() - 1] == nullptr);
+        REQUIRE(args.items[args.size] == nullptr);
+      }
+    }
+  }
+}
+
+SCENARIO("long link command lines should be rewritten in one pass", "[argv]") {
+  GIVEN("Linker with many del-options") {
+    ReplacementSettings settings;
+    auto group = settings.add_group("linkers");
+    settings.programs["ld"] = {"ld.lld", group};
+    for (int i = 0; i < 100; i++) {
+      settings.groups[group].del_options.push_back("--opt" +
+                                                   std::to_string(i));
+    }
+    settings.groups[group].add_options = {"--gc-sections"};
+    REQUIRE(apply_settings(settings));
+
+    WHEN("10k objects are mixed with options to delete") {
+      std::vector<std::string> storage;
+      for (int i = 0; i < 10000; i++) {
+        storage.push_back(i % 100 == 0 ? "--opt" + std::to_string(i / 100)
+                                       : "obj" + std::to_string(i) + ".o");
+      }
+
+      ArgList args;
+      args.push("ld");
+      for (const auto &arg : storage) {
+        args.push(arg.c_str());
+      }
+
+      const char *prog = "ld";
+      prep_prog_argv(prog, args);
+
+      THEN("only deleted options should be gone, order should be kept") {
+        REQUIRE(std::string("ld.lld") == prog);
+        REQUIRE(args.size == 1 + 10000 - 100 + 1);
+        size_t k = 1;
+        for (int i = 0; i < 10000; i++) {
+          if (i % 100 != 0) {
+            REQUIRE(storage[i] == args.items[k++]);
+          }
+        }
+        REQUIRE(std::string("--gc-sections") == args.items[k++]);
+        REQUIRE(args.items[k] == nullptr);
       }
     }
   }
@@ -167,8 +222,9 @@ SCENARIO("exeptor env variables should propagate correctly", "[env]") {
     std::vector<const char *> envp = {"KEY=value", "K=\"123 124 125\"",
                                       "SOMEPATH=/var/logs:/home/user/logs",
                                       nullptr};
+    auto app_envp = const_cast<char *const *>(envp.data());
 
-    auto envs = vec_from_argv_envp(envp.data());
+    ArgList envs;
 
     clearenv();
 
@@ -177,56 +233,80 @@ SCENARIO("exeptor env variables should propagate correctly", "[env]") {
         setenv(exeptor_envs[i], exeptor_envs[i], 1);
       }
 
-      prep_common_envp(envs);
-
-      THEN("env vars passed by application should be kept") {
-        REQUIRE(envs.size() >= envp.size());
+      auto result = prep_common_envp(app_envp, envs);
 
-        for (const auto &e : envp) {
-          REQUIRE(std::find(envs.cbegin(), envs.cend(), e) != envs.cend());
+      THEN("env vars passed by application should be kept in order") {
+        REQUIRE(result == envs.data());
+        for (size_t i = 0; i + 1 < envp.size(); i++) {
+          REQUIRE(result[i] == envp[i]);
         }
       }
 
       THEN("exeptor env vars should be added with correct values") {
-        REQUIRE(envs.size() >= envp.size() + 1);
-
-        char tmp[sizeof(exeptor_envs[0]) * 2 + 2];
-
         for (size_t i = 0; i < num_exeptor_vars; i++) {
-          snprintf(tmp, sizeof(tmp), "%s=%s", exeptor_envs[i], exeptor_envs[i]);
-          auto variable_present =
-              std::find_if(envs.cbegin(), envs.cend(), [&tmp](const char *s) {
-                return s != nullptr && strcmp(s, tmp) == 0;
-              }) != envs.cend();
-
-          REQUIRE(variable_present);
+          std::string var =
+              std::string(exeptor_envs[i]) + "=" + exeptor_envs[i];
+          REQUIRE(var == result[envp.size() - 1 + i]);
         }
       }
 
       THEN("resulting envp should terminate with NULL") {
-        REQUIRE(envs[envs.size() - 1] == nullptr);
+        REQUIRE(envs.items[envs.size] == nullptr);
       }
 
       THEN("no surplus env vars should be added") {
-        REQUIRE(envs.size() == envp.size() + num_exeptor_vars);
+        REQUIRE(envs.size + 1 == envp.size() + num_exeptor_vars);
       }
-    }
 
-    WHEN("NO exeptor variables present") {
-      prep_common_envp(envs);
+      AND_WHEN("resulting envp is used for next exec") {
+        ArgList envs2;
+        auto result2 = prep_common_envp(result, envs2);
 
-      THEN("env vars passed by application should be kept") {
-        for (const auto &e : envp) {
-          REQUIRE(std::find(envs.cbegin(), envs.cend(), e) != envs.cend());
+        THEN("it should be passed as is") {
+          REQUIRE(result2 == result);
+          REQUIRE(envs2.size == 0);
         }
       }
+    }
 
-      THEN("resulting envp should terminate with NULL") {
-        REQUIRE(envs[envs.size() - 1] == nullptr);
+    WHEN("some exeptor variables have wrong values") {
+      setenv("LD_PRELOAD", "/lib/libexeptor.so", 1);
+      setenv("EXEPTOR_CONFIG", "/etc/exeptor.yaml", 1);
+
+      envp.insert(envp.begin() + 1, "LD_PRELOAD=/lib/other.so");
+      envp.insert(envp.begin() + 2, "EXEPTOR_CONFIG=/etc/exeptor.yaml");
+      envp.insert(envp.begin() + 3, "LD_PRELOAD=/lib/another.so");
+      app_envp = const_cast<char *const *>(envp.data());
+
+      auto result = prep_common_envp(app_envp, envs);
+
+      THEN("they should be patched in place and duplicates dropped") {
+        std::vector<std::string> check = {
+            "KEY=value", "LD_PRELOAD=/lib/libexeptor.so",
+            "EXEPTOR_CONFIG=/etc/exeptor.yaml", "K=\"123 124 125\"",
+            "SOMEPATH=/var/logs:/home/user/logs"};
+        REQUIRE(envs.size == check.size());
+        for (size_t i = 0; i < check.size(); i++) {
+          REQUIRE(check[i] == result[i]);
+        }
+        REQUIRE(result[check.size()] == nullptr);
       }
+    }
 
-      THEN("no surplus env vars should be added") {
-        REQUIRE(envs.size() == envp.size());
+    WHEN("NO exeptor variables present") {
+      auto result = prep_common_envp(app_envp, envs);
+
+      THEN("envp of application should be passed as is") {
+        REQUIRE(result == app_envp);
+        REQUIRE(envs.size == 0);
+      }
+    }
+
+    WHEN("application passes environ") {
+      setenv("LD_PRELOAD", "/lib/libexeptor.so", 1);
+
+      THEN("it should be passed as is") {
+        REQUIRE(prep_common_envp(environ, envs) == environ);
       }
     }
   }
@@ -235,14 +315,16 @@ SCENARIO("exeptor env variables should propagate correctly", "[env]") {
 SCENARIO("changes to argv and envp should not affect each other", "[generic]") {
   GIVEN("Settings loaded with one program") {
     g_settings.programs.clear();
-    g_settings.add_options.clear();
-    g_settings.del_options.clear();
+    g_settings.groups.clear();
 
     std::string orig1_name = "orig_prog";
     std::string repl1_name = "rep_prog";
-    g_settings.programs[orig1_name] = repl1_name;
-    g_settings.add_options[orig1_name] = {"--add1", "--add2"};
-    g_settings.del_options[orig1_name] = {"--rem1", "--rem2", "--rem3"};
+    auto group1 = g_settings.add_group("group1");
+    g_settings.programs[orig1_name] = {repl1_name, group1};
+    g_settings.groups[group1].add_options = {"--add1", "--add2"};
+    g_settings.groups[group1].del_options = {"--rem1", "--rem2", "--rem3"};
+
+    REQUIRE(apply_settings(g_settings));
 
     clearenv();
 
@@ -259,57 +341,63 @@ SCENARIO("changes to argv and envp should not affect each other", "[generic]") {
                                           "SOMEPATH=/var/logs:/home/user/logs",
                                           nullptr};
 
-        auto args = vec_from_argv_envp(argv.data());
-        auto envs = vec_from_argv_envp(envp.data());
+        ArgList args;
+        args_from_argv_envp(args, argv.data());
+        ArgList envs;
 
-        std::string prog = "orig_prog";
+        const char *prog = "orig_prog";
 
-        prep_prog_argv_env(prog, args, envs);
+        auto result = prep_prog_argv_env(
+            prog, args, const_cast<char *const *>(envp.data()), envs);
+        REQUIRE(result == envs.data());
 
         THEN("intercepted argv options should pass check") {
           auto check = std::vector<const char *>{
               repl1_name.c_str(), "--good", "1", "--add1", "--add2", nullptr};
 
-          REQUIRE(args.size() == check.size());
+          REQUIRE(args.size + 1 == check.size());
 
-          for (size_t i = 0; i < args.size() - 1; i++) {
-            REQUIRE(std::strcmp(args[i], check[i]) == 0);
+          for (size_t i = 0; i < args.size; i++) {
+            REQUIRE(std::strcmp(args.items[i], check[i]) == 0);
           }
 
-          REQUIRE(args[args.size() - 1] == nullptr);
+          REQUIRE(args.items[args.size] == nullptr);
         }
 
         THEN("env vars passed by application should be kept") {
-          REQUIRE(envs.size() >= envp.size());
+          REQUIRE(envs.size + 1 >= envp.size());
 
           for (const auto &e : envp) {
-            REQUIRE(std::find(envs.cbegin(), envs.cend(), e) != envs.cend());
+            REQUIRE(std::find(envs.items, envs.items + envs.size + 1, e) !=
+                  envs.items + envs.size + 1);
           }
         }
 
         THEN("exeptor env vars should be added with correct values") {
-          REQUIRE(envs.size() >= envp.size() + 1);
+          REQUIRE(envs.size + 1 >= envp.size() + 1);
 
-          char tmp[sizeof(exeptor_envs[0]) * 2 + 2];
+          char tmp[256];
 
           for (size_t i = 0; i < num_exeptor_vars; i++) {
             snprintf(tmp, sizeof(tmp), "%s=%s", exeptor_envs[i],
                      exeptor_envs[i]);
             auto variable_present =
-                std::find_if(envs.cbegin(), envs.cend(), [&tmp](const char *s) {
-                  return s != nullptr && strcmp(s, tmp) == 0;
-                }) != envs.cend();
+                std::find_if(envs.items, envs.items + envs.size,
+                             [&tmp](const char *s) {
+                               return strcmp(s, tmp) == 0;
+                             }) != envs.items + envs.size;
 
             REQUIRE(variable_present);
           }
         }
 
         THEN("resulting envp should terminate with NULL") {
-          REQUIRE(envs[envs.size() - 1] == nullptr);
+          REQUIRE(envs.items[envs.size] == nullptr);
         }
 
         THEN("no surplus env vars should be added") {
-          REQUIRE(envs.size() == envp.size() + num_exeptor_vars);
+          // replacement marker is the only extra variable
+          REQUIRE(envs.size + 1 == envp.size() + num_exeptor_vars + 1);
         }
       }
 
@@ -318,9 +406,10 @@ SCENARIO("changes to argv and envp should not affect each other", "[generic]") {
         std::vector<const char *> argv = {"argv0", "--rem1", "--good",
                                           "1",     "--rem2", nullptr};
 
-        auto args = vec_from_argv_envp(argv.data());
+        ArgList args;
+        args_from_argv_envp(args, argv.data());
 
-        std::string prog = "orig_prog";
+        const char *prog = "orig_prog";
 
         prep_prog_argv(prog, args);
 
@@ -328,32 +417,34 @@ SCENARIO("changes to argv and envp should not affect each other", "[generic]") {
           auto check = std::vector<const char *>{
               repl1_name.c_str(), "--good", "1", "--add1", "--add2", nullptr};
 
-          REQUIRE(args.size() == check.size());
+          REQUIRE(args.size + 1 == check.size());
 
-          for (size_t i = 0; i < args.size() - 1; i++) {
-            REQUIRE(std::strcmp(args[i], check[i]) == 0);
+          for (size_t i = 0; i < args.size; i++) {
+            REQUIRE(std::strcmp(args.items[i], check[i]) == 0);
           }
 
-          REQUIRE(args[args.size() - 1] == nullptr);
+          REQUIRE(args.items[args.size] == nullptr);
         }
 
         THEN("exeptor env vars should be added with correct values") {
-          auto envs = vec_from_argv_envp(environ);
+          ArgList envs;
+          args_from_argv_envp(envs, environ);
 
-          REQUIRE(envs[envs.size() - 1] != nullptr);
+          REQUIRE(envs.items[envs.size - 1] != nullptr);
 
           // no NULL in envs, hence exact size match required
-          REQUIRE(envs.size() == num_exeptor_vars);
+          REQUIRE(envs.size == num_exeptor_vars);
 
-          char tmp[sizeof(exeptor_envs[0]) * 2 + 2];
+          char tmp[256];
 
           for (size_t i = 0; i < num_exeptor_vars; i++) {
             snprintf(tmp, sizeof(tmp), "%s=%s", exeptor_envs[i],
                      exeptor_envs[i]);
             auto variable_present =
-                std::find_if(envs.cbegin(), envs.cend(), [&tmp](const char *s) {
-                  return s != nullptr && strcmp(s, tmp) == 0;
-                }) != envs.cend();
+                std::find_if(envs.items, envs.items + envs.size,
+                             [&tmp](const char *s) {
+                               return strcmp(s, tmp) == 0;
+                             }) != envs.items + envs.size;
 
             REQUIRE(variable_present);
           }
@@ -362,3 +453,3158 @@ SCENARIO("changes to argv and envp should not affect each other", "[generic]") {
     }
   }
 }
+
+SCENARIO("config snapshot should work as replacement settings", "[snapshot]") {
+  GIVEN("Settings compiled to snapshot") {
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    auto binutils = settings.add_group("binutils");
+    settings.programs["gcc"] = {"afl-clang-fast", cc};
+    settings.programs["/usr/bin/gcc"] = {"/usr/local/bin/afl-clang-fast", cc};
+    settings.programs["ar"] = {"llvm-ar", binutils};
+    settings.groups[cc].add_options = {"-g", "-O1"};
+    settings.groups[cc].del_options = {"-Werror"};
+
+    SnapshotSource source;
+    memset(&source, 0, sizeof(source));
+    source.size = 123;
+
+    std::vector<char> bytes;
+    REQUIRE(settings.build_snapshot(source, bytes));
+
+    ConfigSnapshot snapshot;
+    REQUIRE(snapshot.attach(bytes.data(), bytes.size()));
+
+    THEN("every program should be found with its replacement") {
+      REQUIRE(snapshot.num_programs() == settings.programs.size());
+      for (const auto &prog : settings.programs) {
+        auto t = snapshot.find(prog.first.c_str());
+        REQUIRE(t != nullptr);
+        REQUIRE(prog.second.path == snapshot.str(t->replacement));
+        REQUIRE(prog.second.group == t->group);
+      }
+    }
+
+    THEN("unknown programs should not be found") {
+      REQUIRE(snapshot.find("cc") == nullptr);
+      REQUIRE(snapshot.find("") == nullptr);
+      REQUIRE(snapshot.find("/usr/bin/gcc-12") == nullptr);
+    }
+
+    THEN("options should be stored once per group in config order") {
+      REQUIRE(snapshot.num_groups() == 2);
+
+      auto t = snapshot.find("gcc");
+      REQUIRE(t != nullptr);
+      auto &g = snapshot.group(t->group);
+      REQUIRE(std::string("cc") == snapshot.str(g.name));
+      REQUIRE(g.add_count == 2);
+      REQUIRE(g.del_count == 1);
+      auto add = snapshot.list(g.add_first);
+      REQUIRE(std::string("-g") == snapshot.str(add[0]));
+      REQUIRE(std::string("-O1") == snapshot.str(add[1]));
+      REQUIRE(snapshot.list_contains(g.del_first, g.del_count, "-Werror"));
+      REQUIRE_FALSE(snapshot.list_contains(g.del_first, g.del_count, "-g"));
+
+      REQUIRE(snapshot.find("/usr/bin/gcc")->group == t->group);
+
+      auto ar = snapshot.find("ar");
+      REQUIRE(ar != nullptr);
+      REQUIRE(snapshot.group(ar->group).add_count == 0);
+      REQUIRE(snapshot.group(ar->group).del_count == 0);
+    }
+
+    THEN("del-options should be looked up through group hash table") {
+      auto &g = snapshot.group(snapshot.find("gcc")->group);
+      REQUIRE(snapshot.deletes(g, "-Werror"));
+      REQUIRE_FALSE(snapshot.deletes(g, "-Werror=format"));
+      REQUIRE_FALSE(snapshot.deletes(g, "-g"));
+      REQUIRE_FALSE(snapshot.deletes(g, "main.o"));
+      REQUIRE_FALSE(snapshot.deletes(g, ""));
+
+      auto &binutils_group = snapshot.group(snapshot.find("ar")->group);
+      REQUIRE(binutils_group.del_slots_count == 0);
+      REQUIRE_FALSE(snapshot.deletes(binutils_group, "-Werror"));
+    }
+
+    THEN("option slot pointing outside of strings should be rejected") {
+      auto hdr = reinterpret_cast<SnapshotHeader *>(bytes.data());
+      REQUIRE(hdr->option_slots_count > 0);
+      auto slots = reinterpret_cast<SnapshotOptionSlot *>(
+          &bytes[hdr->option_slots_offset]);
+      slots[0].option = hdr->strings_size + 1;
+      REQUIRE_FALSE(snapshot.attach(bytes.data(), bytes.size()));
+    }
+
+    THEN("program pointing to missing group should be rejected") {
+      auto hdr = reinterpret_cast<SnapshotHeader *>(bytes.data());
+      auto progs =
+          reinterpret_cast<SnapshotProgram *>(&bytes[hdr->programs_offset]);
+      progs[0].group = hdr->groups_count;
+      REQUIRE_FALSE(snapshot.attach(bytes.data(), bytes.size()));
+    }
+
+    THEN("snapshot should remember its source") {
+      REQUIRE(snapshot.built_from(source));
+      source.mtime_sec++;
+      REQUIRE_FALSE(snapshot.built_from(source));
+    }
+
+    WHEN("snapshot is damaged") {
+      THEN("truncated snapshot should be rejected") {
+        REQUIRE_FALSE(snapshot.attach(bytes.data(), bytes.size() - 8));
+        REQUIRE_FALSE(snapshot.attached());
+      }
+
+      THEN("snapshot with wrong magic should be rejected") {
+        bytes[0] = 'X';
+        REQUIRE_FALSE(snapshot.attach(bytes.data(), bytes.size()));
+      }
+
+      THEN("snapshot with program pointing outside of strings is rejected") {
+        auto hdr = reinterpret_cast<SnapshotHeader *>(bytes.data());
+        auto progs =
+            reinterpret_cast<SnapshotProgram *>(&bytes[hdr->programs_offset]);
+        progs[0].replacement = hdr->strings_size;
+        REQUIRE_FALSE(snapshot.attach(bytes.data(), bytes.size()));
+      }
+    }
+  }
+}
+
+SCENARIO("program lookup should scale to big generated configs",
+         "[snapshot]") {
+  GIVEN("Snapshot with thousands of cross-toolchain entries") {
+    ReplacementSettings settings;
+    auto group = settings.add_group("cross");
+    const char *archs[] = {"x86_64", "aarch64", "riscv64", "mips", "armv7"};
+    for (const auto arch : archs) {
+      for (int version = 0; version < 1000; version++) {
+        std::string name = std::string("/opt/cross/bin/") + arch +
+                           "-linux-gnu-gcc-" + std::to_string(version);
+        settings.programs[name] = {name + "-afl", group};
+      }
+    }
+    REQUIRE(settings.programs.size() == 5000);
+
+    SnapshotSource source;
+    memset(&source, 0, sizeof(source));
+
+    std::vector<char> bytes;
+    REQUIRE(settings.build_snapshot(source, bytes));
+
+    ConfigSnapshot snapshot;
+    REQUIRE(snapshot.attach(bytes.data(), bytes.size()));
+
+    THEN("every entry should be found") {
+      for (const auto &prog : settings.programs) {
+        auto t = snapshot.find(prog.first.c_str());
+        REQUIRE(t != nullptr);
+        REQUIRE(prog.second.path == snapshot.str(t->replacement));
+      }
+    }
+
+    THEN("similar but unknown paths should not be found") {
+      REQUIRE(snapshot.find("/opt/cross/bin/x86_64-linux-gnu-gcc-1000") ==
+              nullptr);
+      REQUIRE(snapshot.find("/opt/cross/bin/x86_64-linux-gnu-gcc-") == nullptr);
+      REQUIRE(snapshot.find("/opt/cross/bin/x86_64-linux-gnu-gcc-1-afl") ==
+              nullptr);
+      REQUIRE(snapshot.find("/bin/sh") == nullptr);
+    }
+
+    THEN("hash table pointing to missing program should be rejected") {
+      auto hdr = reinterpret_cast<SnapshotHeader *>(bytes.data());
+      auto slots = reinterpret_cast<SnapshotSlot *>(&bytes[hdr->slots_offset]);
+      slots[0].program = hdr->programs_count + 1;
+      REQUIRE_FALSE(snapshot.attach(bytes.data(), bytes.size()));
+    }
+  }
+
+  GIVEN("Snapshot with a few programs") {
+    ReplacementSettings settings;
+    auto group = settings.add_group("cc");
+    settings.programs["gcc"] = {"afl-clang-fast", group};
+    settings.programs["/usr/bin/gcc"] = {"afl-clang-fast", group};
+
+    SnapshotSource source;
+    memset(&source, 0, sizeof(source));
+
+    std::vector<char> bytes;
+    REQUIRE(settings.build_snapshot(source, bytes));
+
+    ConfigSnapshot snapshot;
+    REQUIRE(snapshot.attach(bytes.data(), bytes.size()));
+
+    THEN("prefilter should pass names of programs") {
+      auto hdr = snapshot.header();
+      auto prefilter =
+          reinterpret_cast<const uint32_t *>(&bytes[hdr->prefilter_offset]);
+      for (const auto &prog : settings.programs) {
+        uint32_t bit = prefilter_bit(prog.first.c_str(), prog.first.size());
+        REQUIRE((prefilter[bit / 32] & (1u << (bit % 32))) != 0);
+      }
+    }
+
+    THEN("paths of other lengths or endings should be rejected by prefilter") {
+      auto hdr = snapshot.header();
+      auto prefilter =
+          reinterpret_cast<const uint32_t *>(&bytes[hdr->prefilter_offset]);
+      const char *others[] = {"/bin/sh", "sed", "gcd", "/usr/bin/rm"};
+      for (const auto other : others) {
+        uint32_t bit = prefilter_bit(other, strlen(other));
+        REQUIRE((prefilter[bit / 32] & (1u << (bit % 32))) == 0);
+        REQUIRE(snapshot.find(other) == nullptr);
+      }
+    }
+  }
+}
+
+SCENARIO("patterns should be matched by one automaton", "[patterns]") {
+  GIVEN("Snapshot with exact names and patterns") {
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.add_program("gcc", {"afl-gcc-fast", cc});
+    settings.add_program("base:cc", {"afl-cc", cc});
+    settings.add_program("glob:*-linux-gnu-gcc-*", {"\\1-afl-gcc-\\2", cc});
+    settings.add_program("re:^/opt/rh/devtoolset-([0-9]+)/root/usr/bin/"
+                         "(gcc|g\\+\\+)$",
+                         {"/opt/afl/\\2-\\1", cc});
+    settings.add_program("glob:*gcc*", {"afl-clang-fast", cc});
+    REQUIRE(settings.programs.size() == 1);
+    REQUIRE(settings.patterns.size() == 4);
+
+    SnapshotSource source;
+    memset(&source, 0, sizeof(source));
+
+    std::vector<char> bytes;
+    REQUIRE(settings.build_snapshot(source, bytes));
+
+    ConfigSnapshot snapshot;
+    REQUIRE(snapshot.attach(bytes.data(), bytes.size()));
+
+    THEN("exact names should take priority over patterns") {
+      auto t = snapshot.find("gcc");
+      REQUIRE(t != nullptr);
+      REQUIRE(t->pattern == 0);
+      REQUIRE(std::string(snapshot.str(t->replacement)) == "afl-gcc-fast");
+    }
+
+    THEN("basename patterns should match any directory") {
+      for (auto path : {"cc", "/usr/bin/cc", "./cc"}) {
+        auto t = snapshot.find(path);
+        REQUIRE(t != nullptr);
+        REQUIRE(std::string(snapshot.str(t->replacement)) == "afl-cc");
+      }
+      REQUIRE(snapshot.find("/usr/bin/ccache") == nullptr);
+      REQUIRE(snapshot.find("/usr/bin/cc/") == nullptr);
+      REQUIRE(snapshot.find("/bin/sh") == nullptr);
+    }
+
+    THEN("earlier patterns should take priority over later ones") {
+      auto t = snapshot.find("/usr/bin/x86_64-linux-gnu-gcc-12");
+      REQUIRE(t != nullptr);
+      REQUIRE(t->pattern == 2);
+      t = snapshot.find("/usr/local/bin/gcc-12");
+      REQUIRE(t != nullptr);
+      REQUIRE(t->pattern == 4);
+    }
+
+    THEN("replacements should be built from captures") {
+      REQUIRE(apply_settings(settings));
+      const struct {
+        const char *path;
+        const char *replacement;
+      } cases[] = {
+          {"x86_64-linux-gnu-gcc-12", "x86_64-afl-gcc-12"},
+          {"/usr/bin/aarch64-linux-gnu-gcc-9", "aarch64-afl-gcc-9"},
+          {"/opt/rh/devtoolset-11/root/usr/bin/g++", "/opt/afl/g++-11"},
+          {"/opt/rh/devtoolset-7/root/usr/bin/gcc", "/opt/afl/gcc-7"},
+          {"/usr/local/bin/gcc-12", "afl-clang-fast"},
+      };
+      for (const auto &c : cases) {
+        const char *argv[] = {c.path, "-c", "a.c", nullptr};
+        ArgList args;
+        args_from_argv_envp(args, argv);
+        const char *prog = c.path;
+        prep_prog_argv(prog, args);
+        REQUIRE(std::string(prog) == c.replacement);
+        REQUIRE(std::string(args.items[0]) == c.replacement);
+        REQUIRE(args.size == 3);
+      }
+    }
+
+    THEN("paths with captures out of reach should not be replaced") {
+      REQUIRE(apply_settings(settings));
+      // every directory char is a choice of (?:.*/)? to backtrack to
+      std::string path =
+          "/" + std::string(2 * EXEPTOR_REGEX_BACKTRACK, 'd') +
+          "/x86_64-linux-gnu-gcc-12";
+      auto t = snapshot.find(path.c_str());
+      REQUIRE(t != nullptr);
+      REQUIRE(t->pattern == 2);
+      const char *caps[2 * EXEPTOR_REGEX_MAX_CAPTURES];
+      REQUIRE_FALSE(snapshot.captures(*t, path.c_str(), caps));
+
+      const char *argv[] = {path.c_str(), "-c", "a.c", nullptr};
+      ArgList args;
+      args_from_argv_envp(args, argv);
+      const char *prog = path.c_str();
+      prep_prog_argv(prog, args);
+      REQUIRE(prog == path);
+      REQUIRE(args.items[0] == path);
+      REQUIRE(args.size == 3);
+    }
+
+    THEN("DFA with transitions out of range should be rejected") {
+      auto hdr = reinterpret_cast<SnapshotHeader *>(bytes.data());
+      auto next = reinterpret_cast<uint32_t *>(&bytes[hdr->dfa_offset + 256]);
+      next[hdr->dfa_classes] = hdr->dfa_states;
+      REQUIRE_FALSE(snapshot.attach(bytes.data(), bytes.size()));
+    }
+  }
+
+  GIVEN("Hundreds of cross-toolchain patterns") {
+    ReplacementSettings settings;
+    auto group = settings.add_group("cross");
+    for (int i = 0; i < 300; i++) {
+      settings.add_program("glob:/opt/cross" + std::to_string(i) + "/bin/*-gcc",
+                           {"afl-" + std::to_string(i) + "-\\1", group});
+    }
+
+    SnapshotSource source;
+    memset(&source, 0, sizeof(source));
+
+    std::vector<char> bytes;
+    REQUIRE(settings.build_snapshot(source, bytes));
+
+    ConfigSnapshot snapshot;
+    REQUIRE(snapshot.attach(bytes.data(), bytes.size()));
+
+    THEN("each path should find its own pattern and captures") {
+      for (int i = 0; i < 300; i += 7) {
+        auto path = "/opt/cross" + std::to_string(i) + "/bin/mips-gcc";
+        auto t = snapshot.find(path.c_str());
+        REQUIRE(t != nullptr);
+        REQUIRE(t->pattern == static_cast<uint32_t>(i + 1));
+
+        const char *caps[2 * EXEPTOR_REGEX_MAX_CAPTURES];
+        REQUIRE(snapshot.captures(*t, path.c_str(), caps));
+        REQUIRE(std::string(caps[2], caps[3]) == "mips");
+      }
+      REQUIRE(snapshot.find("/opt/cross300/bin/mips-gcc") == nullptr);
+      REQUIRE(snapshot.find("/opt/cross1/bin/x/mips-gcc") == nullptr);
+    }
+  }
+
+  GIVEN("Bad patterns") {
+    const struct {
+      const char *key;
+      const char *replacement;
+    } cases[] = {
+        {"re:(gcc", "afl-gcc"},         {"re:gcc)", "afl-gcc"},
+        {"re:(a*)*", "afl-gcc"},        {"re:gcc{2}", "afl-gcc"},
+        {"re:[z-a]", "afl-gcc"},        {"re:*gcc", "afl-gcc"},
+        {"glob:*-gcc", "afl-\\2"},      {"base:gcc", "afl-\\1"},
+    };
+
+    THEN("snapshot should not be built") {
+      for (const auto &c : cases) {
+        ReplacementSettings settings;
+        settings.add_program(c.key, {c.replacement, settings.add_group("g")});
+        SnapshotSource source;
+        memset(&source, 0, sizeof(source));
+        std::vector<char> bytes;
+        REQUIRE_FALSE(settings.build_snapshot(source, bytes));
+      }
+    }
+  }
+}
+
+static std::vector<std::string> rewrite(const char *const *argv) {
+  ArgList args;
+  args_from_argv_envp(args, argv);
+  const char *prog = argv[0];
+  prep_prog_argv(prog, args);
+  return std::vector<std::string>(args.items, args.items + args.size);
+}
+
+SCENARIO("rewrite-args rules should run over argv in one pass", "[rules]") {
+  GIVEN("Group with rules of every kind") {
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.add_program("gcc", {"afl-gcc-fast", cc});
+    settings.groups[cc].del_options = {"-Werror"};
+    settings.groups[cc].add_options = {"-g"};
+    std::string error;
+    for (auto rule : {"keep -O0", "delete -O*", "delete re:-march=.*",
+                      "replace -fno-plt -> -fplt", "delete -Xclang -load",
+                      "delete -Xclang -add-plugin", "replace -o -> -o",
+                      "keep -include x.h", "delete -include", "pair -plugin",
+                      "replace -plugin * -> -plugin afl.so",
+                      "insert-before-input -fsanitize=fuzzer-no-link -g",
+                      "append -Wno-error"}) {
+      REQUIRE(settings.add_rule(cc, rule, error));
+    }
+    REQUIRE(settings.groups[cc].rules.size() == 10);
+    REQUIRE(settings.groups[cc].add_options ==
+            ReplacementSettings::options_t{"-g", "-Wno-error"});
+    REQUIRE(apply_settings(settings));
+
+    THEN("prefix and regex deletes should drop matching options only") {
+      const char *argv[] = {"gcc",          "-O2", "-march=native", "-Os",
+                            "-mtune=native", "-O0", "-c",           "a.c",
+                            nullptr};
+      REQUIRE(rewrite(argv) == std::vector<std::string>{
+                                   "afl-gcc-fast", "-mtune=native", "-O0",
+                                   "-c", "-fsanitize=fuzzer-no-link", "-g",
+                                   "a.c", "-g", "-Wno-error"});
+    }
+
+    THEN("replacements should happen in place") {
+      const char *argv[] = {"gcc", "-fno-plt", "-c", "-Werror", "a.c",
+                            nullptr};
+      REQUIRE(rewrite(argv) ==
+              std::vector<std::string>{"afl-gcc-fast", "-fplt", "-c",
+                                       "-fsanitize=fuzzer-no-link", "-g",
+                                       "a.c", "-g", "-Wno-error"});
+    }
+
+    THEN("options with values should be handled as pairs") {
+      const char *argv[] = {"gcc",     "-Xclang",  "-load",   "-Xclang",
+                            "x.so",    "-Xclang",  "-add-plugin", "-Xclang",
+                            "-O3",     "-include", "x.h",     "-include",
+                            "y.h",     "-plugin",  "old.so",  "-o",
+                            "out.o",   "a.c",      nullptr};
+      REQUIRE(rewrite(argv) ==
+              std::vector<std::string>{
+                  "afl-gcc-fast", "-Xclang", "x.so", "-Xclang", "-O3",
+                  "-include", "x.h", "-plugin", "afl.so", "-o", "out.o",
+                  "-fsanitize=fuzzer-no-link", "-g", "a.c", "-g",
+                  "-Wno-error"});
+    }
+
+    THEN("inserted options should go to the end if there is no input") {
+      const char *argv[] = {"gcc", "-o", "a.out", "-", nullptr};
+      REQUIRE(rewrite(argv) ==
+              std::vector<std::string>{"afl-gcc-fast", "-o", "a.out",
+                                       "-fsanitize=fuzzer-no-link", "-g", "-",
+                                       "-g", "-Wno-error"});
+      const char *link[] = {"gcc", "-v", "-o", "a.out", nullptr};
+      REQUIRE(rewrite(link) ==
+              std::vector<std::string>{"afl-gcc-fast", "-v", "-o", "a.out",
+                                       "-fsanitize=fuzzer-no-link", "-g",
+                                       "-g", "-Wno-error"});
+    }
+
+    THEN("snapshot should not accept rules out of range") {
+      SnapshotSource source;
+      memset(&source, 0, sizeof(source));
+      std::vector<char> bytes;
+      REQUIRE(settings.build_snapshot(source, bytes));
+      ConfigSnapshot snapshot;
+      REQUIRE(snapshot.attach(bytes.data(), bytes.size()));
+      auto hdr = reinterpret_cast<SnapshotHeader *>(bytes.data());
+      auto rules = reinterpret_cast<SnapshotRule *>(&bytes[hdr->rules_offset]);
+      rules[0].words_first = hdr->lists_count;
+      rules[0].words_count = 1;
+      REQUIRE_FALSE(snapshot.attach(bytes.data(), bytes.size()));
+    }
+  }
+
+  GIVEN("Bad rules") {
+    THEN("they should be rejected") {
+      for (auto rule : {"", "drop -O2", "replace -O3 -> -O1 -g",
+                        "replace -O3", "replace -O3 ->", "delete -O3 -> -O1",
+                        "delete", "delete a b c", "pair", "pair -a -b",
+                        "append"}) {
+        ReplacementSettings settings;
+        std::string error;
+        REQUIRE_FALSE(settings.add_rule(settings.add_group("g"), rule, error));
+        REQUIRE_FALSE(error.empty());
+      }
+    }
+
+    THEN("bad regex should fail snapshot build") {
+      ReplacementSettings settings;
+      auto g = settings.add_group("g");
+      settings.add_program("gcc", {"afl-gcc-fast", g});
+      std::string error;
+      REQUIRE(settings.add_rule(g, "delete re:-O(", error));
+      SnapshotSource source;
+      memset(&source, 0, sizeof(source));
+      std::vector<char> bytes;
+      REQUIRE_FALSE(settings.build_snapshot(source, bytes));
+    }
+  }
+}
+
+static uint32_t classify(std::vector<const char *> argv) {
+  return classify_action(argv.data(), argv.size(), [](const char *arg) {
+    return strcmp(arg, "-o") == 0 || strcmp(arg, "-x") == 0 ||
+           strcmp(arg, "-MF") == 0;
+  });
+}
+
+SCENARIO("compiler invocations should be classified by their action",
+         "[actions]") {
+  GIVEN("Command lines of a typical build") {
+    THEN("each should get its action classes") {
+      REQUIRE(classify({"gcc", "-c", "a.c", "-o", "a.o"}) == ACTION_COMPILE);
+      REQUIRE(classify({"gcc", "-S", "a.c"}) == ACTION_COMPILE);
+      REQUIRE(classify({"gcc", "-c", "a.S"}) == ACTION_ASSEMBLE);
+      REQUIRE(classify({"gcc", "-c", "-x", "assembler", "a.asm.in"}) ==
+              ACTION_ASSEMBLE);
+      REQUIRE(classify({"gcc", "-c", "-xc", "gen.in"}) == ACTION_COMPILE);
+      REQUIRE(classify({"gcc", "-c", "a.c", "b.s"}) ==
+              (ACTION_COMPILE | ACTION_ASSEMBLE));
+      REQUIRE(classify({"gcc", "-E", "a.c"}) == ACTION_PREPROCESS);
+      REQUIRE(classify({"gcc", "-MM", "-MF", "a.d", "a.c"}) ==
+              ACTION_PREPROCESS);
+      REQUIRE(classify({"gcc", "-c", "-MD", "-MF", "a.d", "a.c"}) ==
+              ACTION_COMPILE);
+      REQUIRE(classify({"gcc", "a.o", "b.o", "-lz", "-o", "app"}) ==
+              ACTION_LINK);
+      REQUIRE(classify({"gcc", "a.c", "-o", "app"}) ==
+              (ACTION_COMPILE | ACTION_LINK));
+      REQUIRE(classify({"gcc", "@objs.rsp", "-o", "app"}) == ACTION_LINK);
+      REQUIRE(classify({"gcc", "--version"}) == ACTION_QUERY);
+      REQUIRE(classify({"gcc", "-print-prog-name=ld"}) == ACTION_QUERY);
+      REQUIRE(classify({"gcc", "-v"}) == ACTION_QUERY);
+      REQUIRE(classify({"gcc", "-o", "a.c"}) == ACTION_QUERY);
+    }
+  }
+
+  GIVEN("Group with add-options scoped to action classes") {
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.add_program("gcc", {"afl-gcc-fast", cc});
+    auto &group = settings.groups[cc];
+    ReplacementSettings::add_scoped_option(group, "-g", EXEPTOR_ACTIONS_ALL);
+    ReplacementSettings::add_scoped_option(group, "-fsanitize=address",
+                                           ACTION_COMPILE);
+    ReplacementSettings::add_scoped_option(group, "-fsanitize=address",
+                                           ACTION_LINK);
+    ReplacementSettings::add_scoped_option(group, "-Wl,-z,now", ACTION_LINK);
+    REQUIRE(group.add_options ==
+            ReplacementSettings::options_t{"-g", "-fsanitize=address",
+                                           "-Wl,-z,now"});
+    REQUIRE(apply_settings(settings));
+
+    THEN("each command should get options of its classes only") {
+      const char *compile[] = {"gcc", "-c", "a.c", nullptr};
+      REQUIRE(rewrite(compile) ==
+              std::vector<std::string>{"afl-gcc-fast", "-c", "a.c", "-g",
+                                       "-fsanitize=address"});
+      const char *link[] = {"gcc", "a.o", "-o", "app", nullptr};
+      REQUIRE(rewrite(link) == std::vector<std::string>{
+                                   "afl-gcc-fast", "a.o", "-o", "app", "-g",
+                                   "-fsanitize=address", "-Wl,-z,now"});
+      const char *scan[] = {"gcc", "-M", "a.c", nullptr};
+      REQUIRE(rewrite(scan) ==
+              std::vector<std::string>{"afl-gcc-fast", "-M", "a.c", "-g"});
+      const char *version[] = {"gcc", "--version", nullptr};
+      REQUIRE(rewrite(version) ==
+              std::vector<std::string>{"afl-gcc-fast", "--version", "-g"});
+    }
+  }
+}
+
+SCENARIO("groups should only replace programs working in their scope",
+         "[scope]") {
+  GIVEN("Group with include and exclude paths") {
+    char root[] = "/tmp/exeptor-scope-XXXXXX";
+    REQUIRE(mkdtemp(root) != nullptr);
+    std::string top = root;
+    for (auto dir : {"/src", "/src/third_party", "/other", "/third_party"}) {
+      REQUIRE(mkdir((top + dir).c_str(), 0700) == 0);
+    }
+
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.add_program("gcc", {"afl-gcc-fast", cc});
+    settings.groups[cc].include_paths = {top + "/src/"};
+    settings.groups[cc].exclude_paths = {"*/third_party"};
+    REQUIRE(apply_settings(settings));
+
+    char old_cwd[PATH_MAX];
+    REQUIRE(getcwd(old_cwd, sizeof(old_cwd)) != nullptr);
+    auto replaced_in = [&](const std::string &dir,
+                           std::vector<const char *> argv) {
+      REQUIRE(chdir((top + dir).c_str()) == 0);
+      argv.push_back(nullptr);
+      bool replaced = rewrite(argv.data())[0] == "afl-gcc-fast";
+      REQUIRE(chdir(old_cwd) == 0);
+      return replaced;
+    };
+
+    THEN("current directory and source files should decide") {
+      REQUIRE(replaced_in("/src", {"gcc", "-c", "a.c"}));
+      REQUIRE(replaced_in("/src", {"gcc", "a.o", "-o", "app"}));
+      REQUIRE(replaced_in("", {"gcc", "-c", "./src/a.c"}));
+      REQUIRE(replaced_in("/other", {"gcc", "-c", (top + "/src/a.c").c_str()}));
+      REQUIRE_FALSE(replaced_in("", {"gcc", "-c", "other/a.c"}));
+      REQUIRE_FALSE(replaced_in("/other", {"gcc", "a.o", "-o", "app"}));
+    }
+
+    THEN("exclusions should win over inclusions") {
+      REQUIRE_FALSE(replaced_in("/src/third_party", {"gcc", "-c", "a.c"}));
+      REQUIRE_FALSE(replaced_in("/src", {"gcc", "-c", "a.c",
+                                         "third_party/b.c"}));
+      REQUIRE_FALSE(replaced_in("/third_party", {"gcc", "-c",
+                                                 (top + "/src/a.c").c_str()}));
+    }
+
+    THEN("values of options should not be taken for source files") {
+      REQUIRE(replaced_in("/src", {"gcc", "-c", "a.c", "-include",
+                                   "third_party/x.h"}));
+    }
+
+    THEN("paths should be matched in normal form") {
+      REQUIRE(replaced_in("/src", {"gcc", "-c", "third_party/../a.c"}));
+      REQUIRE_FALSE(replaced_in("/src", {"gcc", "-c", "a.c",
+                                         "./x/../third_party//b.c"}));
+      REQUIRE_FALSE(replaced_in("/other", {"gcc", "-c",
+                                           (top + "/src/../a.c").c_str()}));
+      REQUIRE(replaced_in("/other", {"gcc", "-c", "..//src/./a.c"}));
+      REQUIRE(replaced_in("/other", {"gcc", "-c",
+                                     (top + "//src/x/../a.c").c_str()}));
+    }
+
+    THEN("path normalization should keep to the root") {
+      char buf[PATH_MAX];
+      REQUIRE(normalize_path("/a/b", "../../../c/./d/", buf, sizeof(buf)));
+      REQUIRE(std::string("/c/d") == buf);
+      REQUIRE(normalize_path("/", "..", buf, sizeof(buf)));
+      REQUIRE(std::string("/") == buf);
+      REQUIRE(normalize_path("/a", "//b//c/..", buf, sizeof(buf)));
+      REQUIRE(std::string("/b") == buf);
+      REQUIRE(normalize_path("/a", "..b/.c", buf, sizeof(buf)));
+      REQUIRE(std::string("/a/..b/.c") == buf);
+      REQUIRE_FALSE(normalize_path("/a", "bcd", buf, 5));
+    }
+
+    for (auto dir : {"/src/third_party", "/src", "/other", "/third_party"}) {
+      rmdir((top + dir).c_str());
+    }
+    rmdir(root);
+  }
+
+  GIVEN("Relative path in yaml config") {
+    char path[] = "/tmp/exeptor-test-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+    FILE *f = fopen(path, "wt");
+    REQUIRE(f != nullptr);
+    fputs("target_groups:\n"
+          "  cc:\n"
+          "    exclude-paths: [third_party]\n"
+          "    replacements:\n"
+          "      gcc: afl-gcc-fast\n",
+          f);
+    fclose(f);
+
+    THEN("config should be rejected") {
+      ReplacementSettings settings;
+      REQUIRE_FALSE(settings.parse_from_file(path));
+    }
+    unlink(path);
+  }
+}
+
+SCENARIO("options should belong to their own group", "[config]") {
+  GIVEN("yaml config file with two groups") {
+    char path[] = "/tmp/exeptor-test-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    FILE *f = fopen(path, "wt");
+    REQUIRE(f != nullptr);
+    fputs("target_groups:\n"
+          "  compilers:\n"
+          "    add-options: [-O1, -g, -O1]\n"
+          "    del-options: [-Werror]\n"
+          "    replacements:\n"
+          "      gcc: afl-clang-fast\n"
+          "      g++: afl-clang-fast++\n"
+          "    add-environ: [AFL_USE_ASAN=1, TMPDIR=/tmp, AFL_USE_ASAN=0]\n"
+          "    del-environ: [CCACHE_DIR]\n"
+          "    include-paths: [/src/pkg]\n"
+          "    exclude-paths: [\"*/tests\", \"*/third_party/*\"]\n"
+          "    rewrite-args:\n"
+          "      - replace -O3 -> -O1\n"
+          "      - delete  -march=*\n"
+          "      - append -g -fno-omit-frame-pointer\n"
+          "  linkers:\n"
+          "    add-options:\n"
+          "      all: [-fuse-ld=lld]\n"
+          "      link: [-fuse-ld=lld, -s]\n"
+          "    reintercept: 2\n"
+          "    match-inodes: yes\n"
+          "    add-environ:\n"
+          "      AFL_LLVM_ALLOWLIST: /tmp/allow.txt\n"
+          "    replacements:\n"
+          "      ld: ld.lld\n",
+          f);
+    fclose(f);
+
+    ReplacementSettings settings;
+    REQUIRE(settings.parse_from_file(path));
+    unlink(path);
+
+    THEN("each program should refer to its group") {
+      REQUIRE(settings.groups.size() == 2);
+      REQUIRE(settings.programs["gcc"].group == 0);
+      REQUIRE(settings.programs["g++"].group == 0);
+      REQUIRE(settings.programs["ld"].group == 1);
+    }
+
+    THEN("options should keep config order without duplicates") {
+      auto &cc = settings.groups[0];
+      REQUIRE(cc.name == "compilers");
+      REQUIRE(cc.add_options ==
+              ReplacementSettings::options_t{"-O1", "-g",
+                                             "-fno-omit-frame-pointer"});
+      REQUIRE(cc.del_options == ReplacementSettings::options_t{"-Werror"});
+    }
+
+    THEN("environment settings should be kept per group") {
+      REQUIRE(settings.groups[0].add_environ ==
+              ReplacementSettings::options_t{"AFL_USE_ASAN=0", "TMPDIR=/tmp"});
+      REQUIRE(settings.groups[0].del_environ ==
+              ReplacementSettings::options_t{"CCACHE_DIR"});
+      REQUIRE(settings.groups[1].add_environ ==
+              ReplacementSettings::options_t{
+                  "AFL_LLVM_ALLOWLIST=/tmp/allow.txt"});
+      REQUIRE(settings.groups[1].del_environ.empty());
+    }
+
+    THEN("options of later groups should not leak into earlier ones") {
+      REQUIRE(settings.groups[1].add_options ==
+              ReplacementSettings::options_t{"-fuse-ld=lld", "-s"});
+      REQUIRE(settings.groups[1].del_options.empty());
+    }
+
+    THEN("reintercept should be off unless group enables it") {
+      REQUIRE(settings.groups[0].reintercept == 0);
+      REQUIRE(settings.groups[1].reintercept == 2);
+    }
+
+    THEN("path globs should be kept per group") {
+      REQUIRE(settings.groups[0].include_paths ==
+              ReplacementSettings::options_t{"/src/pkg"});
+      REQUIRE(settings.groups[0].exclude_paths ==
+              ReplacementSettings::options_t{"*/tests", "*/third_party/*"});
+      REQUIRE(settings.groups[1].include_paths.empty());
+    }
+
+    THEN("add-options may be scoped to action classes") {
+      REQUIRE(settings.groups[1].add_actions ==
+              std::vector<uint32_t>{EXEPTOR_ACTIONS_ALL, ACTION_LINK});
+      REQUIRE(settings.groups[0].add_actions ==
+              std::vector<uint32_t>(3, EXEPTOR_ACTIONS_ALL));
+    }
+
+    THEN("rewrite-args rules should be parsed in config order") {
+      const auto &rules = settings.groups[0].rules;
+      REQUIRE(rules.size() == 2);
+      REQUIRE(rules[0].action == RULE_REPLACE);
+      REQUIRE(rules[0].patterns == ReplacementSettings::options_t{"-O3"});
+      REQUIRE(rules[0].words == ReplacementSettings::options_t{"-O1"});
+      REQUIRE(rules[1].action == RULE_DELETE);
+      REQUIRE(rules[1].patterns == ReplacementSettings::options_t{"-march=*"});
+      REQUIRE(settings.groups[1].rules.empty());
+    }
+
+    THEN("matching by inode should be off unless group enables it") {
+      REQUIRE_FALSE(settings.groups[0].match_inodes);
+      REQUIRE(settings.groups[1].match_inodes);
+    }
+  }
+}
+
+SCENARIO("config snapshot should be cached next to yaml config", "[snapshot]") {
+  GIVEN("yaml config file without cached snapshot") {
+    char dir[] = "/tmp/exeptor-test-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string config_path = std::string(dir) + "/exeptor.yaml";
+    std::string cache_path = config_path + EXEPTOR_SNAPSHOT_SUFFIX;
+
+    FILE *f = fopen(config_path.c_str(), "wt");
+    REQUIRE(f != nullptr);
+    fputs("target_groups:\n"
+          "  compilers:\n"
+          "    add-options: [-g]\n"
+          "    replacements:\n"
+          "      gcc: afl-clang-fast\n",
+          f);
+    fclose(f);
+
+    g_settings = ReplacementSettings();
+
+    WHEN("config gets loaded") {
+      REQUIRE(load_config(config_path.c_str(), *g_config.load()));
+
+      THEN("settings should be available") {
+        const ConfigSnapshot &snapshot = current_snapshot();
+        auto t = snapshot.find("gcc");
+        REQUIRE(t != nullptr);
+        REQUIRE(std::string("afl-clang-fast") == snapshot.str(t->replacement));
+      }
+
+      THEN("cached snapshot should be created and used by next process") {
+        REQUIRE(access(cache_path.c_str(), R_OK) == 0);
+
+        ConfigSnapshot cached;
+        REQUIRE(map_cached_snapshot(config_path.c_str(), cached));
+        REQUIRE(cached.find("gcc") != nullptr);
+      }
+
+      AND_WHEN("config file changes") {
+        f = fopen(config_path.c_str(), "at");
+        REQUIRE(f != nullptr);
+        fputs("      cc: afl-clang-fast\n", f);
+        fclose(f);
+
+        THEN("cached snapshot should be considered stale") {
+          ConfigSnapshot cached;
+          REQUIRE_FALSE(map_cached_snapshot(config_path.c_str(), cached));
+        }
+
+        THEN("reloading should pick up new settings") {
+          REQUIRE(load_config(config_path.c_str(), *g_config.load()));
+          REQUIRE(current_snapshot().find("cc") != nullptr);
+        }
+      }
+    }
+
+    unlink(cache_path.c_str());
+    unlink(config_path.c_str());
+    rmdir(dir);
+  }
+}
+
+SCENARIO("config snapshot should be shared with children via memfd",
+         "[snapshot]") {
+  GIVEN("Settings compiled to snapshot for some config path") {
+    const char *config_path = "/etc/libexeptor.yaml";
+
+    ReplacementSettings settings;
+    settings.programs["gcc"] = {"afl-clang-fast", settings.add_group("cc")};
+
+    SnapshotSource source;
+    memset(&source, 0, sizeof(source));
+    source.path_hash = snapshot_hash(config_path);
+
+    std::vector<char> bytes;
+    REQUIRE(settings.build_snapshot(source, bytes));
+
+    ConfigSnapshot snapshot;
+    REQUIRE(snapshot.attach(bytes.data(), bytes.size()));
+
+    WHEN("snapshot gets published") {
+      int fd = publish_snapshot(snapshot);
+      REQUIRE(fd > STDERR_FILENO);
+
+      char fd_str[16];
+      snprintf(fd_str, sizeof(fd_str), "%d", fd);
+
+      THEN("memfd should be sealed against any changes") {
+        REQUIRE(write(fd, "x", 1) == -1);
+        REQUIRE(ftruncate(fd, 0) == -1);
+      }
+
+      THEN("child with the same config should be able to map it") {
+        ConfigSnapshot inherited;
+        REQUIRE(map_inherited_snapshot(fd_str, config_path, inherited));
+        REQUIRE(inherited.size() == bytes.size());
+        REQUIRE(inherited.find("gcc") != nullptr);
+      }
+
+      THEN("child with another config should ignore it") {
+        ConfigSnapshot inherited;
+        REQUIRE_FALSE(
+            map_inherited_snapshot(fd_str, "/tmp/other.yaml", inherited));
+      }
+
+      close(fd);
+    }
+
+    WHEN("ancestor publishes snapshot it has validated") {
+      // damaged entry tells whether child validates entries once more
+      auto hdr = reinterpret_cast<SnapshotHeader *>(bytes.data());
+      auto progs =
+          reinterpret_cast<SnapshotProgram *>(&bytes[hdr->programs_offset]);
+      progs[0].group = hdr->groups_count;
+      ConfigSnapshot validated;
+      REQUIRE(validated.attach(bytes.data(), bytes.size(), true));
+      int fd = publish_snapshot(validated);
+      REQUIRE(fd > STDERR_FILENO);
+
+      char fd_str[16];
+      snprintf(fd_str, sizeof(fd_str), "%d", fd);
+
+      THEN("child should only check header and bounds of sections") {
+        ConfigSnapshot inherited;
+        REQUIRE(map_inherited_snapshot(fd_str, config_path, inherited));
+        REQUIRE_FALSE(inherited.attach(bytes.data(), bytes.size()));
+      }
+
+      THEN("sections out of bounds should still be rejected") {
+        hdr->programs_count = UINT32_MAX;
+        REQUIRE_FALSE(validated.attach(bytes.data(), bytes.size(), true));
+      }
+
+      close(fd);
+    }
+
+    WHEN("descriptor in environment is not a published snapshot") {
+      ConfigSnapshot inherited;
+
+      THEN("garbage values should be rejected") {
+        REQUIRE_FALSE(map_inherited_snapshot("", config_path, inherited));
+        REQUIRE_FALSE(map_inherited_snapshot("12abc", config_path, inherited));
+        REQUIRE_FALSE(map_inherited_snapshot("-1", config_path, inherited));
+        REQUIRE_FALSE(map_inherited_snapshot("99999", config_path, inherited));
+      }
+
+      THEN("unsealed files should be rejected") {
+        int fd = memfd_create("not-a-snapshot", 0);
+        REQUIRE(fd >= 0);
+        REQUIRE(write(fd, bytes.data(), bytes.size()) ==
+                static_cast<ssize_t>(bytes.size()));
+
+        char fd_str[16];
+        snprintf(fd_str, sizeof(fd_str), "%d", fd);
+        REQUIRE_FALSE(map_inherited_snapshot(fd_str, config_path, inherited));
+        close(fd);
+      }
+    }
+  }
+}
+
+#if defined(EXEPTOR_LEAN_LIB_PATH) && defined(EXEPTOR_APP_PROXY_PATH) &&     \
+    defined(EXEPTOR_STRACE_PATH)
+
+// syscalls libexeptor-lean adds between the first exec call of a process
+// and the exec itself when program isn't found in config: 3 to map snapshot
+// inherited via memfd, getpid for fork detection at initialization and
+// getpid of the hook checking for vfork child
+#define EXEPTOR_SYSCALL_BUDGET 5
+
+// count syscalls app-proxy makes after it announced exec of /bin/true and
+// before the exec itself. loading of libraries is left out, hooks only
+// initialize libexeptor on the first call
+static long count_proxy_syscalls(const std::string &strace_args) {
+  char out_path[] = "/tmp/exeptor-strace-XXXXXX";
+  int fd = mkstemp(out_path);
+  if (fd < 0) {
+    return -1;
+  }
+  close(fd);
+
+  std::string cmd = EXEPTOR_STRACE_PATH " -qq -e signal=none -o " +
+                    std::string(out_path) + " " + strace_args +
+                    " " EXEPTOR_APP_PROXY_PATH " /bin/true > /dev/null 2>&1";
+  long count = -1;
+  if (system(cmd.c_str()) == 0) {
+    FILE *f = fopen(out_path, "rt");
+    if (f) {
+      const char announce[] = "write(1, \"Trying to run via exec:";
+      const char exec[] = "execve(\"/bin/true\"";
+      char line[4096];
+      bool counting = false;
+      bool line_start = true;
+      while (fgets(line, sizeof(line), f)) {
+        if (line_start && strncmp(line, announce, sizeof(announce) - 1) == 0) {
+          counting = true;
+          count = 0;
+        } else if (line_start && counting &&
+                   strncmp(line, exec, sizeof(exec) - 1) == 0) {
+          break;
+        } else if (line_start && counting) {
+          count++;
+        }
+        // long lines may be split by fgets, look only at line starts
+        line_start = line[strlen(line) - 1] == '\n';
+      }
+      fclose(f);
+    }
+  }
+
+  unlink(out_path);
+  return count;
+}
+
+SCENARIO("libexeptor should stay within its syscall budget", "[syscalls]") {
+  // other tests leave garbage in exeptor variables, e.g. log to write
+  for (const char *name : exeptor_envs) {
+    unsetenv(name);
+  }
+  REQUIRE(system(EXEPTOR_STRACE_PATH " -V > /dev/null 2>&1") == 0);
+
+  GIVEN("snapshot published by parent process") {
+    const char *config_path = "/tmp/exeptor-syscalls.yaml";
+
+    ReplacementSettings settings;
+    settings.programs["/bin/false"] = {"/bin/true", settings.add_group("t")};
+
+    SnapshotSource source;
+    memset(&source, 0, sizeof(source));
+    source.path_hash = snapshot_hash(config_path);
+
+    std::vector<char> bytes;
+    REQUIRE(settings.build_snapshot(source, bytes));
+
+    ConfigSnapshot snapshot;
+    REQUIRE(snapshot.attach(bytes.data(), bytes.size()));
+
+    int fd = publish_snapshot(snapshot);
+    REQUIRE(fd > STDERR_FILENO);
+
+    WHEN("app execs program not found in config") {
+      long plain = count_proxy_syscalls("");
+      long preloaded = count_proxy_syscalls(
+          "-E LD_PRELOAD=" EXEPTOR_LEAN_LIB_PATH " -E EXEPTOR_CONFIG=" +
+          std::string(config_path) +
+          " -E EXEPTOR_SNAPSHOT_FD=" + std::to_string(fd));
+
+      THEN("libexeptor should add no more syscalls than budgeted") {
+        CAPTURE(plain, preloaded);
+        REQUIRE(plain >= 0);
+        REQUIRE(preloaded >= 0);
+        REQUIRE(preloaded - plain <= EXEPTOR_SYSCALL_BUDGET);
+      }
+    }
+
+    close(fd);
+  }
+}
+
+#endif
+
+// malloc shim: every allocation made while poisoned gets counted.
+// sanitizers bring their own allocators, so there is nothing to count with them
+static bool malloc_poisoned = false;
+static size_t poisoned_allocations = 0;
+
+#if !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) noexcept {
+  poisoned_allocations += malloc_poisoned;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) noexcept {
+  poisoned_allocations += malloc_poisoned;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+  poisoned_allocations += malloc_poisoned;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) noexcept {
+  poisoned_allocations += malloc_poisoned && ptr;
+  __libc_free(ptr);
+}
+}
+#endif
+
+// exeptor variables initlib keeps for children of the process
+static void forget_own_envs() {
+  for (auto &entry : g_own_envs) {
+    entry = nullptr;
+  }
+}
+
+// fake exec functions remember what would have been executed. argv and envp
+// get copied because hooks release their scratch buffers when exec returns,
+// strings made by hooks are copied too
+static const char *exec_path = nullptr;
+static const char *exec_argv[4 * EXEPTOR_ARGLIST_INLINE];
+static const char *exec_envp[4 * EXEPTOR_ARGLIST_INLINE];
+static char exec_text[1 << 20];
+static size_t exec_text_used = 0;
+
+static void copy_list(const char **dst, size_t n, char *const *src) {
+  size_t i = 0;
+  while (src && src[i] && i + 1 < n) {
+    size_t len = strlen(src[i]) + 1;
+    if (exec_text_used + len <= sizeof(exec_text)) {
+      dst[i] = static_cast<const char *>(
+          memcpy(exec_text + exec_text_used, src[i], len));
+      exec_text_used += len;
+    } else {
+      dst[i] = src[i];
+    }
+    i++;
+  }
+  dst[i] = nullptr;
+}
+
+static int fake_execv(const char *path, char *const argv[]) {
+  exec_path = path;
+  exec_text_used = 0;
+  copy_list(exec_argv, sizeof(exec_argv) / sizeof(exec_argv[0]), argv);
+  exec_envp[0] = nullptr;
+  return 0;
+}
+
+static int fake_execve(const char *path, char *const argv[],
+                       char *const envp[]) {
+  fake_execv(path, argv);
+  copy_list(exec_envp, sizeof(exec_envp) / sizeof(exec_envp[0]), envp);
+  return 0;
+}
+
+static int fake_posix_spawn(pid_t *, const char *path,
+                            const posix_spawn_file_actions_t *,
+                            const posix_spawnattr_t *, char *const argv[],
+                            char *const envp[]) {
+  return fake_execve(path, argv, envp);
+}
+
+static size_t list_size(const char *const *list) {
+  size_t n = 0;
+  while (list && list[n]) {
+    n++;
+  }
+  return n;
+}
+
+SCENARIO("exec hooks should not allocate memory", "[vfork]") {
+  GIVEN("Initialized libexeptor with fake exec functions") {
+    ReplacementSettings settings;
+    auto group = settings.add_group("cc");
+    settings.programs["gcc"] = {"afl-clang-fast", group};
+    settings.groups[group].add_options = {"-g", "-O1"};
+    settings.groups[group].del_options = {"-Werror"};
+    settings.add_program("glob:*-linux-gnu-gcc-*", {"\\1-afl-gcc-\\2", group});
+    REQUIRE(apply_settings(settings));
+
+    exeptor_initialized = true;
+    g_intercept_allowed = true;
+    logpath = nullptr;
+    real_execv = real_execvp = fake_execv;
+    real_execve = real_execvpe = fake_execve;
+    real_posix_spawn = real_posix_spawnp = fake_posix_spawn;
+
+    // long command line doesn't fit into stack buffer of ArgList
+    std::vector<std::string> objects;
+    for (int i = 0; i < 3 * EXEPTOR_ARGLIST_INLINE; i++) {
+      objects.push_back("obj" + std::to_string(i) + ".o");
+    }
+    std::vector<const char *> argv = {"gcc", "-Werror"};
+    for (const auto &obj : objects) {
+      argv.push_back(obj.c_str());
+    }
+    argv.push_back(nullptr);
+    auto args = const_cast<char *const *>(argv.data());
+    char *const envp[] = {const_cast<char *>("PATH=/usr/bin"), nullptr};
+
+    exec_path = nullptr;
+    poisoned_allocations = 0;
+
+    WHEN("execv is called for replaced program") {
+      malloc_poisoned = true;
+      execv("gcc", args);
+      malloc_poisoned = false;
+
+      THEN("nothing should be allocated") {
+        REQUIRE(poisoned_allocations == 0);
+      }
+
+      THEN("command line should still be rewritten") {
+        REQUIRE(std::string("afl-clang-fast") == exec_path);
+        REQUIRE(list_size(exec_argv) == argv.size() - 1 - 1 + 2);
+        REQUIRE(std::string("obj0.o") == exec_argv[1]);
+        REQUIRE(std::string("-O1") == exec_argv[list_size(exec_argv) - 1]);
+      }
+    }
+
+    WHEN("execve and execvpe are called") {
+      malloc_poisoned = true;
+      execve("gcc", args, envp);
+      execvpe("cc", args, envp);
+      malloc_poisoned = false;
+
+      THEN("nothing should be allocated") {
+        REQUIRE(poisoned_allocations == 0);
+        REQUIRE(std::string("cc") == exec_path);
+        REQUIRE(list_size(exec_argv) == argv.size() - 1);
+        auto end = exec_envp + list_size(exec_envp);
+        REQUIRE(std::find_if(exec_envp, end, [&](const char *e) {
+                  return strcmp(e, envp[0]) == 0;
+                }) != end);
+      }
+    }
+
+    WHEN("execl and execle are called") {
+      malloc_poisoned = true;
+      execl("gcc", "gcc", "-Werror", "a.c", nullptr);
+      execle("gcc", "gcc", "b.c", nullptr, envp);
+      malloc_poisoned = false;
+
+      THEN("nothing should be allocated") {
+        REQUIRE(poisoned_allocations == 0);
+        REQUIRE(std::string("afl-clang-fast") == exec_path);
+        REQUIRE(list_size(exec_argv) == 4);
+        REQUIRE(std::string("b.c") == exec_argv[1]);
+      }
+    }
+
+    WHEN("captures of matched pattern can't be found") {
+      std::string path = "/" + std::string(2 * EXEPTOR_REGEX_BACKTRACK, 'd') +
+                         "/x86_64-linux-gnu-gcc-12";
+      malloc_poisoned = true;
+      execve(path.c_str(), args, envp);
+      malloc_poisoned = false;
+
+      THEN("original program should run") {
+        REQUIRE(poisoned_allocations == 0);
+        REQUIRE(path == exec_path);
+        REQUIRE(list_size(exec_argv) == argv.size() - 1);
+        REQUIRE(std::string("-Werror") == exec_argv[1]);
+      }
+    }
+
+    WHEN("posix_spawn and posix_spawnp are called") {
+      pid_t pid;
+      malloc_poisoned = true;
+      posix_spawn(&pid, "gcc", nullptr, nullptr, args, envp);
+      posix_spawnp(&pid, "ld", nullptr, nullptr, args, envp);
+      malloc_poisoned = false;
+
+      THEN("nothing should be allocated") {
+        REQUIRE(poisoned_allocations == 0);
+        REQUIRE(std::string("ld") == exec_path);
+      }
+    }
+
+    real_execv = real_execvp = nullptr;
+    real_execve = real_execvpe = nullptr;
+    real_posix_spawn = real_posix_spawnp = nullptr;
+    exeptor_initialized = false;
+  }
+}
+
+// value of EXEPTOR_REPLACED for replacement of group at depth
+static std::string replaced_marker(const char *group, unsigned depth) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%" PRIx64 ":%u", snapshot_hash(group), depth);
+  return buf;
+}
+
+SCENARIO("environment delta of group should be applied to replaced programs",
+         "[env]") {
+  GIVEN("Group which changes environment of compilers") {
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.programs["gcc"] = {"afl-clang-fast", cc};
+    settings.programs["ld"] = {"ld.lld", settings.add_group("ld")};
+    settings.groups[cc].add_environ = {"AFL_USE_ASAN=1", "TMPDIR=/tmp/afl"};
+    settings.groups[cc].del_environ = {"CCACHE_DIR", "EXEPTOR_VERBOSE"};
+    REQUIRE(apply_settings(settings));
+
+    exeptor_initialized = true;
+    g_intercept_allowed = true;
+    logpath = nullptr;
+    real_execv = real_execvp = fake_execv;
+    real_execve = real_execvpe = fake_execve;
+    real_posix_spawn = real_posix_spawnp = fake_posix_spawn;
+
+    clearenv();
+    setenv("LD_PRELOAD", "/lib/libexeptor.so", 1);
+    setenv("EXEPTOR_VERBOSE", "1", 1);
+    setenv("TMPDIR", "/var/tmp", 1);
+    setenv("HOME", "/root", 1);
+
+    std::vector<const char *> envp = {"CCACHE_DIR=/ccache", "TMPDIR=/var/tmp",
+                                      "LANG=C", nullptr};
+    const char *argv[] = {"gcc", "-c", "a.c", nullptr};
+    auto args = const_cast<char *const *>(argv);
+    auto app_envp = const_cast<char *const *>(envp.data());
+
+    std::string cc_marker = "EXEPTOR_REPLACED=" + replaced_marker("cc", 1);
+
+    auto env_of_exec = [&]() {
+      return std::vector<std::string>(exec_envp,
+                                      exec_envp + list_size(exec_envp));
+    };
+
+    WHEN("replaced program is run with custom envp") {
+      malloc_poisoned = true;
+      poisoned_allocations = 0;
+      execve("gcc", args, app_envp);
+      malloc_poisoned = false;
+
+      THEN("delta should be applied in place without allocations") {
+        REQUIRE(poisoned_allocations == 0);
+        REQUIRE(std::string("afl-clang-fast") == exec_path);
+        REQUIRE(env_of_exec() == std::vector<std::string>{
+                                     "LANG=C",
+                                     "LD_PRELOAD=/lib/libexeptor.so",
+                                     "AFL_USE_ASAN=1",
+                                     "TMPDIR=/tmp/afl",
+                                     cc_marker,
+                                 });
+      }
+    }
+
+    WHEN("replaced program is run by execv") {
+      execv("gcc", args);
+
+      THEN("it should get environ with delta applied through execve") {
+        REQUIRE(std::string("afl-clang-fast") == exec_path);
+        REQUIRE(env_of_exec() == std::vector<std::string>{
+                                     "LD_PRELOAD=/lib/libexeptor.so",
+                                     "HOME=/root",
+                                     "AFL_USE_ASAN=1",
+                                     "TMPDIR=/tmp/afl",
+                                     cc_marker,
+                                 });
+      }
+    }
+
+    WHEN("replaced program without delta is run by execv") {
+      execv("ld", args);
+
+      THEN("environment should only get replacement marker") {
+        REQUIRE(std::string("ld.lld") == exec_path);
+        auto env = env_of_exec();
+        REQUIRE(env.size() == 4 + 1);
+        REQUIRE(env[0] == "LD_PRELOAD=/lib/libexeptor.so");
+        REQUIRE(env[4] == "EXEPTOR_REPLACED=" + replaced_marker("ld", 1));
+      }
+    }
+
+    WHEN("program that isn't replaced is run by posix_spawn") {
+      pid_t pid;
+      posix_spawn(&pid, "cc", nullptr, nullptr, args, app_envp);
+
+      THEN("delta should not be applied") {
+        REQUIRE(std::string("cc") == exec_path);
+        auto env = env_of_exec();
+        REQUIRE(env.size() == 3 + 2);
+        REQUIRE(env[0] == "CCACHE_DIR=/ccache");
+        REQUIRE(env[1] == "TMPDIR=/var/tmp");
+      }
+    }
+
+    real_execv = real_execvp = nullptr;
+    real_execve = real_execvpe = nullptr;
+    real_posix_spawn = real_posix_spawnp = nullptr;
+    exeptor_initialized = false;
+    clearenv();
+  }
+}
+
+static int execveat_flags = -1;
+static int execveat_dirfd = -1;
+
+static int fake_execveat(int dirfd, const char *path, char *const argv[],
+                         char *const envp[], int flags) {
+  execveat_dirfd = dirfd;
+  execveat_flags = flags;
+  return fake_execve(path, argv, envp);
+}
+
+static int fake_fexecve(int, char *const argv[], char *const envp[]) {
+  return fake_execve("(fd)", argv, envp);
+}
+
+SCENARIO("execveat and fexecve should be intercepted", "[fd]") {
+  GIVEN("Program configured by its absolute path") {
+    char path[] = "/tmp/exeptor-test-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+
+    ReplacementSettings settings;
+    auto group = settings.add_group("cc");
+    settings.programs[path] = {"/usr/bin/afl-clang-fast", group};
+    settings.groups[group].del_options = {"-Werror"};
+    REQUIRE(apply_settings(settings));
+
+    exeptor_initialized = true;
+    g_intercept_allowed = true;
+    logpath = nullptr;
+    real_execve = fake_execve;
+    real_execveat = fake_execveat;
+    real_fexecve = fake_fexecve;
+
+    const char *argv[] = {"cc", "-Werror", "a.c", nullptr};
+    auto args = const_cast<char *const *>(argv);
+    exec_path = nullptr;
+    poisoned_allocations = 0;
+
+    WHEN("fexecve runs the file") {
+      malloc_poisoned = true;
+      fexecve(fd, args, environ);
+      malloc_poisoned = false;
+
+      THEN("replacement should be run by its path") {
+        REQUIRE(poisoned_allocations == 0);
+        REQUIRE(std::string("/usr/bin/afl-clang-fast") == exec_path);
+        REQUIRE(list_size(exec_argv) == 2);
+        REQUIRE(std::string("a.c") == exec_argv[1]);
+      }
+    }
+
+    WHEN("execveat runs the file with AT_EMPTY_PATH") {
+      execveat(fd, "", args, environ, AT_EMPTY_PATH);
+
+      THEN("replacement should be run without AT_EMPTY_PATH") {
+        REQUIRE(std::string("/usr/bin/afl-clang-fast") == exec_path);
+        REQUIRE(execveat_flags == 0);
+        REQUIRE(execveat_dirfd == AT_FDCWD);
+      }
+    }
+
+    WHEN("execveat runs the file by its path") {
+      execveat(AT_FDCWD, path, args, environ, 0);
+
+      THEN("replacement should be run") {
+        REQUIRE(std::string("/usr/bin/afl-clang-fast") == exec_path);
+      }
+    }
+
+    WHEN("execveat runs the file by path relative to directory fd") {
+      int dirfd = open("/tmp", O_RDONLY | O_DIRECTORY);
+      REQUIRE(dirfd >= 0);
+      execveat(dirfd, path + strlen("/tmp/"), args, environ, 0);
+      close(dirfd);
+
+      THEN("replacement should be run by its own path") {
+        REQUIRE(std::string("/usr/bin/afl-clang-fast") == exec_path);
+        REQUIRE(execveat_dirfd == AT_FDCWD);
+      }
+    }
+
+    WHEN("fexecve runs some other file") {
+      int other = open("/bin/sh", O_RDONLY);
+      REQUIRE(other >= 0);
+      fexecve(other, args, environ);
+      close(other);
+
+      THEN("original fexecve should be called with original argv") {
+        REQUIRE(std::string("(fd)") == exec_path);
+        REQUIRE(list_size(exec_argv) == 3);
+      }
+    }
+
+    real_execve = nullptr;
+    real_execveat = nullptr;
+    real_fexecve = nullptr;
+    exeptor_initialized = false;
+    close(fd);
+    unlink(path);
+  }
+
+  GIVEN("Program replaced by bare name of executable in PATH") {
+    char dir[] = "/tmp/exeptor-test-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string program = std::string(dir) + "/cc";
+    std::string tool = std::string(dir) + "/exeptor-fake-cc";
+    for (const auto &name : {program, tool}) {
+      int created = open(name.c_str(), O_WRONLY | O_CREAT, 0755);
+      REQUIRE(created >= 0);
+      close(created);
+    }
+    int fd = open(program.c_str(), O_RDONLY);
+    REQUIRE(fd >= 0);
+
+    std::string old_path = getenv("PATH") ? getenv("PATH") : "";
+    setenv("PATH", (std::string(dir) + ":/usr/bin:/bin").c_str(), 1);
+
+    ReplacementSettings settings;
+    settings.programs[program] = {"exeptor-fake-cc", settings.add_group("cc")};
+    REQUIRE(apply_settings(settings));
+
+    exeptor_initialized = true;
+    g_intercept_allowed = true;
+    logpath = nullptr;
+    real_execve = fake_execve;
+    real_execvpe = fake_execve;
+    real_execveat = fake_execveat;
+    real_fexecve = fake_fexecve;
+
+    const char *argv[] = {"cc", "a.c", nullptr};
+    auto args = const_cast<char *const *>(argv);
+    exec_path = nullptr;
+
+    WHEN("fexecve runs the file") {
+      fexecve(fd, args, environ);
+
+      THEN("replacement should be found in PATH") {
+        REQUIRE(tool == exec_path);
+        REQUIRE(std::string("exeptor-fake-cc") == exec_argv[0]);
+      }
+    }
+
+    WHEN("execveat runs the file with AT_EMPTY_PATH") {
+      execveat(fd, "", args, environ, AT_EMPTY_PATH);
+
+      THEN("replacement should be found in PATH") {
+        REQUIRE(tool == exec_path);
+        REQUIRE(execveat_dirfd == AT_FDCWD);
+      }
+    }
+
+    WHEN("replacement can't be resolved in this process") {
+      setenv("PATH", "/usr/bin:/bin", 1);
+      fexecve(fd, args, environ);
+      std::string by_fexecve = exec_path;
+      execveat(fd, "", args, environ, AT_EMPTY_PATH);
+
+      THEN("libc should search PATH for it") {
+        REQUIRE(by_fexecve == "exeptor-fake-cc");
+        REQUIRE(std::string("exeptor-fake-cc") == exec_path);
+      }
+    }
+
+    setenv("PATH", old_path.c_str(), 1);
+    real_execve = nullptr;
+    real_execvpe = nullptr;
+    real_execveat = nullptr;
+    real_fexecve = nullptr;
+    exeptor_initialized = false;
+    close(fd);
+    unlink(program.c_str());
+    unlink(tool.c_str());
+    rmdir(dir);
+  }
+}
+
+// wall time of the same spawn loop run by many threads at once
+template <typename func_t>
+static double threaded_usec(int threads, int spawns, func_t spawn) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.emplace_back([&]() {
+      for (int j = 0; j < spawns; j++) {
+        spawn();
+      }
+    });
+  }
+  for (auto &w : workers) {
+    w.join();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1e6 +
+         (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+SCENARIO("exec hooks should be safe to call from many threads", "[threads]") {
+  GIVEN("Config file not loaded yet and 64 spawning threads") {
+    char config_path[] = "/tmp/exeptor-threads-XXXXXX";
+    int fd = mkstemp(config_path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    FILE *f = fopen(config_path, "wt");
+    REQUIRE(f != nullptr);
+    fputs("target_groups:\n"
+          "  tools:\n"
+          "    replacements:\n"
+          "      /bin/false: /bin/true\n",
+          f);
+    fclose(f);
+
+    setenv("EXEPTOR_CONFIG", config_path, 1);
+    unsetenv("EXEPTOR_SNAPSHOT_FD");
+    forget_own_envs();
+    unsetenv("EXEPTOR_LOG");
+    g_intercept_allowed = true;
+    exeptor_initialized = false;
+    exeptor_init_started = false;
+
+    const int threads = 64;
+    const int spawns = 4;
+    std::atomic<int> failures(0);
+
+    // spawners pass environ just like system() and popen() do, initlib
+    // running in one of them must not change it under others
+    unsetenv("LD_PRELOAD");
+    char **initial_environ = environ;
+
+    // each thread runs /bin/false, which is only fine when it gets replaced
+    auto spawn = [&](posix_spawn_t spawn_func) {
+      char *const argv[] = {const_cast<char *>("/bin/false"), nullptr};
+      pid_t pid;
+      int status = -1;
+      if (spawn_func(&pid, "/bin/false", nullptr, nullptr, argv, environ) !=
+              0 ||
+          waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+          WEXITSTATUS(status) != 0) {
+        failures++;
+      }
+    };
+
+    WHEN("all threads call posix_spawn at once") {
+      double hooked = threaded_usec(threads, spawns,
+                                    [&]() { spawn(posix_spawn); });
+      int hooked_failures = failures.exchange(0);
+
+      char *const argv[] = {const_cast<char *>("/bin/true"), nullptr};
+      double direct = threaded_usec(threads, spawns, [&]() {
+        pid_t pid;
+        int status;
+        if (REAL(posix_spawn)(&pid, "/bin/true", nullptr, nullptr, argv,
+                              environ) != 0 ||
+            waitpid(pid, &status, 0) != pid) {
+          failures++;
+        }
+      });
+
+      THEN("config should be loaded once and every spawn replaced") {
+        REQUIRE(exeptor_initialized);
+        REQUIRE(hooked_failures == 0);
+        REQUIRE(failures == 0);
+      }
+
+      THEN("environment should stay as it was") {
+        REQUIRE(environ == initial_environ);
+        REQUIRE(getenv("EXEPTOR_SNAPSHOT_FD") == nullptr);
+      }
+
+      THEN("hooks should not serialize spawning threads") {
+        // process creation dominates both runs. hooks add one config load
+        // and a lookup per spawn, threads waiting for each other would
+        // multiply the time by the number of cores
+        REQUIRE(hooked < direct * 1.5 + 20000);
+      }
+    }
+
+    WHEN("half of threads spawn programs naming response file at once") {
+      int rsp_fd = make_response_file();
+      REQUIRE(rsp_fd >= 0);
+      std::string rsp_arg = "@/proc/self/fd/" + std::to_string(rsp_fd);
+      // $0 is response file argument, if any
+      std::string has = "fd=${0#@/proc/self/fd/}; [ -e /proc/$$/fd/$fd ]";
+      std::string lacks = "[ ! -e /proc/$$/fd/" + std::to_string(rsp_fd) +
+                          " ]";
+      posix_spawn_file_actions_t app_actions;
+      REQUIRE(posix_spawn_file_actions_init(&app_actions) == 0);
+      std::atomic<int> turn(0);
+
+      threaded_usec(threads, spawns, [&]() {
+        int n = turn++;
+        const char *sh_argv[] = {"/bin/sh", "-c", lacks.c_str(), nullptr,
+                                 nullptr};
+        if (n % 2) {
+          sh_argv[2] = has.c_str();
+          sh_argv[3] = rsp_arg.c_str();
+        }
+        // every other spawn naming response file has file actions of app
+        pid_t pid;
+        int status = -1;
+        if (posix_spawn(&pid, "/bin/sh", n % 4 == 3 ? &app_actions : nullptr,
+                        nullptr, const_cast<char *const *>(sh_argv),
+                        environ) != 0 ||
+            waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+          failures++;
+        }
+      });
+
+      THEN("only programs naming it should inherit it") {
+        REQUIRE(failures == 0);
+      }
+
+      THEN("response file should stay close-on-exec") {
+        REQUIRE(fcntl(rsp_fd, F_GETFD) == FD_CLOEXEC);
+      }
+
+      posix_spawn_file_actions_destroy(&app_actions);
+      close(rsp_fd);
+    }
+
+    exeptor_initialized = false;
+    exeptor_init_started = false;
+    g_config_path[0] = '\0';
+    unsetenv("EXEPTOR_CONFIG");
+    unsetenv("EXEPTOR_SNAPSHOT_FD");
+    forget_own_envs();
+    unlink(config_path);
+    unlink((std::string(config_path) + EXEPTOR_SNAPSHOT_SUFFIX).c_str());
+  }
+}
+
+// readers pinning config and path as given to exec, before any copying
+static unsigned exec_readers = 0;
+static const char *exec_raw_path = nullptr;
+
+static int pin_counting_execve(const char *path, char *const argv[],
+                               char *const envp[]) {
+  exec_readers = g_config_readers[0] + g_config_readers[1];
+  exec_raw_path = path;
+  return fake_execve(path, argv, envp);
+}
+
+SCENARIO("changed config should be reloaded by long-lived spawners",
+         "[reload]") {
+  GIVEN("Config file loaded by libexeptor") {
+    char config_path[] = "/tmp/exeptor-reload-XXXXXX";
+    int fd = mkstemp(config_path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    // replacements have different lengths, so size of file changes too
+    auto write_config = [&](const char *replacement) {
+      FILE *f = fopen(config_path, "wt");
+      REQUIRE(f != nullptr);
+      fprintf(f,
+              "target_groups:\n"
+              "  compilers:\n"
+              "    replacements:\n"
+              "      gcc: %s\n",
+              replacement);
+      fclose(f);
+    };
+    auto replacement_of = [](const ConfigSnapshot &snapshot) {
+      auto t = snapshot.find("gcc");
+      return std::string(t ? snapshot.str(t->replacement) : "");
+    };
+
+    write_config("afl-clang-fast");
+    setenv("EXEPTOR_CONFIG", config_path, 1);
+    unsetenv("EXEPTOR_SNAPSHOT_FD");
+    forget_own_envs();
+    unsetenv("EXEPTOR_LOG");
+    exeptor_initialized = false;
+    exeptor_init_started = false;
+    initlib();
+    REQUIRE(replacement_of(current_snapshot()) == "afl-clang-fast");
+
+    WHEN("config file doesn't change") {
+      THEN("nothing should be reloaded") { REQUIRE_FALSE(reload_config()); }
+    }
+
+    WHEN("config file changes") {
+      write_config("afl-gcc-fast");
+
+      THEN("new config should be swapped in") {
+        REQUIRE(reload_config());
+        REQUIRE(replacement_of(current_snapshot()) == "afl-gcc-fast");
+      }
+
+      THEN("children should find new config by the same descriptor") {
+        REQUIRE(reload_config());
+        ConfigSnapshot inherited;
+        const char *entry = g_own_envs[exeptor_var_index(
+            "EXEPTOR_SNAPSHOT_FD=")];
+        REQUIRE(entry != nullptr);
+        REQUIRE(map_inherited_snapshot(strchr(entry, '=') + 1, config_path,
+                                       inherited));
+        REQUIRE(replacement_of(inherited) == "afl-gcc-fast");
+        munmap(const_cast<SnapshotHeader *>(inherited.header()),
+               inherited.size());
+      }
+
+      THEN("config pinned by hook should outlive reloads") {
+        {
+          ConfigPin pin(true);
+          REQUIRE(reload_config());
+          write_config("afl-clang-lto");
+          REQUIRE_FALSE(reload_config()); // retired config is still read
+          REQUIRE(replacement_of(pin.snapshot()) == "afl-clang-fast");
+        }
+        REQUIRE(reload_config());
+        REQUIRE(replacement_of(current_snapshot()) == "afl-clang-lto");
+      }
+
+      THEN("exec hooks should keep config pinned until exec") {
+        real_execve = pin_counting_execve;
+        g_intercept_allowed = true;
+        const char *argv[] = {"gcc", nullptr};
+        auto args = const_cast<char *const *>(argv);
+        const ConfigSnapshot &snapshot = current_snapshot();
+        auto begin = reinterpret_cast<const char *>(snapshot.header());
+        auto end = begin + snapshot.size();
+
+        execve("gcc", args, environ);
+        REQUIRE(exec_readers == 1);
+        REQUIRE((exec_raw_path >= begin && exec_raw_path < end));
+
+        // vfork child sees pid of its parent in shared memory
+        pid_t pid = g_pid;
+        g_pid = getpid() + 1;
+        execve("gcc", args, environ);
+        g_pid = pid;
+        REQUIRE(exec_readers == 0);
+        REQUIRE_FALSE((exec_raw_path >= begin && exec_raw_path < end));
+        REQUIRE(std::string("afl-clang-fast") == exec_path);
+        REQUIRE(g_config_readers[0] + g_config_readers[1] == 0);
+        real_execve = nullptr;
+      }
+
+      THEN("spawn hooks should check config once per interval") {
+        real_posix_spawn = fake_posix_spawn;
+        g_intercept_allowed = true;
+        g_spawns = 0;
+        const char *argv[] = {"gcc", nullptr};
+        auto args = const_cast<char *const *>(argv);
+        for (int i = 0; i < EXEPTOR_RELOAD_INTERVAL - 1; i++) {
+          posix_spawn(nullptr, "gcc", nullptr, nullptr, args, environ);
+        }
+        REQUIRE(std::string("afl-clang-fast") == exec_path);
+
+        posix_spawn(nullptr, "gcc", nullptr, nullptr, args, environ);
+        REQUIRE(std::string("afl-gcc-fast") == exec_path);
+        real_posix_spawn = nullptr;
+      }
+    }
+
+    WHEN("replacement and group are removed from config") {
+      FILE *f = fopen(config_path, "wt");
+      REQUIRE(f != nullptr);
+      fputs("target_groups:\n"
+            "  compilers:\n"
+            "    replacements:\n"
+            "      gcc: afl-clang-fast\n"
+            "      cc: afl-clang-fast\n"
+            "  linkers:\n"
+            "    replacements:\n"
+            "      ld: ld.lld\n",
+            f);
+      fclose(f);
+      REQUIRE(reload_config());
+      REQUIRE(current_snapshot().find("cc") != nullptr);
+      REQUIRE(current_snapshot().num_groups() == 2);
+
+      // retired config is released by the next reload
+      REQUIRE_FALSE(reload_config());
+      write_config("afl-gcc-fast");
+
+      THEN("reloaded config should not keep them") {
+        REQUIRE(reload_config());
+        const ConfigSnapshot &snapshot = current_snapshot();
+        REQUIRE(replacement_of(snapshot) == "afl-gcc-fast");
+        REQUIRE(snapshot.find("cc") == nullptr);
+        REQUIRE(snapshot.find("ld") == nullptr);
+        REQUIRE(snapshot.num_groups() == 1);
+      }
+
+      THEN("cached snapshot should not keep them either") {
+        REQUIRE(reload_config());
+        ConfigSnapshot cached;
+        REQUIRE(map_cached_snapshot(config_path, cached));
+        REQUIRE(cached.find("cc") == nullptr);
+        REQUIRE(cached.num_groups() == 1);
+        munmap(const_cast<SnapshotHeader *>(cached.header()), cached.size());
+      }
+    }
+
+    for (auto &config : g_configs) {
+      config.release();
+    }
+    g_retired = nullptr;
+    g_config_path[0] = '\0';
+    close(g_snapshot_fd);
+    g_snapshot_fd = -1;
+    exeptor_initialized = false;
+    exeptor_init_started = false;
+    unsetenv("EXEPTOR_CONFIG");
+    unsetenv("EXEPTOR_SNAPSHOT_FD");
+    forget_own_envs();
+    unlink(config_path);
+    unlink((std::string(config_path) + EXEPTOR_SNAPSHOT_SUFFIX).c_str());
+  }
+}
+
+SCENARIO("replacements should recognize themselves by marker", "[recursion]") {
+  GIVEN("Replacement which runs the program it replaces and a wrapper chain") {
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.programs["gcc"] = {"afl-gcc-fast", cc};
+    auto wrappers = settings.add_group("wrappers");
+    settings.programs["cc"] = {"ccache", wrappers};
+    settings.groups[wrappers].reintercept = 1;
+    REQUIRE(apply_settings(settings));
+
+    exeptor_initialized = true;
+    logpath = nullptr;
+    real_execve = fake_execve;
+
+    const char *argv[] = {"gcc", "-c", "a.c", nullptr};
+    auto args = const_cast<char *const *>(argv);
+    const char *envp[] = {"HOME=/root", "EXEPTOR_REPLACED=1:1", nullptr};
+    auto app_envp = const_cast<char *const *>(envp);
+
+    auto start_as = [](const char *marker) {
+      g_intercept_allowed = true;
+      g_replaced_depth = 0;
+      g_has_replaced_marker = false;
+      setenv("EXEPTOR_REPLACED", marker, 1);
+      take_replaced_marker();
+      check_replaced_marker(current_snapshot());
+    };
+
+    WHEN("replacement of group without reintercept starts") {
+      start_as(replaced_marker("cc", 1).c_str());
+
+      THEN("it should run everything as is") {
+        REQUIRE_FALSE(g_intercept_allowed);
+        REQUIRE(getenv("EXEPTOR_REPLACED") == nullptr);
+
+        execve("gcc", args, app_envp);
+        REQUIRE(std::string("gcc") == exec_path);
+        REQUIRE(list_size(exec_envp) == 1);
+      }
+    }
+
+    WHEN("wrapper allowed to reintercept starts") {
+      start_as(replaced_marker("wrappers", 1).c_str());
+
+      THEN("its child should be replaced one level deeper") {
+        REQUIRE(g_intercept_allowed);
+
+        execve("gcc", args, app_envp);
+        REQUIRE(std::string("afl-gcc-fast") == exec_path);
+        REQUIRE(list_size(exec_envp) == 2);
+        REQUIRE(std::string("HOME=/root") == exec_envp[0]);
+        REQUIRE("EXEPTOR_REPLACED=" + replaced_marker("cc", 2) ==
+                exec_envp[1]);
+      }
+    }
+
+    WHEN("wrapper starts once reloaded config has its groups reordered") {
+      ReplacementSettings reloaded;
+      auto moved = reloaded.add_group("wrappers");
+      reloaded.programs["cc"] = {"ccache", moved};
+      reloaded.groups[moved].reintercept = 1;
+      reloaded.programs["gcc"] = {"afl-gcc-fast", reloaded.add_group("cc")};
+      REQUIRE(apply_settings(reloaded));
+      start_as(replaced_marker("wrappers", 1).c_str());
+
+      THEN("marker should still point to its group") {
+        REQUIRE(g_intercept_allowed);
+      }
+    }
+
+    WHEN("wrapper chain is deeper than allowed") {
+      start_as(replaced_marker("wrappers", 2).c_str());
+
+      THEN("nothing should be intercepted") {
+        REQUIRE_FALSE(g_intercept_allowed);
+      }
+    }
+
+    WHEN("marker is broken") {
+      start_as("garbage");
+
+      THEN("process should still be treated as replacement") {
+        REQUIRE_FALSE(g_intercept_allowed);
+      }
+    }
+
+    WHEN("marker is too long") {
+      start_as(("0:1" + std::string(100, '0')).c_str());
+
+      THEN("process should still be treated as replacement") {
+        REQUIRE_FALSE(g_intercept_allowed);
+        REQUIRE(getenv("EXEPTOR_REPLACED") == nullptr);
+      }
+    }
+
+    WHEN("process isn't a replacement") {
+      g_intercept_allowed = true;
+      g_replaced_depth = 0;
+
+      THEN("stale marker should be dropped for other programs") {
+        execve("ld", args, app_envp);
+        REQUIRE(std::string("ld") == exec_path);
+        REQUIRE(list_size(exec_envp) == 1);
+        REQUIRE(std::string("HOME=/root") == exec_envp[0]);
+      }
+    }
+
+    g_intercept_allowed = true;
+    g_replaced_depth = 0;
+    g_has_replaced_marker = false;
+    real_execve = nullptr;
+    exeptor_initialized = false;
+  }
+}
+
+// like execvpe and posix_spawnp, fail for paths which don't exist
+static int fake_execvpe_checked(const char *path, char *const argv[],
+                                char *const envp[]) {
+  if (strchr(path, '/') && access(path, X_OK) != 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  return fake_execve(path, argv, envp);
+}
+
+static int fake_posix_spawnp_checked(pid_t *, const char *path,
+                                     const posix_spawn_file_actions_t *,
+                                     const posix_spawnattr_t *,
+                                     char *const argv[], char *const envp[]) {
+  return fake_execvpe_checked(path, argv, envp) == 0 ? 0 : ENOENT;
+}
+
+SCENARIO("replacements should be resolved in PATH only once",
+         "[path]") {
+  GIVEN("Replacement given by bare name of executable in PATH") {
+    char dir[] = "/tmp/exeptor-test-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string tool = std::string(dir) + "/exeptor-fake-cc";
+    int fd = open(tool.c_str(), O_WRONLY | O_CREAT, 0755);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    std::string old_path = getenv("PATH") ? getenv("PATH") : "";
+    std::string search_path = std::string(dir) + ":/usr/bin:/bin";
+    setenv("PATH", search_path.c_str(), 1);
+
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.programs["gcc"] = {"exeptor-fake-cc", cc};
+    settings.programs["cc"] = {"exeptor-missing-cc", cc};
+    REQUIRE(apply_settings(settings));
+
+    exeptor_initialized = true;
+    g_intercept_allowed = true;
+    logpath = nullptr;
+    real_execvp = fake_execv;
+    real_execvpe = fake_execve; // replacements get environment of their own
+    real_posix_spawnp = fake_posix_spawn;
+
+    const char *argv[] = {"gcc", "a.c", nullptr};
+    auto args = const_cast<char *const *>(argv);
+
+    THEN("snapshot should keep absolute path for PATH it was built with") {
+      const ConfigSnapshot &snapshot = current_snapshot();
+      auto t = snapshot.find("gcc");
+      REQUIRE(t != nullptr);
+      auto resolved = snapshot.resolved(*t, snapshot_hash(search_path.c_str()));
+      REQUIRE(resolved != nullptr);
+      REQUIRE(tool == resolved);
+      REQUIRE(snapshot.resolved(*t, snapshot_hash("/usr/bin")) == nullptr);
+    }
+
+    WHEN("posix_spawnp runs replaced program") {
+      posix_spawnp(nullptr, "gcc", nullptr, nullptr, args, environ);
+
+      THEN("replacement should be run by absolute path") {
+        REQUIRE(tool == exec_path);
+        REQUIRE(std::string("exeptor-fake-cc") == exec_argv[0]);
+      }
+    }
+
+    WHEN("PATH differs from the one snapshot was built with") {
+      std::string other_path = "/usr/bin:" + std::string(dir);
+      setenv("PATH", other_path.c_str(), 1);
+      execvp("gcc", args);
+      std::string first = exec_path;
+      execvp("gcc", args);
+
+      THEN("replacement should be resolved by the process") {
+        REQUIRE(first == tool);
+        REQUIRE(tool == exec_path);
+      }
+    }
+
+    WHEN("resolved replacement is gone since snapshot was built") {
+      real_execvpe = fake_execvpe_checked;
+      real_posix_spawnp = fake_posix_spawnp_checked;
+      unlink(tool.c_str());
+
+      THEN("execvp should search PATH for bare name") {
+        exec_path = nullptr;
+        REQUIRE(execvp("gcc", args) == 0);
+        REQUIRE(exec_path != nullptr);
+        REQUIRE(std::string("exeptor-fake-cc") == exec_path);
+      }
+
+      THEN("posix_spawnp should search PATH for bare name") {
+        exec_path = nullptr;
+        REQUIRE(posix_spawnp(nullptr, "gcc", nullptr, nullptr, args,
+                             environ) == 0);
+        REQUIRE(exec_path != nullptr);
+        REQUIRE(std::string("exeptor-fake-cc") == exec_path);
+      }
+
+      real_execvpe = fake_execve;
+      real_posix_spawnp = fake_posix_spawn;
+    }
+
+    WHEN("replacement isn't in PATH") {
+      execvp("cc", args);
+
+      THEN("libc should search PATH as usual") {
+        REQUIRE(std::string("exeptor-missing-cc") == exec_path);
+      }
+    }
+
+    WHEN("PATH has relative directory before the replacement") {
+      std::string relative_path = "bin:" + std::string(dir);
+      setenv("PATH", relative_path.c_str(), 1);
+      execvp("gcc", args);
+
+      THEN("libc should search PATH as usual") {
+        REQUIRE(std::string("exeptor-fake-cc") == exec_path);
+      }
+    }
+
+    setenv("PATH", old_path.c_str(), 1);
+    real_execvp = nullptr;
+    real_execvpe = nullptr;
+    real_posix_spawnp = nullptr;
+    exeptor_initialized = false;
+    unlink(tool.c_str());
+    rmdir(dir);
+  }
+}
+
+SCENARIO("programs should be matched by inode of their binary", "[inode]") {
+  GIVEN("Binary with symlinks, matched by inode in one group only") {
+    char dir[] = "/tmp/exeptor-test-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string base = dir;
+    std::string tool = base + "/gcc-12";
+    std::string other = base + "/ld";
+    for (const auto &path : {tool, other}) {
+      int fd = open(path.c_str(), O_WRONLY | O_CREAT, 0755);
+      REQUIRE(fd >= 0);
+      close(fd);
+    }
+    REQUIRE(mkdir((base + "/bin").c_str(), 0755) == 0);
+    REQUIRE(symlink("../gcc-12", (base + "/bin/cc").c_str()) == 0);
+    REQUIRE(symlink("../ld", (base + "/bin/ld.bfd").c_str()) == 0);
+
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.groups[cc].match_inodes = true;
+    settings.programs[tool] = {"afl-clang-fast", cc};
+    settings.programs[other] = {"ld.lld", settings.add_group("ld")};
+    REQUIRE(apply_settings(settings));
+    const ConfigSnapshot &snapshot = current_snapshot();
+
+    THEN("only programs of groups with match-inodes should match by inode") {
+      REQUIRE(snapshot.num_inode_programs() == 1);
+      auto t = find_program(snapshot, (base + "/./gcc-12").c_str(), false);
+      REQUIRE(t != nullptr);
+      REQUIRE(std::string("afl-clang-fast") == snapshot.str(t->replacement));
+      REQUIRE(find_program(snapshot, (base + "/./ld").c_str(), false) ==
+              nullptr);
+    }
+
+    THEN("symlinks to the binary should match") {
+      auto t = find_program(snapshot, (base + "/bin/cc").c_str(), false);
+      REQUIRE(t != nullptr);
+      REQUIRE(std::string("afl-clang-fast") == snapshot.str(t->replacement));
+      REQUIRE(find_program(snapshot, (base + "/bin/ld.bfd").c_str(), false) ==
+              nullptr);
+      REQUIRE(find_program(snapshot, "/bin/sh", false) == nullptr);
+    }
+
+    THEN("relative paths should be resolved against current directory") {
+      char cwd[PATH_MAX];
+      REQUIRE(getcwd(cwd, sizeof(cwd)) != nullptr);
+      REQUIRE(chdir((base + "/bin").c_str()) == 0);
+      auto t1 = find_program(snapshot, "./cc", false);
+      auto t2 = find_program(snapshot, "../gcc-12", false);
+      auto t3 = find_program(snapshot, "cc", false);
+      REQUIRE(chdir(cwd) == 0);
+      REQUIRE(t1 != nullptr);
+      REQUIRE(t2 == t1);
+      REQUIRE(t3 == t1);
+      REQUIRE(find_program(snapshot, "cc", false) == nullptr);
+    }
+
+    THEN("bare names should be resolved in PATH by execvp-like calls") {
+      std::string old_path = getenv("PATH") ? getenv("PATH") : "";
+      setenv("PATH", (base + "/bin").c_str(), 1);
+      auto t = find_program(snapshot, "cc", true);
+      setenv("PATH", old_path.c_str(), 1);
+      REQUIRE(t != nullptr);
+      REQUIRE(std::string("afl-clang-fast") == snapshot.str(t->replacement));
+    }
+
+    WHEN("symlink gets intercepted by exec hook") {
+      exeptor_initialized = true;
+      g_intercept_allowed = true;
+      logpath = nullptr;
+      real_execve = fake_execve;
+      std::string link = base + "/bin/cc";
+      const char *argv[] = {link.c_str(), "a.c", nullptr};
+      execve(link.c_str(), const_cast<char *const *>(argv), environ);
+      real_execve = nullptr;
+      exeptor_initialized = false;
+
+      THEN("replacement should run") {
+        REQUIRE(std::string("afl-clang-fast") == exec_path);
+        REQUIRE(std::string("afl-clang-fast") == exec_argv[0]);
+      }
+    }
+
+    // state of libexeptor in the first process of a new build
+    auto forget_stat_cache = [&]() {
+      if (g_stat_cache) {
+        munmap(g_stat_cache, EXEPTOR_STATCACHE_SIZE);
+      }
+      if (g_stat_cache_fd >= 0) {
+        close(g_stat_cache_fd);
+      }
+      g_stat_cache = nullptr;
+      g_stat_cache_failed = false;
+      g_stat_cache_fd = -1;
+      forget_own_envs();
+      unsetenv("EXEPTOR_STATCACHE_FD");
+    };
+    auto new_build = [&]() {
+      forget_stat_cache();
+      publish_stat_cache(snapshot);
+    };
+    std::string link = base + "/bin/cc";
+
+    WHEN("first process of a build makes the table") {
+      new_build();
+      StatCacheSlot *cache = stat_cache();
+      REQUIRE(cache != nullptr);
+
+      THEN("binaries should be recorded in it") {
+        uint64_t index, unused;
+        REQUIRE(statcache_get(cache, inodes_recorded_key(snapshot), index,
+                              unused));
+        struct stat st;
+        REQUIRE(stat(tool.c_str(), &st) == 0);
+        REQUIRE(statcache_get(cache, inode_key(snapshot, st.st_dev, st.st_ino),
+                              index, unused));
+        REQUIRE(&snapshot.program(index) == snapshot.find(tool.c_str()));
+        REQUIRE(stat(other.c_str(), &st) == 0);
+        REQUIRE_FALSE(statcache_get(
+            cache, inode_key(snapshot, st.st_dev, st.st_ino), index, unused));
+      }
+
+      forget_stat_cache();
+    }
+
+    WHEN("path gets re-pointed after lookup") {
+      new_build();
+      REQUIRE(find_program(snapshot, link.c_str(), false) != nullptr);
+      REQUIRE(stat_cache() != nullptr);
+      unlink(link.c_str());
+      REQUIRE(symlink("../ld", link.c_str()) == 0);
+
+      THEN("build which looked it up should keep cached inode") {
+        REQUIRE(find_program(snapshot, link.c_str(), false) != nullptr);
+      }
+
+      THEN("next build should find new target") {
+        new_build();
+        REQUIRE(find_program(snapshot, link.c_str(), false) == nullptr);
+      }
+
+      THEN("table should be passed to children of the build") {
+        char *const envp[] = {nullptr};
+        ArgList envs;
+        auto child_envp = prep_common_envp(envp, envs);
+        std::string entry =
+            "EXEPTOR_STATCACHE_FD=" + std::to_string(g_stat_cache_fd);
+        auto end = child_envp + list_size(child_envp);
+        REQUIRE(std::find(child_envp, end, entry) != end);
+      }
+
+      forget_stat_cache();
+    }
+
+    WHEN("inherited descriptor is not a table") {
+      forget_stat_cache();
+      FILE *f = tmpfile();
+      REQUIRE(f != nullptr);
+      REQUIRE(ftruncate(fileno(f), EXEPTOR_STATCACHE_SIZE) == 0);
+      setenv("EXEPTOR_STATCACHE_FD", std::to_string(fileno(f)).c_str(), 1);
+      publish_stat_cache(snapshot);
+
+      THEN("it should be left alone") {
+        REQUIRE(g_stat_cache_fd == fileno(f));
+        REQUIRE(stat_cache() == nullptr);
+        REQUIRE(find_program(snapshot, link.c_str(), false) != nullptr);
+      }
+
+      g_stat_cache_fd = -1;
+      forget_stat_cache();
+      fclose(f);
+    }
+
+    unlink((base + "/bin/cc").c_str());
+    unlink((base + "/bin/ld.bfd").c_str());
+    rmdir((base + "/bin").c_str());
+    unlink(tool.c_str());
+    unlink(other.c_str());
+    rmdir(dir);
+  }
+
+  GIVEN("Config cached on disk with compiler given by symlink") {
+    char dir[] = "/tmp/exeptor-test-XXXXXX";
+    REQUIRE(mkdtemp(dir) != nullptr);
+    std::string base = dir;
+    std::string config_path = base + "/exeptor.yaml";
+    std::string cache_path = config_path + EXEPTOR_SNAPSHOT_SUFFIX;
+    std::string link = base + "/cc";
+    for (const char *name : {"/gcc-12", "/gcc-13"}) {
+      int fd = open((base + name).c_str(), O_WRONLY | O_CREAT, 0755);
+      REQUIRE(fd >= 0);
+      close(fd);
+    }
+    REQUIRE(symlink("gcc-12", link.c_str()) == 0);
+
+    FILE *f = fopen(config_path.c_str(), "wt");
+    REQUIRE(f != nullptr);
+    fprintf(f,
+            "target_groups:\n"
+            "  compilers:\n"
+            "    match-inodes: yes\n"
+            "    replacements:\n"
+            "      %s: afl-clang-fast\n",
+            link.c_str());
+    fclose(f);
+
+    auto forget_build = [&]() {
+      if (g_stat_cache) {
+        munmap(g_stat_cache, EXEPTOR_STATCACHE_SIZE);
+      }
+      if (g_stat_cache_fd >= 0) {
+        close(g_stat_cache_fd);
+      }
+      g_stat_cache = nullptr;
+      g_stat_cache_failed = false;
+      g_stat_cache_fd = -1;
+      forget_own_envs();
+      unsetenv("EXEPTOR_STATCACHE_FD");
+    };
+    // the first process of a build: config from disk, new table
+    auto start_build = [&]() {
+      forget_build();
+      REQUIRE(load_config(config_path.c_str(), *g_config.load()));
+      publish_stat_cache(current_snapshot());
+    };
+
+    WHEN("symlink gets re-pointed between two builds") {
+      start_build();
+      REQUIRE(find_program(current_snapshot(), (base + "/gcc-12").c_str(),
+                           false) != nullptr);
+      REQUIRE(access(cache_path.c_str(), R_OK) == 0);
+
+      unlink(link.c_str());
+      REQUIRE(symlink("gcc-13", link.c_str()) == 0);
+      start_build();
+
+      THEN("next build should use cached snapshot") {
+        REQUIRE(g_config.load()->mapped);
+      }
+
+      THEN("next build should match the new target only") {
+        const ConfigSnapshot &snapshot = current_snapshot();
+        REQUIRE(find_program(snapshot, (base + "/gcc-13").c_str(), false) !=
+                nullptr);
+        REQUIRE(find_program(snapshot, (base + "/gcc-12").c_str(), false) ==
+                nullptr);
+      }
+    }
+
+    forget_build();
+    g_config.load()->release();
+    unlink(link.c_str());
+    unlink((base + "/gcc-12").c_str());
+    unlink((base + "/gcc-13").c_str());
+    unlink(cache_path.c_str());
+    unlink(config_path.c_str());
+    rmdir(dir);
+  }
+
+  GIVEN("Stat cache table") {
+    std::vector<StatCacheSlot> slots(EXEPTOR_STATCACHE_SLOTS);
+    memset(slots.data(), 0, slots.size() * sizeof(StatCacheSlot));
+
+    THEN("entries should be found until probe limit is exhausted") {
+      uint64_t dev = 0, ino = 0;
+      REQUIRE_FALSE(statcache_get(slots.data(), 42, dev, ino));
+      statcache_put(slots.data(), 42, 1, 2);
+      REQUIRE(statcache_get(slots.data(), 42, dev, ino));
+      REQUIRE(dev == 1);
+      REQUIRE(ino == 2);
+
+      // keys colliding in the same slot
+      for (uint64_t k = 1; k <= EXEPTOR_STATCACHE_PROBES + 1; k++) {
+        statcache_put(slots.data(), k << 32 | 7, k, k);
+      }
+      REQUIRE(statcache_get(slots.data(), 1ULL << 32 | 7, dev, ino));
+      REQUIRE(ino == 1);
+      REQUIRE_FALSE(statcache_get(
+          slots.data(), uint64_t(EXEPTOR_STATCACHE_PROBES + 1) << 32 | 7, dev,
+          ino));
+    }
+
+    THEN("slots being filled should not be read") {
+      uint64_t dev = 0, ino = 0;
+      slots[5].key = 5;
+      REQUIRE_FALSE(statcache_get(slots.data(), 5, dev, ino));
+    }
+  }
+}
+
+static std::string read_file(const char *path) {
+  std::string content;
+  FILE *f = fopen(path, "rb");
+  if (f) {
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      content.append(buf, n);
+    }
+    fclose(f);
+  }
+  return content;
+}
+
+static std::vector<std::string> parse_rsp(const std::string &content) {
+  std::vector<std::string> result;
+  std::vector<char> buf(content.size() + 1);
+  RspParser parser{content.data(), content.data() + content.size()};
+  size_t len;
+  while (parser.next(buf.data(), len)) {
+    result.emplace_back(buf.data(), len);
+  }
+  return result;
+}
+
+// response file made by hook only lives until exec returns
+static std::string exec_rsp_content;
+static int exec_rsp_flags = -1;
+
+static int fake_execve_rsp(const char *path, char *const argv[],
+                           char *const envp[]) {
+  exec_rsp_content.clear();
+  exec_rsp_flags = -1;
+  if (argv[1] && argv[1][0] == '@') {
+    exec_rsp_content = read_file(argv[1] + 1);
+    exec_rsp_flags = fcntl(response_file_fd(argv[1]), F_GETFD);
+  }
+  return fake_execve(path, argv, envp);
+}
+
+SCENARIO("response files should be rewritten and used for huge command lines",
+         "[rsp]") {
+  GIVEN("Group deleting options, response files on disk") {
+    ReplacementSettings settings;
+    auto group = settings.add_group("cc");
+    settings.programs["gcc"] = {"afl-clang-fast", group};
+    settings.groups[group].add_options = {"-g"};
+    settings.groups[group].del_options = {"-Werror", "-Wl,--fatal-warnings"};
+    REQUIRE(apply_settings(settings));
+
+    char path[] = "/tmp/exeptor-test-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    std::string rsp = "-c 'dir with space/a.c'\n"
+                      "-Werror \"-DMSG=\\\"hi there\\\"\" -O2\\ x\n"
+                      "\t-Wl,--fatal-warnings back\\\\slash ''\n";
+    REQUIRE(write(fd, rsp.data(), rsp.size()) == (ssize_t)rsp.size());
+    close(fd);
+    std::string rsp_arg = std::string("@") + path;
+
+    THEN("parser should follow quoting rules of GCC") {
+      REQUIRE(parse_rsp(rsp) ==
+              std::vector<std::string>{"-c", "dir with space/a.c", "-Werror",
+                                       "-DMSG=\"hi there\"", "-O2 x",
+                                       "-Wl,--fatal-warnings", "back\\slash",
+                                       ""});
+    }
+
+    WHEN("replaced program gets response file with del-options") {
+      const char *argv[] = {"gcc", rsp_arg.c_str(), "-Werror", "x.o", nullptr};
+      int rsp_fd = -1;
+      int rsp_flags = -1;
+      std::vector<std::string> rewritten;
+      {
+        ArgList args;
+        args_from_argv_envp(args, argv);
+        const char *prog = "gcc";
+        malloc_poisoned = true;
+        poisoned_allocations = 0;
+        prep_prog_argv(prog, args);
+        malloc_poisoned = false;
+        REQUIRE(poisoned_allocations == 0);
+
+        REQUIRE(args.size == 4);
+        REQUIRE(std::string("x.o") == args.items[2]);
+        REQUIRE(std::string("-g") == args.items[3]);
+        REQUIRE(args.fds_count == 1);
+        rsp_fd = args.fds[0];
+        REQUIRE(std::string("@/proc/self/fd/") + std::to_string(rsp_fd) ==
+                args.items[1]);
+        rewritten = parse_rsp(read_file(args.items[1] + 1));
+        rsp_flags = fcntl(rsp_fd, F_GETFD);
+      }
+
+      THEN("copy should keep everything else as it was") {
+        REQUIRE(rewritten == std::vector<std::string>{"-c",
+                                                      "dir with space/a.c",
+                                                      "-DMSG=\"hi there\"",
+                                                      "-O2 x", "back\\slash",
+                                                      ""});
+      }
+
+      THEN("copy should be closed together with arguments") {
+        REQUIRE(fcntl(rsp_fd, F_GETFD) == -1);
+      }
+
+      THEN("copy should not leak to other children") {
+        REQUIRE(rsp_flags == FD_CLOEXEC);
+      }
+    }
+
+    WHEN("response file has nothing to delete or can't be read") {
+      std::string clean = std::string(path) + ".clean";
+      FILE *f = fopen(clean.c_str(), "w");
+      REQUIRE(f != nullptr);
+      fputs("-c a.c -O2\n", f);
+      fclose(f);
+      std::string clean_arg = "@" + clean;
+      const char *argv[] = {"gcc", clean_arg.c_str(), "@/nonexistent/rsp",
+                            "@", nullptr};
+
+      ArgList args;
+      args_from_argv_envp(args, argv);
+      const char *prog = "gcc";
+      prep_prog_argv(prog, args);
+      unlink(clean.c_str());
+
+      THEN("arguments should stay as they were") {
+        REQUIRE(args.size == 5);
+        REQUIRE(args.items[1] == argv[1]);
+        REQUIRE(args.items[2] == argv[2]);
+        REQUIRE(args.items[3] == argv[3]);
+        REQUIRE(args.fds_count == 0);
+      }
+    }
+
+    WHEN("rewritten command line is too big for exec") {
+      exeptor_initialized = true;
+      g_intercept_allowed = true;
+      logpath = nullptr;
+      real_execve = fake_execve_rsp;
+
+      std::string big = "-DBIG=" + std::string(EXEPTOR_MAX_ARG_STRLEN, 'x');
+      const char *argv[] = {"gcc", "-Werror", big.c_str(), "a.c", nullptr};
+      char *const envp[] = {const_cast<char *>("PATH=/usr/bin"), nullptr};
+      execve("gcc", const_cast<char *const *>(argv), envp);
+
+      THEN("arguments should go to response file") {
+        REQUIRE(std::string("afl-clang-fast") == exec_path);
+        REQUIRE(list_size(exec_argv) == 2);
+        REQUIRE(std::string("afl-clang-fast") == exec_argv[0]);
+        REQUIRE(parse_rsp(exec_rsp_content) ==
+                std::vector<std::string>{big, "a.c", "-g"});
+      }
+
+      THEN("only exec of replacement should inherit response file") {
+        REQUIRE(exec_rsp_flags == 0);
+      }
+
+      real_execve = nullptr;
+      exeptor_initialized = false;
+    }
+
+    WHEN("replacement gets loaded with inherited response files") {
+      int rsp_fd = make_response_file();
+      REQUIRE(rsp_fd >= 0);
+      REQUIRE(fcntl(rsp_fd, F_SETFD, 0) == 0);
+      int pipe_fds[2];
+      REQUIRE(pipe(pipe_fds) == 0);
+      std::string rsp_arg = "@/proc/self/fd/" + std::to_string(rsp_fd);
+      std::string pipe_arg = "@/proc/self/fd/" + std::to_string(pipe_fds[0]);
+      char *argv[] = {const_cast<char *>("cc"),
+                      const_cast<char *>(rsp_arg.c_str()),
+                      const_cast<char *>(pipe_arg.c_str()), nullptr};
+      keep_response_files(3, argv, environ);
+
+      THEN("its children should not inherit them") {
+        REQUIRE(fcntl(rsp_fd, F_GETFD) == FD_CLOEXEC);
+      }
+
+      THEN("descriptors of others should stay as they were") {
+        REQUIRE(fcntl(pipe_fds[0], F_GETFD) == 0);
+      }
+
+      THEN("wrapper should pass them on to exec that gets them") {
+        exeptor_initialized = true;
+        g_intercept_allowed = true;
+        logpath = nullptr;
+        real_execve = fake_execve_rsp;
+        char *const envp[] = {nullptr};
+        execve("/bin/cc", argv, envp);
+        REQUIRE(exec_rsp_flags == 0);
+        REQUIRE(fcntl(rsp_fd, F_GETFD) == FD_CLOEXEC);
+        real_execve = nullptr;
+        exeptor_initialized = false;
+      }
+
+      close(rsp_fd);
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+    }
+
+    WHEN("command line is small") {
+      exeptor_initialized = true;
+      g_intercept_allowed = true;
+      logpath = nullptr;
+      real_execve = fake_execve_rsp;
+
+      const char *argv[] = {"gcc", "-c", "a.c", nullptr};
+      char *const envp[] = {nullptr};
+      execve("gcc", const_cast<char *const *>(argv), envp);
+
+      THEN("arguments should be passed as usual") {
+        REQUIRE(list_size(exec_argv) == 4);
+        REQUIRE(exec_rsp_content.empty());
+      }
+
+      real_execve = nullptr;
+      exeptor_initialized = false;
+    }
+
+    unlink(path);
+  }
+}
+
+SCENARIO("replacements should be switched off in some build phases",
+         "[phase]") {
+  GIVEN("Phase rules for test and install steps") {
+    ReplacementSettings settings;
+    auto group = settings.add_group("cc");
+    settings.programs["gcc"] = {"afl-clang-fast", group};
+    REQUIRE(settings.add_phase(false, "make check"));
+    REQUIRE(settings.add_phase(false, "make install"));
+    REQUIRE(settings.add_phase(false, "ctest"));
+    REQUIRE(settings.add_phase(true, "make check-build*"));
+    REQUIRE_FALSE(settings.add_phase(false, "  "));
+    REQUIRE(apply_settings(settings));
+    const ConfigSnapshot &snapshot = current_snapshot();
+    REQUIRE(snapshot.num_phases() == 4);
+
+    auto phase_of = [&](std::vector<std::string> argv) {
+      std::string cmdline;
+      for (const auto &arg : argv) {
+        cmdline.append(arg.c_str(), arg.size() + 1);
+      }
+      return phase_of_cmdline(snapshot, cmdline.data(), cmdline.size());
+    };
+
+    THEN("globs should match whole strings") {
+      REQUIRE(phase_glob("make", "make"));
+      REQUIRE(phase_glob("*make", "gmake"));
+      REQUIRE(phase_glob("check-*", "check-am"));
+      REQUIRE(phase_glob("c?test", "cxtest"));
+      REQUIRE(phase_glob("*", ""));
+      REQUIRE_FALSE(phase_glob("make", "makefile"));
+      REQUIRE_FALSE(phase_glob("check-*", "check"));
+    }
+
+    THEN("commands should be matched by program and arguments") {
+      REQUIRE(phase_of({"/usr/bin/make", "-j8", "check"}) == PHASE_OFF);
+      REQUIRE(phase_of({"make", "DESTDIR=/tmp/x", "install"}) == PHASE_OFF);
+      REQUIRE(phase_of({"ctest", "--output-on-failure"}) == PHASE_OFF);
+      REQUIRE(phase_of({"make", "-j8", "all"}) == PHASE_NONE);
+      REQUIRE(phase_of({"/usr/bin/cmake", "check"}) == PHASE_NONE);
+      REQUIRE(phase_of({"make", "check", "check-build-tests"}) == PHASE_ON);
+      REQUIRE(phase_of({}) == PHASE_NONE);
+    }
+
+    THEN("marker of parent should decide unless own argv matches") {
+      char *make_all[] = {const_cast<char *>("make"),
+                          const_cast<char *>("all"), nullptr};
+      char *make_check[] = {const_cast<char *>("make"),
+                            const_cast<char *>("check"), nullptr};
+      REQUIRE(decide_phase(snapshot, "off", make_all) == PHASE_OFF);
+      REQUIRE(decide_phase(snapshot, "on", make_all) == PHASE_ON);
+      REQUIRE(decide_phase(snapshot, nullptr, make_all) == PHASE_ON);
+      REQUIRE(decide_phase(snapshot, "on", make_check) == PHASE_OFF);
+    }
+
+    THEN("ancestors should be found through /proc") {
+      REQUIRE(parent_of(getpid()) == getppid());
+      char cmdline[EXEPTOR_PHASE_CMDLINE];
+      REQUIRE(read_cmdline(0, cmdline, sizeof(cmdline)) > 0);
+    }
+
+    WHEN("replacements are off") {
+      exeptor_initialized = true;
+      g_intercept_allowed = true;
+      g_phase_off = true;
+      logpath = nullptr;
+      real_execve = fake_execve;
+
+      const char *argv[] = {"gcc", "-c", "a.c", nullptr};
+      char *const envp[] = {nullptr};
+      execve("gcc", const_cast<char *const *>(argv), envp);
+
+      THEN("original program should run with its argv") {
+        REQUIRE(std::string(exec_path) == "gcc");
+        REQUIRE(list_size(exec_argv) == 3);
+      }
+
+      g_phase_off = false;
+      real_execve = nullptr;
+      exeptor_initialized = false;
+    }
+
+    WHEN("phase gets decided") {
+      exeptor_initialized = true;
+      g_intercept_allowed = true;
+      logpath = nullptr;
+      real_execv = fake_execv;
+      real_execve = fake_execve;
+      unsetenv(EXEPTOR_PHASE);
+      g_phase_decided = false;
+      check_phase(snapshot);
+      std::string entry =
+          std::string(EXEPTOR_PHASE "=") + (g_phase_off ? "off" : "on");
+      auto passed = [&]() {
+        auto end = exec_envp + list_size(exec_envp);
+        return std::find(exec_envp, end, entry) != end;
+      };
+
+      THEN("environment of this process should stay as it was") {
+        REQUIRE(getenv(EXEPTOR_PHASE) == nullptr);
+      }
+
+      THEN("children should get decision in their envp") {
+        const char *argv[] = {"ld", "-o", "app", nullptr};
+        execv("ld", const_cast<char *const *>(argv));
+        REQUIRE(passed());
+        char *const envp[] = {const_cast<char *>("PATH=/usr/bin"), nullptr};
+        execve("ld", const_cast<char *const *>(argv), envp);
+        REQUIRE(passed());
+      }
+
+      g_own_envs[exeptor_var_index(entry.c_str())] = nullptr;
+      g_phase_off = false;
+      g_phase_decided = false;
+      real_execv = nullptr;
+      real_execve = nullptr;
+      exeptor_initialized = false;
+    }
+
+    WHEN("libexeptor gets loaded to process of a build with phases") {
+      SnapshotSource source;
+      memset(&source, 0, sizeof(source));
+      source.path_hash = snapshot_hash("/etc/libexeptor.yaml");
+      std::vector<char> bytes;
+      REQUIRE(settings.build_snapshot(source, bytes));
+      ConfigSnapshot inherited;
+      REQUIRE(inherited.attach(bytes.data(), bytes.size()));
+      int fd = publish_snapshot(inherited);
+      REQUIRE(fd >= 0);
+
+      setenv("EXEPTOR_SNAPSHOT_FD", std::to_string(fd).c_str(), 1);
+      unsetenv("EXEPTOR_CONFIG");
+      setenv(EXEPTOR_PHASE, "on", 1);
+      char **saved_argv = g_argv;
+      char *argv[] = {const_cast<char *>("/usr/bin/make"),
+                      const_cast<char *>("check"), nullptr};
+      take_phase(2, argv, environ);
+
+      THEN("phase should be decided by its own argv") {
+        REQUIRE(g_phase_decided);
+        REQUIRE(g_phase_off);
+      }
+
+      THEN("environ should pass decision to children spawned without hooks") {
+        REQUIRE(std::string("off") == getenv(EXEPTOR_PHASE));
+      }
+
+      THEN("inherited snapshot should be kept for initialization") {
+        REQUIRE(g_early_snapshot != nullptr);
+        REQUIRE(g_early_snapshot_size == inherited.size());
+      }
+
+      if (g_early_snapshot) {
+        munmap(const_cast<void *>(g_early_snapshot), g_early_snapshot_size);
+      }
+      g_early_snapshot = nullptr;
+      g_early_snapshot_size = 0;
+      g_argv = saved_argv;
+      g_phase_off = false;
+      g_phase_decided = false;
+      forget_own_envs();
+      unsetenv(EXEPTOR_PHASE);
+      unsetenv("EXEPTOR_SNAPSHOT_FD");
+      close(fd);
+    }
+  }
+}
+
+SCENARIO("log records should be appended with one write each", "[log]") {
+  GIVEN("logging is off") {
+    logpath = nullptr;
+    int evaluated = 0;
+    logprintf("%d\n", ++evaluated);
+
+    THEN("record should not even be formatted") { REQUIRE(evaluated == 0); }
+  }
+
+  GIVEN("log file") {
+    char path[] = "/tmp/exeptor-log-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+    logpath = path;
+    logfd = -1;
+    pid_t init_pid = g_pid;
+    g_pid = getpid();
+
+    auto lines = [&]() {
+      std::vector<std::string> result;
+      FILE *f = fopen(path, "rt");
+      char line[2 * PIPE_BUF];
+      while (f && fgets(line, sizeof(line), f)) {
+        result.push_back(line);
+      }
+      if (f) {
+        fclose(f);
+      }
+      return result;
+    };
+
+    WHEN("records are logged by process and its child") {
+      errno = E2BIG;
+      logprintf("one %s\n", "x");
+      int saved_errno = errno;
+      int parent_fd = logfd;
+      pid_t pid = fork();
+      if (pid == 0) {
+        logprintf("child\n");
+        _exit(logfd == parent_fd ? 0 : 1);
+      }
+      int status = -1;
+      waitpid(pid, &status, 0);
+      logprintf_at("at %s %s:%u: ", "message %d", 2);
+      logprintf("%s\n", std::string(2 * PIPE_BUF, 'a').c_str());
+
+      THEN("each record should be a line of its own") {
+        REQUIRE(saved_errno == E2BIG);
+        REQUIRE(parent_fd >= 0);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+
+        auto log = lines();
+        REQUIRE(log.size() == 4);
+        REQUIRE(log[0] == "one x\n");
+        REQUIRE(log[1] == "child\n");
+        REQUIRE(log[2].find("at ") == 0);
+        REQUIRE(log[2].find(": message 2\n") != std::string::npos);
+        REQUIRE(log[3].size() == PIPE_BUF - 1);
+        REQUIRE(log[3].back() == '\n');
+      }
+    }
+
+    WHEN("vfork child logs before its parent") {
+      pid_t pid = vfork();
+      if (pid == 0) {
+        logprintf("vfork child\n");
+        _exit(0);
+      }
+      int status = -1;
+      waitpid(pid, &status, 0);
+      int fd_after_child = logfd;
+      logprintf("parent\n");
+
+      THEN("parent should keep descriptor of its own") {
+        REQUIRE(fd_after_child == -1);
+        REQUIRE(logfd >= 0);
+        REQUIRE(fcntl(logfd, F_GETFD) >= 0);
+        REQUIRE(lines() ==
+                std::vector<std::string>{"vfork child\n", "parent\n"});
+      }
+    }
+
+    if (logfd >= 0) {
+      close(logfd);
+    }
+    logfd = -1;
+    g_pid = init_pid;
+    logpath = nullptr;
+    unlink(path);
+  }
+}
+
+#ifdef EXEPTOR_TEST_PLUGIN_PATH
+
+SCENARIO("plugins should rewrite commands of their groups", "[plugin]") {
+  GIVEN("yaml config with plugin in group") {
+    char path[] = "/tmp/exeptor-test-XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+    FILE *f = fopen(path, "wt");
+    REQUIRE(f != nullptr);
+    fputs("target_groups:\n"
+          "  cc:\n"
+          "    plugin: " EXEPTOR_TEST_PLUGIN_PATH "\n"
+          "    add-options: [-g]\n"
+          "    replacements:\n"
+          "      gcc: afl-gcc-fast\n"
+          "  ld:\n"
+          "    replacements:\n"
+          "      ld: ld.lld\n",
+          f);
+    fclose(f);
+
+    ReplacementSettings settings;
+    REQUIRE(settings.parse_from_file(path));
+    unlink(path);
+    REQUIRE(settings.groups[0].plugin == EXEPTOR_TEST_PLUGIN_PATH);
+    REQUIRE(settings.groups[1].plugin.empty());
+    REQUIRE(apply_settings(settings));
+
+    exeptor_initialized = true;
+    g_intercept_allowed = true;
+    g_phase_off = false;
+    logpath = nullptr;
+    real_execve = real_execvpe = fake_execve;
+    REQUIRE(load_plugins(current_snapshot()));
+
+    const char *argv[] = {"gcc", "-O3", "-c", "a.c", nullptr};
+    auto args = const_cast<char *const *>(argv);
+    const char *app_envp[] = {"LANG=C", nullptr};
+    auto envp = const_cast<char *const *>(app_envp);
+    auto list = [](const char *const *l) {
+      return std::vector<std::string>(l, l + list_size(l));
+    };
+
+    WHEN("replaced program of the group is run") {
+      malloc_poisoned = true;
+      poisoned_allocations = 0;
+      execve("gcc", args, envp);
+      malloc_poisoned = false;
+
+      THEN("plugin should edit argv and envp in place") {
+        REQUIRE(poisoned_allocations == 0);
+        REQUIRE(std::string(exec_path) == "afl-gcc-fast");
+        REQUIRE(list(exec_argv) ==
+                std::vector<std::string>{"afl-gcc-fast", "-O1", "-c", "a.c",
+                                         "-g", "-DPLUGIN_GROUP=cc"});
+        auto env = list(exec_envp);
+        REQUIRE(env.front() == "LANG=C");
+        REQUIRE(env.back() == "EXEPTOR_TEST_PLUGIN=1");
+      }
+    }
+
+    WHEN("plugin changes program") {
+      const char *other[] = {"gcc", "--plugin-program", "a.c", nullptr};
+      execve("gcc", const_cast<char *const *>(other), envp);
+
+      THEN("replacement chosen by plugin should run") {
+        REQUIRE(std::string(exec_path) == "plugin-cc");
+        REQUIRE(list(exec_argv) ==
+                std::vector<std::string>{"afl-gcc-fast", "a.c", "-g",
+                                         "-DPLUGIN_GROUP=cc"});
+      }
+    }
+
+    WHEN("program of group without plugin is run") {
+      execve("ld", args, envp);
+
+      THEN("command should be left to options of group") {
+        REQUIRE(std::string(exec_path) == "ld.lld");
+        REQUIRE(list(exec_argv) ==
+                std::vector<std::string>{"ld.lld", "-O3", "-c", "a.c"});
+      }
+    }
+
+    WHEN("caller doesn't pass environment") {
+      ArgList prep_args;
+      args_from_argv_envp(prep_args, argv);
+      const char *prog = "gcc";
+      prep_prog_argv(prog, prep_args);
+
+      THEN("only argv should be given to plugin") {
+        REQUIRE(std::string(prog) == "afl-gcc-fast");
+        REQUIRE(list(prep_args.data()).back() == "-DPLUGIN_GROUP=cc");
+      }
+    }
+
+    real_execve = real_execvpe = nullptr;
+    exeptor_initialized = false;
+  }
+
+  GIVEN("plugin that can't be loaded") {
+    ReplacementSettings settings;
+    auto cc = settings.add_group("cc");
+    settings.programs["gcc"] = {"afl-gcc-fast", cc};
+    settings.groups[cc].plugin = "/nonexistent/exeptor-plugin.so";
+    REQUIRE(apply_settings(settings));
+
+    THEN("loading should fail") {
+      REQUIRE_FALSE(load_plugins(current_snapshot()));
+    }
+
+    THEN("replacements shouldn't need plugins") {
+      g_intercept_allowed = false;
+      REQUIRE(load_plugins(current_snapshot()));
+      g_intercept_allowed = true;
+    }
+  }
+}
+
+#endif
+
+#if defined(EXEPTOR_LIB_PATH) && defined(EXEPTOR_APP_PROXY_PATH)
+
+// files made by scenario get removed even when one of its REQUIREs fails
+struct TempFiles {
+  std::vector<std::string> paths;
+  ~TempFiles() {
+    for (const auto &path : paths) {
+      unlink(path.c_str());
+    }
+  }
+
+  // new empty file, path is mkstemp template
+  std::string make(const char *pattern) {
+    std::string path = pattern;
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+      return "";
+    }
+    close(fd);
+    paths.push_back(path);
+    return path;
+  }
+};
+
+SCENARIO("response files should only reach programs which get them",
+         "[rsp]") {
+  GIVEN("replacement checking who inherits its response file") {
+    TempFiles files;
+    std::string config = files.make("/tmp/exeptor-rsp-XXXXXX");
+    std::string script = files.make("/tmp/exeptor-rsp-cc-XXXXXX");
+    std::string rsp = files.make("/tmp/exeptor-rsp-args-XXXXXX");
+    REQUIRE(!config.empty());
+    REQUIRE(!script.empty());
+    REQUIRE(!rsp.empty());
+    files.paths.push_back(config + EXEPTOR_SNAPSHOT_SUFFIX);
+
+    // exit status: 3 if replacement has no response file, 4 if its child
+    // (grandchild of the one calling exec) inherited it
+    FILE *f = fopen(script.c_str(), "wt");
+    REQUIRE(f != nullptr);
+    fputs("#!/bin/sh\n"
+          "fd=${1#@/proc/self/fd/}\n"
+          "[ -e /proc/$$/fd/$fd ] || exit 3\n"
+          "grep -q -- -O2 /proc/$$/fd/$fd || exit 3\n"
+          "ls /proc/self/fd/$fd > /dev/null 2>&1 && exit 4\n"
+          "exit 0\n",
+          f);
+    fclose(f);
+    REQUIRE(chmod(script.c_str(), 0755) == 0);
+
+    f = fopen(rsp.c_str(), "wt");
+    REQUIRE(f != nullptr);
+    fputs("-Werror -O2\n", f);
+    fclose(f);
+
+    f = fopen(config.c_str(), "wt");
+    REQUIRE(f != nullptr);
+    fprintf(f,
+            "target_groups:\n"
+            "  t:\n"
+            "    del-options: [\"-Werror\"]\n"
+            "    replacements:\n"
+            "      /bin/echo: %s\n",
+            script.c_str());
+    fclose(f);
+
+    WHEN("replaced program gets rewritten response file") {
+      std::string cmd = "/usr/bin/env -i PATH=/usr/bin:/bin EXEPTOR_CONFIG=" +
+                        config + " LD_PRELOAD=" EXEPTOR_LIB_PATH
+                        " " EXEPTOR_APP_PROXY_PATH " /bin/echo @" +
+                        rsp + " > /dev/null 2>&1";
+      int status = system(cmd.c_str());
+
+      THEN("replacement should read it but its children should not get it") {
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+      }
+    }
+  }
+}
+
+SCENARIO("build phase should be taken from ancestors", "[phase]") {
+  GIVEN("config switching replacements off below marked shell") {
+    TempFiles files;
+    std::string path = files.make("/tmp/exeptor-phase-XXXXXX");
+    REQUIRE(!path.empty());
+    files.paths.push_back(path + EXEPTOR_SNAPSHOT_SUFFIX);
+    FILE *f = fopen(path.c_str(), "wt");
+    REQUIRE(f != nullptr);
+    fputs("phases:\n"
+          "  off: [\"sh exeptor-phase-off\", \"awk exeptor-phase-off\"]\n"
+          "target_groups:\n"
+          "  t:\n"
+          "    replacements:\n"
+          "      /bin/false: /bin/true\n",
+          f);
+    fclose(f);
+
+    // exit status tells whether /bin/false got replaced, unless other
+    // program and redirection are given
+    auto run = [&](const std::string &env, const char *shell_arg,
+                   const char *program = "/bin/false",
+                   const char *redirect = " > /dev/null 2>&1") {
+      // other tests leave environment cleared or full of exeptor variables
+      std::string cmd = "/usr/bin/env -i PATH=/usr/bin:/bin " + env +
+                        " EXEPTOR_CONFIG=" + path +
+                        " sh -c 'LD_PRELOAD=" EXEPTOR_LIB_PATH
+                        " " EXEPTOR_APP_PROXY_PATH " " +
+                        program + "' " + shell_arg + redirect;
+      return system(cmd.c_str()) == 0;
+    };
+
+    THEN("replacements should be on elsewhere") {
+      REQUIRE(run("", "exeptor-phase-on"));
+    }
+
+    THEN("replacements should be off below matching ancestor") {
+      REQUIRE_FALSE(run("", "exeptor-phase-off"));
+    }
+
+    THEN("marker of parent should be trusted") {
+      REQUIRE_FALSE(run("EXEPTOR_PHASE=off", "exeptor-phase-on"));
+      REQUIRE(run("EXEPTOR_PHASE=on", "exeptor-phase-off"));
+    }
+
+    THEN("decision should be passed on to children") {
+      REQUIRE(run("", "exeptor-phase-off", "/usr/bin/env",
+                  " 2>/dev/null | /usr/bin/env PATH=/usr/bin:/bin"
+                  " grep -qx EXEPTOR_PHASE=off"));
+    }
+
+    THEN("decision should reach children spawned without hooks") {
+      // awk matches the rule by itself and runs env through system()
+      REQUIRE(run("", "exeptor-phase-on",
+                  "/usr/bin/awk \"BEGIN { system(\\\"/usr/bin/env\\\") }\""
+                  " exeptor-phase-off",
+                  " 2>/dev/null | /usr/bin/env PATH=/usr/bin:/bin"
+                  " grep -qx EXEPTOR_PHASE=off"));
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+
+file    :  test/test_plugin.cpp
+repo    :  https://github.com/fuzzah/exeptor
+author  :  https://github.com/fuzzah
+license :  MIT
+check repository for more information
+
+plugin for tests: -O3 becomes -O1, --plugin-program gets dropped and makes
+replacement 'plugin-cc', group name is appended as -DPLUGIN_GROUP=<name> and
+environment gets EXEPTOR_TEST_PLUGIN=1
+
+*/
+
+#include <cstdio>
+#include <cstring>
+
+#include "exeptor-plugin.h"
+
+extern "C" __attribute__((visibility("default"))) void
+exeptor_plugin_rewrite(exeptor_plugin_call *call) {
+  if (call->api != EXEPTOR_PLUGIN_API) {
+    return;
+  }
+
+  auto &argv = call->argv;
+  size_t kept = 0;
+  for (size_t i = 0; i < argv.size; i++) {
+    if (strcmp(argv.items[i], "--plugin-program") == 0) {
+      call->program = "plugin-cc";
+      continue;
+    }
+    argv.items[kept++] =
+        strcmp(argv.items[i], "-O3") == 0 ? "-O1" : argv.items[i];
+  }
+  argv.size = kept;
+
+  int n = snprintf(call->scratch, call->scratch_size, "-DPLUGIN_GROUP=%s",
+                   call->group);
+  if (n > 0 && static_cast<size_t>(n) < call->scratch_size &&
+      argv.size < argv.capacity) {
+    argv.items[argv.size++] = call->scratch;
+  }
+
+  auto &envp = call->envp;
+  if (envp.items && envp.size < envp.capacity) {
+    envp.items[envp.size++] = "EXEPTOR_TEST_PLUGIN=1";
+  }
+}